@@ -0,0 +1,207 @@
+/*
+ * Compares cubic2quad_batch() against converting one cubic at a time with
+ * cubic2quad(), which is what glyph loading did before, and checks that both
+ * give the same quadratics.
+ *
+ * Usage: bench_cubic2quad [font file]...
+ *
+ * Cubics come from every glyph of the fonts, LiberationSans by default.
+ * TrueType fonts only have quadratics, so those are raised to cubics and
+ * given a slight bend (the same every run) to have something to convert.
+ * CFF/OpenType fonts are used as they are. Results are printed as one JSON
+ * object per line.
+ */
+
+#include "cubic2quad.hpp"
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_OUTLINE_H
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Cubics of one glyph, converted together like GetBeziersForOutline() does
+struct GlyphCubics
+{
+	std::vector<double> cubics; // 8 doubles each
+	double precision;
+};
+
+struct CollectState
+{
+	std::vector<double> *cubics;
+	FT_Vector prev;
+	uint32_t random;
+};
+
+static int collectMoveTo(const FT_Vector *to, void *user)
+{
+	CollectState *state = static_cast<CollectState *>(user);
+	state->prev = *to;
+	return 0;
+}
+
+static int collectLineTo(const FT_Vector *to, void *user)
+{
+	CollectState *state = static_cast<CollectState *>(user);
+	state->prev = *to;
+	return 0;
+}
+
+static int collectCubicTo(const FT_Vector *c1, const FT_Vector *c2, const FT_Vector *to, void *user)
+{
+	CollectState *state = static_cast<CollectState *>(user);
+	double in[8] = {
+		(double)state->prev.x, (double)state->prev.y,
+		(double)c1->x, (double)c1->y,
+		(double)c2->x, (double)c2->y,
+		(double)to->x, (double)to->y,
+	};
+	state->cubics->insert(state->cubics->end(), in, in + 8);
+	state->prev = *to;
+	return 0;
+}
+
+// Raises the quadratic to a cubic, then moves its controls by up to a fifth
+// of the curve's length
+static int collectConicTo(const FT_Vector *c, const FT_Vector *to, void *user)
+{
+	CollectState *state = static_cast<CollectState *>(user);
+	FT_Vector p = state->prev;
+	double len = std::abs(to->x - p.x) + std::abs(to->y - p.y);
+	auto jitter = [&]() {
+		state->random = state->random * 1664525 + 1013904223; // LCG
+		return ((state->random >> 8) / (double)(1 << 24) - 0.5) * 0.4 * len;
+	};
+
+	FT_Vector c1, c2;
+	c1.x = p.x + (c->x - p.x) * 2 / 3 + jitter();
+	c1.y = p.y + (c->y - p.y) * 2 / 3 + jitter();
+	c2.x = to->x + (c->x - to->x) * 2 / 3 + jitter();
+	c2.y = to->y + (c->y - to->y) * 2 / 3 + jitter();
+	return collectCubicTo(&c1, &c2, to, user);
+}
+
+static bool loadFont(FT_Library ft, const char *path, std::vector<GlyphCubics> &glyphs)
+{
+	FT_Face face;
+	if (FT_New_Face(ft, path, 0, &face)) {
+		return false;
+	}
+
+	FT_Outline_Funcs funcs{};
+	funcs.move_to = collectMoveTo;
+	funcs.line_to = collectLineTo;
+	funcs.conic_to = collectConicTo;
+	funcs.cubic_to = collectCubicTo;
+
+	CollectState state{};
+	state.random = 1;
+	for (FT_Long i = 0; i < face->num_glyphs; i++) {
+		if (FT_Load_Glyph(face, i, FT_LOAD_NO_SCALE) || face->glyph->format != FT_GLYPH_FORMAT_OUTLINE) {
+			continue;
+		}
+		FT_Outline *outline = &face->glyph->outline;
+		GlyphCubics glyph;
+		state.cubics = &glyph.cubics;
+		FT_Outline_Decompose(outline, &funcs, &state);
+		if (glyph.cubics.empty()) {
+			continue;
+		}
+
+		// Same as GetBeziersForOutline()
+		FT_BBox cbox;
+		FT_Outline_Get_CBox(outline, &cbox);
+		FT_Pos width = cbox.xMax - cbox.xMin;
+		FT_Pos height = cbox.yMax - cbox.yMin;
+		glyph.precision = std::max((int)(((width + height) / 2) * 0.05), 1);
+		glyphs.push_back(glyph);
+	}
+
+	FT_Done_Face(face);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<const char *> fontPaths;
+	for (int i = 1; i < argc; i++) {
+		fontPaths.push_back(argv[i]);
+	}
+	if (fontPaths.empty()) {
+		fontPaths.push_back("fonts/LiberationSans-Regular.ttf");
+		fontPaths.push_back("fonts/LiberationSans-Bold.ttf");
+	}
+
+	FT_Library ft;
+	if (FT_Init_FreeType(&ft)) {
+		std::cerr << "Failed to load freetype\n";
+		return 1;
+	}
+	std::vector<GlyphCubics> glyphs;
+	size_t numCubics = 0;
+	for (size_t i = 0; i < fontPaths.size(); i++) {
+		if (!loadFont(ft, fontPaths[i], glyphs)) {
+			std::cerr << "Failed to load font " << fontPaths[i] << "\n";
+			return 1;
+		}
+	}
+	FT_Done_FreeType(ft);
+	for (size_t i = 0; i < glyphs.size(); i++) {
+		numCubics += glyphs[i].cubics.size() / 8;
+	}
+
+	// Both results are kept for comparing afterwards
+	std::vector<double> scalarOut, batchOut;
+	std::vector<double> out;
+	std::vector<int> counts;
+	size_t numScalarQuads = 0, numBatchQuads = 0;
+	const int kRounds = 5;
+	double scalarSec = 1e9, batchSec = 1e9;
+
+	for (int round = 0; round < kRounds; round++) {
+		scalarOut.clear();
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < glyphs.size(); i++) {
+			const GlyphCubics &g = glyphs[i];
+			double quads[C2Q_OUT_LEN];
+			for (size_t j = 0; j < g.cubics.size(); j += 8) {
+				int n = cubic2quad(&g.cubics[j], g.precision, quads);
+				scalarOut.insert(scalarOut.end(), quads, quads + n * 6);
+			}
+		}
+		auto end = std::chrono::steady_clock::now();
+		scalarSec = std::min(scalarSec, std::chrono::duration<double>(end - start).count());
+		numScalarQuads = scalarOut.size() / 6;
+
+		batchOut.clear();
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < glyphs.size(); i++) {
+			const GlyphCubics &g = glyphs[i];
+			int n = g.cubics.size() / 8;
+			out.resize(n * C2Q_OUT_LEN);
+			counts.resize(n);
+			int nq = cubic2quad_batch(&g.cubics[0], n, g.precision, &out[0], &counts[0]);
+			batchOut.insert(batchOut.end(), out.begin(), out.begin() + nq * 6);
+		}
+		end = std::chrono::steady_clock::now();
+		batchSec = std::min(batchSec, std::chrono::duration<double>(end - start).count());
+		numBatchQuads = batchOut.size() / 6;
+	}
+
+	bool same = scalarOut.size() == batchOut.size()
+		&& memcmp(&scalarOut[0], &batchOut[0], scalarOut.size() * sizeof(double)) == 0;
+
+	std::cout << "{\"bench\": \"cubic2quad\", \"path\": \"scalar\", \"cubics\": " << numCubics
+		<< ", \"quads\": " << numScalarQuads
+		<< ", \"ns_per_cubic\": " << scalarSec * 1e9 / numCubics << "}\n";
+	std::cout << "{\"bench\": \"cubic2quad\", \"path\": \"batch\", \"cubics\": " << numCubics
+		<< ", \"quads\": " << numBatchQuads
+		<< ", \"ns_per_cubic\": " << batchSec * 1e9 / numCubics
+		<< ", \"speedup\": " << scalarSec / batchSec
+		<< ", \"same_output\": " << (same ? "true" : "false") << "}\n";
+	return same ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+/*
+ * Times each stage of preparing glyphs, without GL: loading outlines into
+ * beziers with GetBeziersForOutline(), building their grids with
+ * VGrid::Build(), writing the grids into an atlas with
+ * VGridAtlas::WriteVGridAt(), and prepare_glyph() as a whole, which
+ * includes searching for the right grid size, both on one thread and
+ * spread over every core with prepare_glyphs().
+ *
+ * Usage: bench_glyph_prep [font file]...
+ *
+ * Every codepoint in each font's charmap is prepared, with the same limits
+ * GLFontManager uses. Fonts default to LiberationSans; pass a CJK font too
+ * to see how the stages scale with many complex glyphs. Each stage is run
+ * a few times and the fastest is reported. Results are printed as one JSON
+ * object per line.
+ */
+
+#include "glyph_loader.hpp"
+#include "outline.hpp"
+#include "skyline_packer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Same as GLFontManager's
+static const uint8_t kGridMaxSize = 20;
+static const uint8_t kAtlasChannels = 4;
+static const uint16_t kGridAtlasSize = 1024;
+
+static const int kRounds = 5;
+
+struct BenchGlyph
+{
+	uint32_t point;
+	Vec2 size;
+	std::vector<Bezier2> curves;
+	int gridWidth, gridHeight; // As picked by prepare_glyph()
+};
+
+// Runs f() kRounds times and returns the fastest, in seconds
+template <class F>
+static double fastest(F f)
+{
+	double best = 1e9;
+	for (int round = 0; round < kRounds; round++) {
+		auto start = std::chrono::steady_clock::now();
+		f();
+		auto end = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double>(end - start).count());
+	}
+	return best;
+}
+
+static void printStage(const std::string &font, const char *stage, size_t glyphs, double sec)
+{
+	std::cout << "{\"bench\": \"glyph_prep\", \"font\": \"" << font
+		<< "\", \"stage\": \"" << stage
+		<< "\", \"glyphs\": " << glyphs
+		<< ", \"ms\": " << sec * 1e3
+		<< ", \"ns_per_glyph\": " << (glyphs ? sec * 1e9 / glyphs : 0) << "}\n";
+}
+
+static bool benchFont(FT_Library ft, const std::string &path)
+{
+	FT_Face face;
+	if (FT_New_Face(ft, path.c_str(), 0, &face)) {
+		return false;
+	}
+
+	// Find every glyph with an outline, and the grid prepare_glyph() gives it
+	std::vector<BenchGlyph> glyphs;
+	std::vector<uint32_t> points;
+	PreparedGlyph prepared;
+	FT_UInt index;
+	for (FT_ULong point = FT_Get_First_Char(face, &index); index != 0; point = FT_Get_Next_Char(face, point, &index)) {
+		points.push_back(point);
+		if (!prepare_glyph(face, point, kGridMaxSize, kAtlasChannels, prepared) || prepared.curves.empty()) {
+			continue;
+		}
+		BenchGlyph glyph;
+		glyph.point = point;
+		glyph.size = Vec2(prepared.metrics.width, prepared.metrics.height);
+		glyph.curves = prepared.curves;
+		glyph.gridWidth = prepared.grid.width;
+		glyph.gridHeight = prepared.grid.height;
+		glyphs.push_back(glyph);
+	}
+
+	double sec = fastest([&]() {
+		for (size_t i = 0; i < glyphs.size(); i++) {
+			FT_Load_Glyph(face, FT_Get_Char_Index(face, glyphs[i].point), FT_LOAD_NO_SCALE);
+			GetBeziersForOutline(&face->glyph->outline, glyphs[i].curves);
+		}
+	});
+	printStage(path, "outline", glyphs.size(), sec);
+
+	// Grids are kept for writing them out next
+	std::vector<VGrid> grids(glyphs.size());
+	sec = fastest([&]() {
+		for (size_t i = 0; i < glyphs.size(); i++) {
+			grids[i].Build(glyphs[i].curves, glyphs[i].size, glyphs[i].gridWidth, glyphs[i].gridHeight);
+		}
+	});
+	printStage(path, "vgrid", glyphs.size(), sec);
+
+	std::vector<uint16_t> atlasData(kGridAtlasSize * kGridAtlasSize * kAtlasChannels);
+	std::vector<uint8_t> overflow;
+	VGridAtlas atlas{};
+	atlas.data = &atlasData[0];
+	atlas.width = kGridAtlasSize;
+	atlas.height = kGridAtlasSize;
+	atlas.depth = kAtlasChannels;
+	sec = fastest([&]() {
+		SkylinePacker packer(kGridAtlasSize, kGridAtlasSize);
+		for (size_t i = 0; i < glyphs.size(); i++) {
+			uint16_t x, y;
+			if (!packer.Pack(grids[i].width, grids[i].height, x, y)) {
+				// Start over on the same atlas, as if it were a new one
+				packer = SkylinePacker(kGridAtlasSize, kGridAtlasSize);
+				packer.Pack(grids[i].width, grids[i].height, x, y);
+			}
+			overflow.resize(atlas.OverflowSize(grids[i]) * kAtlasChannels);
+			atlas.WriteVGridAt(grids[i], x, y, overflow.empty() ? nullptr : &overflow[0], 0);
+		}
+	});
+	printStage(path, "write", glyphs.size(), sec);
+
+	// Includes glyphs without outlines, like spaces, since those are
+	// prepared too
+	sec = fastest([&]() {
+		for (size_t i = 0; i < points.size(); i++) {
+			prepare_glyph(face, points[i], kGridMaxSize, kAtlasChannels, prepared);
+		}
+	});
+	printStage(path, "prepare", points.size(), sec);
+
+	std::shared_ptr<FontFile> file = FontFile::Map(path);
+	if (file) {
+		std::vector<PreparedGlyph> out;
+		std::vector<uint8_t> loaded;
+		unsigned numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		sec = fastest([&]() {
+			prepare_glyphs(file, 0, points, numThreads, kGridMaxSize, kAtlasChannels, out, loaded);
+		});
+		printStage(path, "prepare_parallel", points.size(), sec);
+	}
+
+	FT_Done_Face(face);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<std::string> fontPaths;
+	for (int i = 1; i < argc; i++) {
+		fontPaths.push_back(argv[i]);
+	}
+	if (fontPaths.empty()) {
+		fontPaths.push_back("fonts/LiberationSans-Regular.ttf");
+		fontPaths.push_back("fonts/LiberationSans-Bold.ttf");
+	}
+
+	FT_Library ft;
+	if (FT_Init_FreeType(&ft)) {
+		std::cerr << "Failed to load freetype\n";
+		return 1;
+	}
+	for (size_t i = 0; i < fontPaths.size(); i++) {
+		if (!benchFont(ft, fontPaths[i])) {
+			std::cerr << "Failed to load font " << fontPaths[i] << "\n";
+			FT_Done_FreeType(ft);
+			return 1;
+		}
+	}
+	FT_Done_FreeType(ft);
+	return 0;
+}
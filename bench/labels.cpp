@@ -0,0 +1,251 @@
+/*
+ * Times editing and drawing labels: InsertText() and RemoveText() latency
+ * for labels of various lengths, then the GPU time of drawing N labels of
+ * M glyphs each, measured with timer queries, both with GLLabel::Render()
+ * and with a GLLabelBatch.
+ *
+ * Usage: bench_labels [font file]
+ *
+ * Uses the default font if none is given. Drawing goes to an offscreen
+ * framebuffer of a hidden window, so nothing shows up on screen and the
+ * results don't depend on the window system. Results are printed as one
+ * JSON object per line.
+ */
+
+#include <gllabel.hpp>
+#include <glfw3.h>
+#include <glm/gtx/transform.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+static const int kFramebufferWidth = 1280;
+static const int kFramebufferHeight = 720;
+static const size_t kLineLength = 64;
+
+static const int kEdits = 200;
+static const int kWarmupFrames = 10;
+static const int kFrames = 100;
+
+struct Percentiles
+{
+	double median, p99, mean;
+};
+
+static Percentiles percentiles(std::vector<double> samples)
+{
+	std::sort(samples.begin(), samples.end());
+	Percentiles p{};
+	if (samples.empty()) {
+		return p;
+	}
+	p.median = samples[samples.size() / 2];
+	p.p99 = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+	for (size_t i = 0; i < samples.size(); i++) {
+		p.mean += samples[i];
+	}
+	p.mean /= samples.size();
+	return p;
+}
+
+// Printable ASCII, broken into lines of kLineLength
+static std::u32string makeText(size_t length)
+{
+	std::u32string text;
+	for (size_t i = 0; i < length; i++) {
+		text += ((i + 1) % (kLineLength + 1) == 0) ? U'\n' : (char32_t)(U'!' + i % 94);
+	}
+	return text;
+}
+
+static double elapsedUs(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void benchEdits(FT_Face face)
+{
+	const size_t lengths[] = {100, 1000, 10000, 100000};
+	glm::vec4 color(0, 0, 0, 1);
+	for (size_t length : lengths) {
+		GLLabel label;
+		label.SetText(makeText(length), color, face);
+
+		// Same positions every run
+		uint32_t random = 1;
+		std::vector<double> insertUs, removeUs;
+		for (int i = 0; i < kEdits; i++) {
+			random = random * 1664525 + 1013904223; // LCG
+			size_t index = (random >> 8) % length;
+
+			auto start = std::chrono::steady_clock::now();
+			label.InsertText(U"x", index, color, face);
+			insertUs.push_back(elapsedUs(start));
+
+			start = std::chrono::steady_clock::now();
+			label.RemoveText(index, 1);
+			removeUs.push_back(elapsedUs(start));
+		}
+
+		const char *ops[] = {"insert", "remove"};
+		Percentiles results[] = {percentiles(insertUs), percentiles(removeUs)};
+		for (int i = 0; i < 2; i++) {
+			std::cout << "{\"bench\": \"label_edit\", \"op\": \"" << ops[i]
+				<< "\", \"length\": " << length
+				<< ", \"median_us\": " << results[i].median
+				<< ", \"p99_us\": " << results[i].p99
+				<< ", \"mean_us\": " << results[i].mean << "}\n";
+		}
+	}
+}
+
+// Draws `numLabels` labels of `numGlyphs` glyphs, laid out in a grid over
+// the framebuffer, and prints the GPU and CPU time per frame
+static void benchFrames(FT_Face face, size_t numLabels, size_t numGlyphs, bool batched)
+{
+	std::vector<std::unique_ptr<GLLabel>> labels;
+	std::vector<glm::mat4> transforms;
+	size_t columns = (size_t)std::ceil(std::sqrt((double)numLabels));
+	size_t lines = (numGlyphs + kLineLength - 1) / kLineLength;
+	std::u32string text = makeText(numGlyphs + lines - 1);
+	for (size_t i = 0; i < numLabels; i++) {
+		labels.emplace_back(new GLLabel());
+		labels.back()->SetText(text, glm::vec4(0, 0, 0, 1), face);
+
+		// Fit each label to its cell, assuming glyphs are about half an em
+		// wide and lines an em apart
+		float cellSize = 2.0f / columns;
+		float emUnits = face->units_per_EM;
+		float scale = cellSize / (std::max(kLineLength / 2.0f, (float)lines) * emUnits);
+		glm::mat4 m(1.0);
+		m = glm::translate(m, glm::vec3(-1 + (i % columns) * cellSize, 1 - (i / columns) * cellSize, 0));
+		m = glm::scale(m, glm::vec3(scale * kFramebufferHeight / kFramebufferWidth, scale, 1));
+		transforms.push_back(m);
+	}
+
+	GLLabelBatch batch;
+	std::vector<GLuint> queries(kFrames);
+	glGenQueries(kFrames, &queries[0]);
+	std::vector<double> cpuMs;
+	for (int frame = 0; frame < kWarmupFrames + kFrames; frame++) {
+		int measured = frame - kWarmupFrames;
+		glClear(GL_COLOR_BUFFER_BIT);
+		auto start = std::chrono::steady_clock::now();
+		if (measured >= 0) {
+			glBeginQuery(GL_TIME_ELAPSED, queries[measured]);
+		}
+
+		float time = frame / 60.0f;
+		for (size_t i = 0; i < labels.size(); i++) {
+			if (batched) {
+				batch.Add(labels[i].get(), transforms[i]);
+			}
+			else {
+				labels[i]->Render(time, transforms[i]);
+			}
+		}
+		if (batched) {
+			batch.Render(time);
+		}
+
+		if (measured >= 0) {
+			glEndQuery(GL_TIME_ELAPSED);
+		}
+		// Wait for the frame, as a swap would
+		glFinish();
+		if (measured >= 0) {
+			cpuMs.push_back(elapsedUs(start) / 1e3);
+		}
+	}
+
+	std::vector<double> gpuMs;
+	for (int i = 0; i < kFrames; i++) {
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &ns);
+		gpuMs.push_back(ns / 1e6);
+	}
+	glDeleteQueries(kFrames, &queries[0]);
+
+	Percentiles gpu = percentiles(gpuMs);
+	Percentiles cpu = percentiles(cpuMs);
+	std::cout << "{\"bench\": \"frame\", \"path\": \"" << (batched ? "batch" : "labels")
+		<< "\", \"labels\": " << numLabels
+		<< ", \"glyphs_per_label\": " << numGlyphs
+		<< ", \"width\": " << kFramebufferWidth
+		<< ", \"height\": " << kFramebufferHeight
+		<< ", \"gpu_median_ms\": " << gpu.median
+		<< ", \"gpu_p99_ms\": " << gpu.p99
+		<< ", \"cpu_median_ms\": " << cpu.median << "}\n";
+}
+
+int main(int argc, char **argv)
+{
+	if (!glfwInit()) {
+		std::cerr << "Failed to initialize GLFW.\n";
+		return 1;
+	}
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	GLFWwindow *window = glfwCreateWindow(1, 1, "bench_labels", NULL, NULL);
+	if (!window) {
+		std::cerr << "Failed to create GLFW window.\n";
+		glfwTerminate();
+		return 1;
+	}
+	glfwMakeContextCurrent(window);
+	glewExperimental = true;
+	if (glewInit() != GLEW_OK) {
+		std::cerr << "Failed to initialize GLEW.\n";
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return 1;
+	}
+
+	GLuint framebuffer, colorBuffer;
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glGenRenderbuffers(1, &colorBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, kFramebufferWidth, kFramebufferHeight);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+	glViewport(0, 0, kFramebufferWidth, kFramebufferHeight);
+	glClearColor(1, 1, 1, 1);
+
+	int status = 0;
+	{
+		std::shared_ptr<GLFontManager> manager = GLFontManager::GetFontManager();
+		FT_Face face = (argc > 1) ? manager->GetFontFromPath(argv[1]) : manager->GetDefaultFont();
+		if (!face) {
+			std::cerr << "Failed to load font " << (argc > 1 ? argv[1] : "(default)") << "\n";
+			status = 1;
+		}
+		else {
+			// Glyph preparation is timed by bench_glyph_prep, keep it out of these
+			manager->LoadASCII(face);
+			benchEdits(face);
+
+			const size_t numLabels[] = {1, 16, 256};
+			const size_t numGlyphs[] = {100, 1000};
+			for (size_t n : numLabels) {
+				for (size_t m : numGlyphs) {
+					benchFrames(face, n, m, false);
+					benchFrames(face, n, m, true);
+				}
+			}
+		}
+		GLFontManager::singleton = nullptr;
+	}
+
+	glDeleteRenderbuffers(1, &colorBuffer);
+	glDeleteFramebuffers(1, &framebuffer);
+	glfwDestroyWindow(window);
+	glfwTerminate();
+	return status;
+}
@@ -85,6 +85,9 @@ int main()
 	Label->ShowCaret(true);
 
 	std::cout << "Loading font files\n";
+	// Baked by `make fonts/demo.atlas`, otherwise the glyphs are prepared
+	// from the fonts as usual
+	GLFontManager::GetFontManager()->LoadAtlas("fonts/demo.atlas");
 	defaultFace = GLFontManager::GetFontManager()->GetDefaultFont();
 	boldFace = GLFontManager::GetFontManager()->GetFontFromPath("fonts/LiberationSans-Bold.ttf");
 
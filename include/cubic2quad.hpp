@@ -30,4 +30,23 @@
 //     the buffer (total of C2Q_OUT_LEN doubles long) is undefined.
 int cubic2quad(const double in[8], const double precision, double out[C2Q_OUT_LEN]);
 
+// cubic2quad_batch converts many cubics at once, such as all of a glyph's,
+// which is a good deal faster than calling cubic2quad() for each. The
+// quadratics are exactly the same as cubic2quad() would give.
+//
+// Parameters:
+// in: `count` cubics, 8 doubles each, in the same form as for cubic2quad()
+//
+// precision: Same as for cubic2quad(), for all of the cubics
+//
+// out: The output quadratics of every cubic, in order and back to back,
+//     in the same form as for cubic2quad(). Must be at least
+//     (count*C2Q_OUT_LEN*sizeof(double)) bytes long.
+//
+// outCounts: Filled with the number of output quadratics of each cubic.
+//     Must be `count` ints long.
+//
+// Return value: The total number of output quadratics written to `out`.
+int cubic2quad_batch(const double *in, int count, const double precision, double *out, int *outCounts);
+
 #endif // _H_CUBIC2QUAD
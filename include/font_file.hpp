@@ -0,0 +1,42 @@
+#ifndef FONT_FILE_H
+#define FONT_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+// A font file mapped read-only into memory, to open faces over with
+// FT_New_Memory_Face(). The GL thread and every glyph worker open their own
+// faces of the same mapping, instead of each reading the file again.
+// FreeType reads out of the mapping for as long as those faces are open, so
+// whatever opens one keeps the shared_ptr until the face is done.
+class FontFile
+{
+	const uint8_t *data;
+	size_t size;
+	mutable uint64_t hash; // 0 until Hash() is first called
+
+	FontFile(const uint8_t *data, size_t size) : data(data), size(size), hash(0) { }
+
+public:
+	~FontFile();
+	FontFile(const FontFile &) = delete;
+	FontFile & operator=(const FontFile &) = delete;
+
+	// Null if the file can't be opened or mapped
+	static std::shared_ptr<FontFile> Map(const std::string &path);
+
+	// Opens face number `faceIndex` of the file, see FT_New_Memory_Face()
+	FT_Error OpenFace(FT_Library ft, FT_Long faceIndex, FT_Face *face) const;
+
+	size_t Size() const { return size; }
+	// Hash of the whole file, for telling whether it changed since glyphs
+	// were prepared from it. Worked out on first use, which has to be on
+	// the thread that mapped the file.
+	uint64_t Hash() const;
+};
+
+#endif
@@ -1,9 +1,18 @@
 #include <string>
 #include <vector>
 #include <memory>
-#include <map>
+#include <atomic>
 #include <glew.h>
 #include <glm/glm.hpp>
+#include "glyph_cache.hpp"
+#include "skyline_packer.hpp"
+#include "glyph_loader.hpp"
+#include "glyph_store.hpp"
+#include "font_file.hpp"
+#include "render_stats.hpp"
+#include "text_layout.hpp"
+#include <unordered_map>
+#include <unordered_set>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_OUTLINE_H
@@ -11,66 +20,464 @@
 class GLFontManager
 {
 public:
+	// Antialiasing quality of the glyph shader, by how many rays it casts
+	// per pixel: 2, 3 or 4. Auto picks fewer for glyphs that are small on
+	// screen. Each is a separate variant of the shader.
+	enum class Quality
+	{
+		Low,
+		Medium,
+		High,
+		Auto
+	};
+	static const size_t kNumQualities = 4;
+
 	struct AtlasGroup
 	{
-		// Grid atlas contains an array of square grids with side length
-		// gridMaxSize. Each grid takes a single glyph and splits it into
-		// cells that inform the fragment shader which curves of the glyph
-		// intersect that cell. The cell contains coords to data in the bezier
-		// atlas. The bezier atlas contains the actual bezier curves for each
-		// glyph. All data for a single glyph must lie in a single row, although
-		// multiple glyphs can be in one row. Each bezier curve takes three
-		// "RGBA pixels" (12 bytes) of data.
-		// Both atlases also encode some extra information, which is explained
-		// where it is used in the code.
-		GLuint gridAtlasId;
-		uint8_t *gridAtlas;
-		uint16_t nextGridPos[2]; // XY pixel coordinates
+		// Grid atlas contains grids of varying size, placed by gridPacker.
+		// Each grid takes a single glyph and splits it into cells that
+		// inform the fragment shader which curves of the glyph intersect
+		// that cell. Each cell holds up to four 16 bit indices of beziers in
+		// the glyph's data, which contains the actual bezier curves. Each
+		// bezier curve takes three "RGBA pixels" (12 bytes) of glyph data.
+		// Both also encode some extra information, which is explained where
+		// it is used in the code.
+		// On the GPU, each group's grid atlas is one layer of the manager's
+		// grid atlas array texture, so glyphs from every group can be drawn
+		// together.
+		uint16_t *gridAtlas;
+		SkylinePacker gridPacker; // Free space in the grid atlas
 		bool full; // For faster checking
-		bool uploaded;
 
-		GLuint glyphDataBufId, glyphDataBufTexId;
-		uint8_t *glyphDataBuf;
-		uint16_t glyphDataBufOffset; // pixel coordinates
+		// Part of the grid atlas written since it was last uploaded, so
+		// only that needs to be sent to the GPU. Max is exclusive, and the
+		// region is empty when min >= max.
+		uint16_t dirtyGridMin[2], dirtyGridMax[2]; // XY pixel coordinates
 	};
 
 	struct Glyph
 	{
 		uint16_t size[2]; // Width and height in FT units
 		int16_t offset[2]; // Offset of glyph in FT units
-		uint16_t bezierAtlasPos[2]; // XZ pixel coordinates (Z being atlas index)
+		uint32_t glyphDataOffset; // Texel offset of its data in glyphData
+		uint16_t atlasIndex; // Group with its grid, UINT16_MAX if no curves
 		int16_t advance; // Amount to advance after character in FT units
+
+		// Holders of the glyph, see RetainGlyph(), and the residency clock
+		// when it was last looked up or released. Unheld glyphs are evicted
+		// least recently used first.
+		uint32_t refCount;
+		uint32_t faceId; // Face it's from, for kerning against its neighbors
+		uint64_t lastUsed;
+	};
+
+	// How full one atlas group's grid atlas is
+	struct AtlasFill
+	{
+		uint16_t usedHeight; // Rows up to the tallest grid in it
+		float fill; // Fraction of its area under the packer's skyline
+		bool full;
+	};
+
+	// Counters and timings since the manager was created, see GetStats().
+	// Counters are always kept. Timings are only recorded once enabled
+	// with SetTimingsEnabled().
+	struct Stats
+	{
+		GlyphCache<Glyph>::Stats cache;
+		LayoutCache::Stats layoutCache;
+
+		// Glyphs prepared outside the worker threads, by
+		// GetGlyphForCodepoint(), PreloadSet() and the like, and glyphs added
+		// to the atlases by any means, including those prepared on the workers
+		uint64_t glyphsPrepared, glyphsCommitted;
+		// Beziers of the committed glyphs that went into the atlases
+		uint64_t committedBeziers;
+		// Glyphs handed to the worker threads, and those of them or of
+		// PreloadSet()'s that couldn't be prepared or didn't fit, see
+		// RequestGlyphs()
+		uint64_t glyphsQueued, glyphsFailed;
+		// Glyphs taken from the glyph store instead of being prepared, see
+		// Create()
+		uint64_t glyphsShared;
+
+		// Grid cells with more beziers than fit in their texel, which get
+		// an overflow list instead, and cells with more than even those can
+		// hold (VGrid::kCellCapacity), which lose some of their beziers
+		uint64_t overflowCells, truncatedCells;
+
+		// UploadAtlases() calls that sent anything to the GPU, the bytes
+		// they sent, and times they had to reallocate the GPU copies
+		uint64_t uploads, uploadedBytes, reallocations;
+
+		// Glyphs dropped to stay within the memory budget, and the
+		// compactions that dropped them, see SetMemoryBudget()
+		uint64_t evictedGlyphs, compactions;
+
+		// Fill levels, as of the GetStats() call
+		std::vector<AtlasFill> atlases;
+		size_t glyphDataTexels, maxGlyphDataTexels;
+		size_t residentBytes; // Atlases and glyph data, see MemoryUsed()
+
+		// CPU time of each glyph cache miss that prepared the glyph on the
+		// GL thread, and of each UploadAtlases() that sent anything
+		Histogram glyphLoadTime, uploadTime;
+		// GPU time of each GLLabel and GLLabelBatch Render()
+		Histogram renderGpuTime;
 	};
 
 public: // TODO: private
 	std::vector<AtlasGroup> atlases;
-	std::map<FT_Face, std::map<uint32_t, Glyph> > glyphs;
+	GlyphCache<Glyph> glyphs;
+
+	// Index of each face is its id in the glyph cache. Null for faces that
+	// were closed by ReleaseFont(), or not opened yet (see bakedFaces).
+	std::vector<FT_Face> faces;
+	size_t lastFaceId;
+
+	// Where each face came from, by face id. GetFontFromPath() hands out
+	// the same face for the same path and face index, counting the callers,
+	// and ReleaseFont() closes it once every one of them is done. Glyphs can
+	// only be prepared off-thread for faces that have a file.
+	struct FaceSource
+	{
+		std::string path; // Empty if the manager didn't open the face
+		FT_Long index;
+		std::shared_ptr<FontFile> file; // Null while the face isn't open
+		uint32_t refCount;
+		uint32_t storeFontId; // 0 if there's no store, or no file
+	};
+	std::vector<FaceSource> faceSources;
+
+	// Shared with other managers, see Create(). Null if not shared.
+	std::shared_ptr<GlyphStore> store;
+
+	// Worker threads for RequestGlyphs(), created on first use. Each glyph
+	// they are working on maps (by its glyph cache key) to the requests
+	// waiting on it. glyphCommits counts the CommitPreparedGlyphs() calls
+	// that added glyphs, so labels can cheaply tell when to look again.
+	std::unique_ptr<GlyphLoader> loader;
+	std::unordered_map<uint64_t, std::vector<std::shared_ptr<GlyphRequest>>> glyphsInFlight;
+	uint64_t glyphCommits;
+	// Glyphs queued or being prepared on the workers, by face id, and the
+	// faces closed by ReleaseFont() that the workers still have open. Those
+	// are released from the workers once none of their glyphs are left.
+	std::unordered_map<uint32_t, size_t> faceGlyphsInFlight;
+	std::vector<uint32_t> workerFacesToRelease;
+	// Glyphs the workers couldn't prepare, or that didn't fit when committed,
+	// so they aren't queued again on every look. Cleared when compaction
+	// makes room.
+	std::unordered_set<uint64_t> failedGlyphs;
+
+	// Faces of a loaded atlas file (see LoadAtlas()) that haven't been
+	// opened yet, and faces closed by ReleaseFont(). Each already has a face
+	// id, with its path in faceSources but a null entry in faces, which
+	// GetFontFromPath() fills in once it opens the same face again. That
+	// way their glyphs are still found in the glyph cache.
+	struct BakedFace
+	{
+		uint32_t faceId;
+		// To tell whether the font file changed since it was baked
+		FT_Long numGlyphs;
+		FT_UShort unitsPerEM;
+		uint64_t fileSize, fileHash; // See FontFile::Hash()
+	};
+	std::vector<BakedFace> bakedFaces;
+
+	// Layouts of recently inserted text runs, see GetLayout()
+	LayoutCache layouts;
+
+	// Reused by glyphs prepared on this thread, so their curves and grid
+	// don't need fresh allocations every time
+	PreparedGlyph scratchGlyph;
+
+	// See GetStats(). Everything but the snapshot fields is kept up to
+	// date as things happen.
+	Stats stats;
+	bool cpuTimings, gpuTimings;
+
+	// See SetMemoryBudget(). The residency clock ticks once per
+	// UploadAtlases(), for telling how long ago glyphs were used. Compaction
+	// waits until MemoryUsed() is over compactAbove, so a budget that can't
+	// be met doesn't compact on every call. atlasGeneration counts the
+	// compactions, which move glyph data, so labels can tell when to look
+	// up their offsets again.
+	size_t memoryBudget, compactAbove;
+	uint64_t residencyClock;
+	uint64_t atlasGeneration;
+
+	// Fully covered one-cell glyph for drawing rectangles, see GetSolidGlyph()
+	Glyph solidGlyph;
+	bool hasSolidGlyph;
 	FT_Library ft;
 	FT_Face defaultFace;
-	GLuint glyphShader, uGridAtlas, uTransform;
-	GLuint uGlyphData;
 
-	GLFontManager();
+	// The glyph shader compiled for one Quality. All of them start
+	// compiling when the manager is created, but only the ones actually
+	// used are waited on, by FinishGlyphShader(). Drivers with
+	// ARB_parallel_shader_compile compile the rest in the background.
+	struct GlyphShader
+	{
+		GLuint program, uGridAtlas, uTransform;
+		GLuint uGlyphData, uGlyphHeaders, uTransforms, uUseTransforms;
+		GLuint uLineOffsets, uUseLineOffsets, uPalette, uPaletteBases, uUseInstanceSize;
+
+		bool ready; // Linked, with its uniform locations found
+		bool failed; // Didn't compile or link, see UseGlyphShader()
+		bool fromCache; // Linked from a cached program binary
+		GLuint vertexShader, fragmentShader; // 0 once ready, or from cache
+		std::string cachePath; // Its program binary file, empty if none
+
+		// Uniform values last set, which stay with the program
+		bool hasTransform;
+		glm::mat4 transform;
+		GLint useTransforms, useLineOffsets, useInstanceSize; // -1 if unknown
+	};
+	GlyphShader glyphShaders[kNumQualities];
+
+	// Header and beziers of every glyph with curves, back to back, as
+	// RG16UI texels, with each glyph starting on an even one. Unlike grids,
+	// all of it lives in one buffer, which can grow up to
+	// GL_MAX_TEXTURE_BUFFER_SIZE texels. Max is exclusive, and the dirty
+	// range is empty when min >= max.
+	std::vector<uint8_t> glyphData;
+	uint32_t dirtyGlyphDataMin, dirtyGlyphDataMax; // texel offsets
+
+	// GPU copies of every atlas group and the glyph data. gridAtlasLayers
+	// is how many groups the array texture currently has room for, and
+	// glyphDataCapacity how many texels the glyph data buffer does.
+	// glyphHeaderBufTexId is a second, RGBA16UI view of the glyph data, for
+	// reading headers in two fetches.
+	GLuint gridAtlasId, glyphDataBufId, glyphDataBufTexId, glyphHeaderBufTexId;
+	size_t gridAtlasLayers;
+	GLint maxGridAtlasLayers;
+	size_t glyphDataCapacity;
+	size_t maxGlyphDataSize;
+	size_t maxTextureBufferSize; // GL_MAX_TEXTURE_BUFFER_SIZE, in texels
+
+	// Pixel unpack buffer that atlas updates are copied through. It is
+	// handed out as a ring, see MapStagingRange().
+	GLuint stagingBufId;
+	size_t stagingBufOffset;
+
+	// GL state last set up for drawing glyphs, so drawing label after label
+	// only has to change what actually differs. See ResetRenderState().
+	struct RenderState
+	{
+		GlyphShader *shader; // Null if unknown
+		bool atlasTextures, blend; // Whether each is known to be set
+		GLuint vertexArray; // 0 if unknown
+		// Buffer textures bound for the shader, 0 if unknown
+		GLuint transformBufTex, lineOffsetBufTex, paletteBufTex, paletteBaseBufTex;
+	};
+	RenderState renderState;
+
+	// Shader for DrawTexture(), and an empty vertex array to draw it with.
+	// Both are only created on first use.
+	GLuint textureProgram;
+	bool textureProgramFailed; // Didn't compile or link, so never drawn with
+	GLuint uTextureTransform, uTextureRect;
+	GLuint textureVertexArray;
+
+	// Directory of cached glyph shader binaries, see SetShaderCacheDir()
+	static std::string shaderCacheDir;
+
+	GLFontManager(std::shared_ptr<GlyphStore> store);
+	void StartGlyphShader(GlyphShader &shader, const char *fragDefines);
+	bool FinishGlyphShader(GlyphShader &shader);
 
 	AtlasGroup * GetOpenAtlasGroup();
+	uint8_t * MapStagingRange(size_t size, size_t *offset);
+	uint32_t GetFaceId(FT_Face face);
+	Glyph * CommitGlyph(uint32_t faceId, uint32_t point, PreparedGlyph &prepared);
+	Glyph * LoadGlyph(FT_Face face, uint32_t faceId, uint32_t point);
+	bool QueueGlyph(uint32_t faceId, uint32_t point, std::shared_ptr<GlyphRequest> request);
+	void ReleaseWorkerFaces();
+	const StoredGlyph * FindStored(uint32_t faceId, uint32_t point);
+	size_t MemoryUsed();
+	void Compact();
 
 public:
 	~GLFontManager();
 
+	// A manager and everything drawn with it belong to one GL context, and
+	// the thread that has it current. This one is what labels and batches
+	// use unless given another, created on first use in whatever context is
+	// current then.
 	static std::shared_ptr<GLFontManager> singleton;
 	static std::shared_ptr<GLFontManager> GetFontManager();
 
-	FT_Face GetFontFromPath(std::string fontPath);
+	// A manager of its own for the GL context current on the calling thread,
+	// for labels and batches drawn in that context. Managers given the same
+	// store only prepare each glyph once between them, whatever thread they
+	// are on, but each packs and uploads its own atlases. The store keeps
+	// every glyph it's given for as long as it lives, whatever the managers'
+	// memory budgets, and assumes font files don't change on disk meanwhile.
+	static std::shared_ptr<GLFontManager> Create(std::shared_ptr<GlyphStore> store = nullptr);
+
+	// Caches the glyph shaders' program binaries in `dir`, keyed by the GL
+	// vendor, renderer and version, and the shader sources. That saves
+	// compiling them on every start. Needs ARB_get_program_binary, and has
+	// to be called before the manager is first created. Off by default.
+	static void SetShaderCacheDir(std::string dir);
+
+	// Opens face number `faceIndex` (for font collections) of a font file,
+	// mapped into memory and shared with the glyph workers. Calls with the
+	// same path and index get the same face, which stays open until each of
+	// them is matched by a ReleaseFont(). Null if the file can't be opened.
+	FT_Face GetFontFromPath(std::string fontPath, FT_Long faceIndex = 0);
+
+	// Looks for an open face whose family name, or family and style name
+	// ("Liberation Sans Bold"), is `fontName`, taking a reference to it like
+	// GetFontFromPath(). There's no lookup of system fonts, so anything
+	// else is taken as a path.
 	FT_Face GetFontFromName(std::string fontName);
+
+	// Drops a reference taken by GetFontFromPath() or GetFontFromName(),
+	// closing the face once none are left. Labels must not use it after
+	// that, but its glyphs stay cached for when it's opened again. The
+	// default font belongs to the manager, and is never closed.
+	void ReleaseFont(FT_Face face);
 	FT_Face GetDefaultFont();
 
+	// Glyphs stay valid until the next UploadAtlases() call that compacts
+	// the atlases, unless they are retained. See SetMemoryBudget().
 	Glyph * GetGlyphForCodepoint(FT_Face face, uint32_t point);
+
+	// Keeps a glyph from being evicted while it's held. Labels hold every
+	// glyph they show. The glyph itself stays where it is, but its
+	// glyphDataOffset and atlasIndex change whenever the atlases are
+	// compacted, which bumps GetAtlasGeneration().
+	void RetainGlyph(Glyph *glyph) { glyph->refCount++; }
+	void ReleaseGlyph(Glyph *glyph) {
+		glyph->refCount--;
+		glyph->lastUsed = residencyClock;
+	}
+	uint64_t GetAtlasGeneration() { return atlasGeneration; }
+
+	// Caps the memory taken by the atlases and glyph data, on the CPU and
+	// again on the GPU, in bytes each. Once over it, UploadAtlases() evicts
+	// the least recently used glyphs nobody retains, then packs the rest
+	// into as few atlas groups as they fit in, and shrinks the GPU copies to
+	// match. That's a full reupload, so leave plenty of room over what the
+	// retained glyphs need. 0, the default, never evicts anything.
+	void SetMemoryBudget(size_t bytes);
+
+	// Lays out a run of text in the face with layout_text(), unless the
+	// same run was laid out recently. Only valid until the next call.
+	const std::vector<LayoutGlyph> & GetLayout(FT_Face face, const std::u32string &text, const LayoutOptions &options = kDefaultLayoutOptions);
+	// Kerning between the characters of two neighboring glyphs. 0 unless
+	// both are of the same face, and it's still open.
+	float GetKerning(const Glyph *left, uint32_t leftPoint, const Glyph *right, uint32_t rightPoint, const LayoutOptions &options);
+
+	// A glyph that covers its whole quad, for selection highlights and the
+	// like. Its size is meant to be set per instance. Null if there's no
+	// room left in the atlases.
+	Glyph * GetSolidGlyph();
+	GlyphCache<Glyph>::Stats GetGlyphCacheStats();
+
+	// Copy of the counters and timings, with the cache stats and fill
+	// levels filled in
+	Stats GetStats();
+	// Off by default. CPU timings cost two clock reads per timed call, GPU
+	// timings a timer query per Render(), whose results are picked up by
+	// later frames without waiting on the GPU. Those can't overlap, so GPU
+	// timings can't be on while rendering inside a GL_TIME_ELAPSED query.
+	void SetTimingsEnabled(bool cpu, bool gpu);
+	bool GPUTimingsEnabled() { return gpuTimings; }
+
+	// Starts preparing glyphs on worker threads and returns right away. The
+	// glyphs are added to the atlases on the GL thread by
+	// CommitPreparedGlyphs(), after which the future becomes ready, so don't
+	// block on it from the GL thread. Faces not opened with
+	// GetFontFromPath() are loaded synchronously instead.
+	std::shared_future<void> RequestGlyphs(FT_Face face, std::u32string codepoints);
+
+	// Returns the glyph if it's loaded. Otherwise queues it like
+	// RequestGlyphs(), sets *pending and returns nullptr. Glyphs that failed
+	// on the worker threads aren't queued again, and give nullptr.
+	Glyph * GetGlyphOrRequest(FT_Face face, uint32_t point, bool *pending);
+	bool IsGlyphPending(FT_Face face, uint32_t point);
+
+	// Adds glyphs finished by the worker threads to the atlases. Called by
+	// UploadAtlases(), so there's normally no need to call it directly.
+	void CommitPreparedGlyphs();
+
+	// Loads every codepoint from first to last inclusive, or in the set,
+	// that the face has a glyph for and isn't loaded yet, then uploads the
+	// atlases. The glyphs are prepared across every core, and then added to
+	// the atlases in codepoint order, so they pack the same every time.
+	// Blocks until it's done, so it's for warming up at startup, say with a
+	// whole CJK charset. Faces not opened with GetFontFromPath() are loaded
+	// on this thread instead.
+	void PreloadRange(FT_Face face, uint32_t first, uint32_t last);
+	void PreloadSet(FT_Face face, std::vector<uint32_t> codepoints);
+	// Codepoint 0 and printable ASCII, with PreloadSet()
 	void LoadASCII(FT_Face face);
 	void UploadAtlases();
 
-	void UseGlyphShader();
+	// Writes every glyph committed so far, along with the atlases and glyph
+	// data they live in, to a file for LoadAtlas(). Only glyphs of faces
+	// opened with GetFontFromPath() are kept, since that's how they are
+	// matched up again. Returns false if the file can't be written.
+	bool SaveAtlas(std::string path);
+
+	// Maps an atlas file written by SaveAtlas() and takes its glyphs as they
+	// are, so they don't have to be prepared from the font again. They are
+	// used by faces GetFontFromPath() opens with the same path afterwards;
+	// any other glyphs are still prepared as usual. Only works before the
+	// first glyph is loaded. Returns false, loading nothing, if the file
+	// can't be read or was baked by an incompatible version.
+	bool LoadAtlas(std::string path);
+
+	// Writes each group's grid atlas to <prefix><group>.bmp, for looking at.
+	// Only the low byte of each 16 bit channel is kept, which is all of the
+	// bezier indices of glyphs with fewer than 256 curves.
+	void WriteAtlasBMPs(std::string prefix);
+
+	// Uses the glyph shader of the given quality, or if that one failed to
+	// build, the best lower quality one that didn't. Returns false if none
+	// did, in which case there is nothing to draw glyphs with.
+	bool UseGlyphShader(Quality quality = Quality::High);
 	void SetShaderTransform(glm::mat4 transform);
-	void UseAtlasTextures(uint16_t atlasIndex);
+	void UseAtlasTextures();
+	void UseBlending();
+	void BindVertexArray(GLuint vertexArrayId);
+
+	// Labels leave their program, vertex array, textures (units 0-4 and 6) and
+	// GL_BLEND enabled after drawing, and skip setting them again while the
+	// manager thinks they're still in place. Call this after changing any of
+	// them between drawing labels.
+	void ResetRenderState();
+
+	// Draws a texture with premultiplied alpha as a quad, over the label
+	// space rect going from its (0, 0) corner at rect.xy to its (1, 1)
+	// corner at rect.zw. See GLLabel::SetCoverageCache(). Leaves the glyph
+	// shader out of use, and the blend function as it was. Returns false,
+	// without changing any of it, if the shader for it didn't build.
+	bool DrawTexture(GLuint texture, glm::mat4 transform, glm::vec4 rect);
+
+	// Makes the glyph shader read a per-vertex transform out of the given
+	// buffer texture (see GLLabelBatch) instead of using uTransform. Pass 0
+	// to go back to uTransform.
+	void UseTransformBuffer(GLuint transformBufTexId);
+
+	// Makes the glyph shader add a per-line offset, read out of the given
+	// buffer texture (see GLLabel::Line), to every instance position. Pass 0
+	// to turn that off again.
+	void UseLineOffsetBuffer(GLuint lineOffsetBufTexId);
+
+	// Makes the glyph shader size each quad from vertex attribute 5, which
+	// only overlays have, instead of from its glyph. Whatever the
+	// attribute's current value is when its array is disabled, text draws
+	// have to turn this off.
+	void UseInstanceSize(bool useInstanceSize);
+
+	// Makes the glyph shader take colors out of the given RGBA8 buffer
+	// texture, see GLLabel::palette. With a transform buffer, each label's
+	// palette starts at the texel that the R32UI paletteBaseBufTexId has for
+	// its transform index (see GLLabelBatch).
+	void UsePaletteBuffer(GLuint paletteBufTexId, GLuint paletteBaseBufTexId = 0);
 };
 
 class GLLabel
@@ -88,61 +495,453 @@ public:
 		uint8_t r,g,b,a;
 	};
 
+	// Entries in a label's palette, see AddColor()
+	static const size_t kPaletteSize = 256;
+
+	using Quality = GLFontManager::Quality;
+
+	// Counters and timings since the label was created, see GetStats()
+	struct Stats
+	{
+		uint64_t renders;
+		size_t glyphs; // Glyph instances drawn by the last Render()
+		// Lines the last Render() left out for being outside the viewport,
+		// and the draw calls taken by what was left
+		size_t culledLines, drawRanges;
+		// Times the text was rendered into the coverage cache, and
+		// Render()s that drew it from there, see SetCoverageCache()
+		uint64_t coverageCacheUpdates, coverageCacheDraws;
+		// Instance, overlay and line offset data sent to the GPU, and times
+		// the whole instance buffer had to be sent again
+		uint64_t uploadedBytes, reuploads;
+		// GPU time of each Render(), if enabled with
+		// GLFontManager::SetTimingsEnabled()
+		Histogram renderGpuTime;
+	};
+
 private:
-	struct GlyphVertex
+	friend class GLLabelBatch;
+
+	static const uint32_t kLineIdMask = 0xFFFFFF;
+
+	// One per character. The vertex shader expands each into the glyph's
+	// quad, reading the glyph's size from its data.
+	struct GlyphInstance
 	{
-		// XY coords of the vertex
+		// XY coords of the bottom-left of the glyph's quad, relative to the
+		// start of its line. For characters without a glyph, this is where
+		// the next character starts instead.
 		glm::vec2 pos;
 
-		// Bit 0 (low) is norm coord X (varies per vertex)
-		// Bit 1 is norm coord Y (varies per vertex)
-		// Bits 2-31 are texel offset (byte offset / 4) into
-		//   glyphDataBuf (same for all verticies of a glyph)
-		uint32_t data;
+		// Texel offset (byte offset / 4) into the manager's glyphData
+		uint32_t glyphDataOffset;
+
+		// Id of the line, which indexes lineOffsets, in the low 24 bits, and
+		// the glyph's color, as an index into the palette, in the high 8
+		uint32_t lineAndColor;
+
+		uint32_t LineId() const { return lineAndColor & kLineIdMask; }
+		uint8_t ColorIndex() const { return lineAndColor >> 24; }
+		void SetLineId(uint32_t id) { lineAndColor = (lineAndColor & ~kLineIdMask) | id; }
+		void SetColorIndex(uint8_t color) { lineAndColor = (lineAndColor & kLineIdMask) | (uint32_t)color << 24; }
+	};
+
+	// Text is stored line by line, so an edit only has to lay out and
+	// upload the lines it touches. Every line but the last ends with its
+	// '\n'. Each of the arrays store the same "set" of data, but different
+	// versions of it. Consequently, each of these will be exactly the same
+	// length. Can't put them all into one array, because instances is
+	// needed alone as a buffer to upload to the GPU, and text is needed alone
+	// mostly for GetText.
+	struct Line
+	{
+		std::u32string text;
+		std::vector<GlyphInstance> instances;
+		std::vector<GLFontManager::Glyph *> glyphs;
+		// Kerning between each character and the next, in FT units. The
+		// same length as the others too, with 0 for the last character.
+		std::vector<float> kerning;
+
+		uint32_t id; // Stays the same while the line exists
+		float height; // How far below this line the next one starts
+
+		// Box around the quads of the line's glyphs, relative to its start.
+		// Empty (min > max) if none of them draw anything.
+		glm::vec2 boundsMin, boundsMax;
+
+		// Where the line's instances go in instanceBuffer. Slots past the
+		// end of the line are left as empty instances, which draw nothing.
+		size_t bufferStart, bufferCapacity;
+		bool dirty; // Instances changed since they were uploaded
+	};
+	std::vector<Line> lines; // Never empty
+	size_t textLength;
+
+	// Origin of each line, by line id, and the ids free for new lines.
+	// The vertex shader adds these to the line-relative instance positions.
+	std::vector<glm::vec2> lineOffsets;
+	std::vector<uint32_t> freeLineIds;
+	bool lineOffsetsDirty;
 
-		// RGBA color [0,255]
-		Color color;
+	// Labels with more than kCullChunkLines lines only draw the lines that
+	// are in view. Lines are tested in chunks of that many, by the union of
+	// their bounds, then one by one in the chunks that are in view. The
+	// chunks are rebuilt after lines change or move. See Render().
+	static const size_t kCullChunkLines = 32;
+	struct CullChunk
+	{
+		glm::vec2 boundsMin, boundsMax; // Relative to the label
 	};
+	std::vector<CullChunk> cullChunks;
+	bool cullChunksDirty;
+	bool culling;
 
-	// Each of these arrays store the same "set" of data, but different versions
-	// of it. Consequently, each of these will be exactly the same length
-	// (except verts, which is six times longer than the other two, since
-	// six verts per glyph).
-	// Can't put them all into one array, because verts is needed alone as a
-	// buffer to upload to the GPU, and text is needed alone mostly for GetText.
-	std::u32string text;
-	std::vector<GlyphVertex> verts;
-	std::vector<GLFontManager::Glyph *> glyphs;
+	// Instances (start, count) Render() draws out of instanceBuffer, and
+	// the buffer of indirect draw commands for drawing them in one call
+	std::vector<std::pair<size_t, size_t>> drawRanges;
+	GLuint drawIndirectBuf;
+	size_t drawIndirectBufCapacity;
+
+	// The text as last rendered into a texture, see SetCoverageCache()
+	struct CoverageCache
+	{
+		bool enabled;
+		GLuint framebuffer, texture; // 0 until first used
+		GLsizei width, height;
+		uint64_t version, paletteVersion; // Of the text it has, 0 if none
+		Quality quality;
+		glm::vec2 scale; // Pixels per FT unit it was rendered at
+		glm::vec4 rect; // Texture corners in label space, see DrawTexture()
+	};
+	CoverageCache coverageCache;
 
 	std::shared_ptr<GLFontManager> manager;
-	GLuint vertBuffer, caretBuffer;
+	GLuint instanceBuffer, lineOffsetBuf, lineOffsetBufTex;
+
+	// Set up once to draw the text, caret and selection, see Render()
+	GLuint vertexArray, caretVertexArray, selectionVertexArray;
+
+	// Slots of instanceBuffer given out to lines so far, and its size.
+	// staleRegions are slots (start, count) left behind by lines that moved
+	// or were removed, which still need clearing on the GPU.
+	size_t instanceBufferUsed, instanceBufferCapacity;
+	std::vector<std::pair<size_t, size_t>> staleRegions;
 	bool showingCaret;
 	size_t caretPosition;
 	float prevTime, caretTime;
 
+	// Selection highlights and the caret, drawn as glyph instances too
+	struct OverlayInstance
+	{
+		GlyphInstance glyph;
+		glm::vec2 size; // Replaces the glyph's size, see GLFontManager::UseInstanceSize()
+	};
+
+	// [selectionStart, selectionEnd) is highlighted, nothing if empty
+	size_t selectionStart, selectionEnd;
+
+	// Colors that instances index, starting with the selection's and the
+	// caret's, and the characters using each. Entries for colors passed to
+	// InsertText() are shared by all text of that color, and reused once
+	// none is left. Those of AddColor() are styles, which stay. Uploaded
+	// into paletteBuf whenever paletteVersion, which follows the same
+	// numbering as version, changes.
+	std::vector<Color> palette;
+	struct PaletteUse
+	{
+		size_t chars;
+		bool style;
+	};
+	std::vector<PaletteUse> paletteUses;
+	uint64_t paletteVersion, uploadedPaletteVersion;
+	GLuint paletteBuf, paletteBufTex;
+
+	// The caret (an empty instance if it isn't shown), followed by one
+	// highlight per selected line. Keeping the caret first means neither
+	// vertex array ever has to be pointed elsewhere in overlayBuffer.
+	// These only get rebuilt, and reuploaded into overlayBuffer, when the
+	// text, caret or selection change. Blinking just leaves the caret out of
+	// the draw, so drawing them every frame costs no buffer updates.
+	std::vector<OverlayInstance> overlays;
+	size_t numSelectionRects;
+	bool hasCaretOverlay;
+	GLFontManager::Glyph *caretGlyph; // Retained, '|' of the default font
+	GLuint overlayBuffer;
+	size_t overlayBufferCapacity;
+
+	// Changes whenever the overlays need rebuilding, following the same
+	// numbering as version
+	uint64_t overlayVersion, builtOverlayVersion, uploadedOverlayVersion;
+
+	// Characters whose glyphs were still being prepared by the manager's
+	// worker threads when they were inserted. They are drawn with the face's
+	// notdef glyph until Update() finds them ready and lays them out again.
+	struct PendingGlyph
+	{
+		size_t index;
+		FT_Face face;
+	};
+	std::vector<PendingGlyph> pendingGlyphs;
+	bool asyncGlyphs;
+	uint64_t seenGlyphCommits;
+	Quality quality;
+
+	// Manager's atlas generation the glyph data offsets are from
+	uint64_t seenAtlasGeneration;
+
+	LayoutOptions layoutOptions;
+
+	Stats stats;
+	GPUTimer renderTimer;
+
+	// Changes every time the text is modified. Values are unique across all
+	// labels, so a batch can tell whether its copy of the instances is stale.
+	uint64_t version;
+	static std::atomic<uint64_t> lastVersion; // Shared by labels of every manager
+
+	// Finds the line holding the character at `index`, and its column
+	size_t FindLine(size_t index, size_t *column);
+	uint32_t NewLineId();
+	void LayoutLine(Line &line, size_t fromColumn);
+	static void ExtendBounds(Line &line, size_t column);
+	static void PointInstanceAttribs(size_t stride, size_t first);
+	// Works out the kerning between the character at `column` and the next
+	void UpdateKerning(Line &line, size_t column);
+	void UpdateLineOffsets();
+
+	// Pen position (relative to the line) after the character at `column`
+	static glm::vec2 PenAfter(const Line &line, size_t column);
+	// Or before it, which is also right for the end of the line
+	static glm::vec2 PenBefore(const Line &line, size_t column);
+
+	// Uploads the lines and line offsets that changed since the last call
+	void UploadLines();
+
+	// Works out drawRanges: every line that might be in view once drawn
+	// with `transform`, and together, so that gaps of empty slots between
+	// lines are drawn through rather than split into more draw calls
+	void FindDrawRanges(const glm::mat4 &transform);
+	void DrawRanges();
+
+	// Draws the text from the coverage cache, rendering it again first if
+	// it's out of date. Returns false, drawing nothing, if the transform
+	// doesn't allow for it.
+	bool DrawCoverageCache(const glm::mat4 &transform);
+
+	// Takes the glyph data offsets of every instance from its glyph again,
+	// if the manager compacted its atlases since they were last taken
+	void RefreshGlyphData();
+
+	// Palette entry for the color, adding one unless it's shared (see
+	// palette) and there already is one. Takes the closest entry once the
+	// palette is full.
+	uint8_t FindColor(Color color, bool style);
+	// Drops the palette uses of the characters from `from` up to `to`
+	void ReleaseColors(const Line &line, size_t from, size_t to);
+	void UploadPalette();
+
+	// Rebuilds the overlays if they're out of date
+	void BuildOverlays();
+	void UploadOverlays();
+
+	// Advances the caret's blink to `time`, and returns whether it's on
+	bool AdvanceCaret(float time);
+
 public:
-	GLLabel();
+	// Draws with the given manager, or GLFontManager::GetFontManager()'s if
+	// null, which is then the only one the label can be drawn with
+	GLLabel(std::shared_ptr<GLFontManager> manager = nullptr);
 	~GLLabel();
 
 	void InsertText(std::u32string text, size_t index, glm::vec4 color, FT_Face face);
 	void RemoveText(size_t index, size_t length);
 	inline void SetText(std::u32string text, glm::vec4 color, FT_Face face) {
-		this->RemoveText(0, this->text.size());
+		this->RemoveText(0, this->textLength);
 		this->InsertText(text, 0, color, face);
 	}
 	inline void AppendText(std::u32string text, glm::vec4 color, FT_Face face) {
-		this->InsertText(text, this->text.size(), color, face);
+		this->InsertText(text, this->textLength, color, face);
+	}
+
+	// Same, with a color out of the palette
+	void InsertText(std::u32string text, size_t index, uint8_t color, FT_Face face);
+	inline void SetText(std::u32string text, uint8_t color, FT_Face face) {
+		this->RemoveText(0, this->textLength);
+		this->InsertText(text, 0, color, face);
 	}
+	inline void AppendText(std::u32string text, uint8_t color, FT_Face face) {
+		this->InsertText(text, this->textLength, color, face);
+	}
+
+	// Colors are kept in a palette of up to kPaletteSize entries, which
+	// each character indexes, so a whole run of text can be recolored, say
+	// on hover, by changing its entry instead of the text. Text inserted
+	// with a glm::vec4 color shares an entry with all other text of that
+	// color. AddColor() adds an entry of its own, a style for the text
+	// inserted with it, which stays for the life of the label. Once the
+	// palette is full, both make do with the closest color already in it.
+	uint8_t AddColor(glm::vec4 color);
+	void SetColor(uint8_t color, glm::vec4 value);
+	glm::vec4 GetColor(uint8_t color);
+	// Gives the characters from index up to index + length a palette entry
+	void SetTextColor(size_t index, size_t length, uint8_t color);
 
-	inline std::u32string GetText() { return this->text; }
+	std::u32string GetText();
 
 	void SetHorzAlignment(Align horzAlign);
 	void SetVertAlignment(Align vertAlign);
-	void ShowCaret(bool show) { showingCaret = show; }
-	void SetCaretPosition(int position) { caretTime = 0; caretPosition = glm::clamp(position, 0, (int)text.size()); }
+	void ShowCaret(bool show) { showingCaret = show; overlayVersion = ++GLLabel::lastVersion; }
+	void SetCaretPosition(int position) {
+		caretTime = 0;
+		caretPosition = glm::clamp(position, 0, (int)textLength);
+		overlayVersion = ++GLLabel::lastVersion;
+	}
 	int GetCaretPosition() { return caretPosition; }
 
+	// Highlights the characters from start up to (not including) end.
+	// Passing start == end clears the selection.
+	void SetSelection(size_t start, size_t end);
+	void SetSelectionColor(glm::vec4 color);
+	size_t GetSelectionStart() { return selectionStart; }
+	size_t GetSelectionEnd() { return selectionEnd; }
+
+	// When enabled, glyphs that aren't loaded yet are prepared on the font
+	// manager's worker threads instead of stalling InsertText(), and show up
+	// as placeholders until they're ready.
+	void SetAsyncGlyphLoading(bool async) { asyncGlyphs = async; }
+
+	// Whether Render() leaves out lines outside the viewport, on by
+	// default. Only labels with many lines bother, so the cost of testing
+	// them doesn't show up on small ones.
+	void SetCulling(bool cull) { culling = cull; }
+
+	// Coverage cache mode, off by default: the text is rendered once into
+	// a texture at the scale it's drawn at, which later Render()s draw as a
+	// single quad. It's only rendered again once the text changes, or the
+	// scale drifts more than 5% from it. Transforms that do more than scale
+	// and translate draw the text as usual, as do transforms that would need
+	// a texture bigger than GL_MAX_TEXTURE_SIZE. Meant for static text; text
+	// that moves by fractions of a pixel comes out slightly blurred. The
+	// selection and caret are always drawn as usual.
+	void SetCoverageCache(bool cache);
+
+	// Kerning and tab stops, kDefaultLayoutOptions by default. Changing them
+	// lays out the whole text again.
+	void SetLayoutOptions(const LayoutOptions &options);
+	const LayoutOptions & GetLayoutOptions() { return layoutOptions; }
+
+	// Quality::High by default. Lower qualities are cheaper to draw, which
+	// adds up with lots of small text.
+	void SetQuality(Quality quality) { this->quality = quality; }
+	Quality GetQuality() { return quality; }
+
+	// Swaps in glyphs that were pending and have finished loading. Render()
+	// and GLLabelBatch::Add() call this.
+	void Update();
+
 	// Render the label. Also uploads modified textures as necessary. 'time'
 	// should be passed in monotonic seconds (no specific zero time necessary).
 	void Render(float time, glm::mat4 transform);
+
+	Stats GetStats() { return stats; }
+};
+
+// Draws many labels, each with its own transform, in a single draw call.
+// Labels are queued every frame with Add() and drawn together by Render().
+// The glyph instances of all queued labels are kept in one persistent
+// buffer, and only labels that changed (or moved within the queue) since the
+// last frame get copied into it again. Per-label transforms, palettes and
+// where each palette starts are stored in buffer textures indexed from the
+// instance data.
+// Selections and carets are drawn from two more, much smaller buffers, which
+// are only regathered when one of them changes or a caret blinks.
+class GLLabelBatch
+{
+private:
+	struct BatchInstance
+	{
+		glm::vec2 pos;
+		uint32_t glyphDataOffset; // Same as in GLLabel::GlyphInstance
+
+		// Index into the transform buffer, one per queued label, in the low
+		// 24 bits, and the index into that label's palette in the high 8
+		uint32_t transformAndColor;
+	};
+
+	struct BatchOverlay
+	{
+		BatchInstance instance;
+		glm::vec2 size; // Same as in GLLabel::OverlayInstance
+	};
+
+	struct Entry
+	{
+		GLLabel *label;
+		uint64_t version;
+		uint64_t overlayVersion;
+		uint64_t paletteVersion;
+		bool caretOn; // Whether its caret was blinked on when gathered
+	};
+
+	std::shared_ptr<GLFontManager> manager;
+	std::vector<Entry> entries;
+	std::vector<glm::mat4> transforms;
+	std::vector<BatchInstance> instances;
+
+	// Start (in instances) of each entry's instances, plus the end of the last
+	std::vector<size_t> entryInstances;
+
+	size_t numQueued, firstDirtyEntry;
+	bool transformsDirty;
+	GLuint instanceBuffer, transformBuf, transformBufTex;
+	size_t instanceBufferCapacity;
+
+	// Every entry's palette, back to back at the size it has, and the range
+	// of entries whose palettes changed since the last upload. paletteStarts
+	// has where each entry's palette is in palettes, plus the end of the
+	// last. paletteBases is the same for the shader, except that palettes
+	// past GL_MAX_TEXTURE_BUFFER_SIZE make do with the first one.
+	std::vector<GLLabel::Color> palettes;
+	std::vector<size_t> paletteStarts;
+	std::vector<uint32_t> paletteBases;
+	size_t firstDirtyPalette, endDirtyPalette;
+	GLuint paletteBuf, paletteBufTex, paletteBaseBuf, paletteBaseBufTex;
+	size_t paletteBufCapacity; // In colors
+	size_t paletteBaseBufCapacity; // In entries
+
+	// Every entry's selection highlights, and the carets that are on
+	std::vector<BatchOverlay> selections, carets;
+	bool overlaysDirty;
+	GLuint selectionBuffer, caretBuffer;
+	size_t selectionBufferCapacity, caretBufferCapacity;
+
+	// Set up once to draw each of the buffers
+	GLuint vertexArray, selectionVertexArray, caretVertexArray;
+	GLLabel::Quality quality;
+	uint64_t seenAtlasGeneration; // Same as GLLabel's
+
+	// Adds to the manager's render timings
+	GPUTimer renderTimer;
+
+	void GatherOverlays();
+	void UploadPalettes();
+
+public:
+	// Same as for GLLabel
+	GLLabelBatch(std::shared_ptr<GLFontManager> manager = nullptr);
+	~GLLabelBatch();
+
+	// Queues a label to be drawn by the next Render(). Transforms are the
+	// same as for GLLabel::Render. A label may be queued more than once,
+	// but only if it has the batch's manager.
+	void Add(GLLabel *label, glm::mat4 transform);
+
+	// Draws every label queued since the previous Render() and empties the
+	// queue. Also uploads modified textures as necessary. 'time' is the same
+	// as for GLLabel::Render, and makes the carets blink.
+	void Render(float time);
+
+	// Same as GLLabel::SetQuality, for every label in the batch regardless
+	// of their own quality
+	void SetQuality(GLLabel::Quality quality) { this->quality = quality; }
 };
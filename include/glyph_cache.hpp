@@ -0,0 +1,211 @@
+#ifndef GLYPH_CACHE_H
+#define GLYPH_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <deque>
+#include <vector>
+
+// Cache of loaded glyphs keyed by (face id, codepoint). Lookups go through
+// an open-addressing hash table with linear probing, except for codepoints
+// below kDirectSize (ASCII and Latin-1), which are directly indexed in a
+// per-face table since that's where nearly every western lookup lands.
+// Glyphs are stored in a deque, so the pointers returned by Find() and
+// Insert() stay valid until the glyph is removed. Removed glyphs leave their
+// storage to the next ones inserted.
+template <class T>
+class GlyphCache
+{
+public:
+	struct Stats
+	{
+		uint64_t hits;
+		uint64_t misses;
+		size_t size; // Number of glyphs in the cache
+	};
+
+	static const uint32_t kDirectSize = 256;
+
+private:
+	struct Slot
+	{
+		uint64_t key;
+		T *value;
+	};
+
+	static const uint64_t kEmptyKey = UINT64_MAX;
+
+	std::deque<T> storage;
+	std::vector<T *> freeStorage; // Left behind by Remove()
+	std::vector<std::array<T *, kDirectSize>> direct; // Indexed by face id
+	std::vector<Slot> slots; // Size is always 0 or a power of two
+	size_t numSlotsUsed;
+	Stats stats;
+
+	static uint64_t make_key(uint32_t faceId, uint32_t point) {
+		return ((uint64_t)faceId << 32) | point;
+	}
+
+	// Fibonacci hashing, good enough to spread sequential codepoints
+	static size_t slot_for_key(uint64_t key, size_t mask) {
+		return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+	}
+
+	void InsertSlot(uint64_t key, T *value) {
+		size_t mask = this->slots.size() - 1;
+		size_t i = slot_for_key(key, mask);
+		while (this->slots[i].key != kEmptyKey) {
+			i = (i + 1) & mask;
+		}
+		this->slots[i] = Slot{key, value};
+		this->numSlotsUsed++;
+	}
+
+	void Grow() {
+		std::vector<Slot> old;
+		old.swap(this->slots);
+		this->slots.resize(old.size() ? old.size() * 2 : 256, Slot{kEmptyKey, nullptr});
+		this->numSlotsUsed = 0;
+		for (size_t i = 0; i < old.size(); i++) {
+			if (old[i].key != kEmptyKey) {
+				this->InsertSlot(old[i].key, old[i].value);
+			}
+		}
+	}
+
+public:
+	GlyphCache() : numSlotsUsed(0), stats{} { }
+
+	// Returns the cached glyph or nullptr. Counts towards the hit/miss stats.
+	T * Find(uint32_t faceId, uint32_t point) {
+		T *value = this->Peek(faceId, point);
+		if (value) {
+			this->stats.hits++;
+		}
+		else {
+			this->stats.misses++;
+		}
+		return value;
+	}
+
+	// Same as Find(), but without touching the stats
+	T * Peek(uint32_t faceId, uint32_t point) {
+		if (point < kDirectSize) {
+			if (faceId < this->direct.size()) {
+				return this->direct[faceId][point];
+			}
+			return nullptr;
+		}
+
+		if (this->slots.size() > 0) {
+			uint64_t key = make_key(faceId, point);
+			size_t mask = this->slots.size() - 1;
+			for (size_t i = slot_for_key(key, mask); this->slots[i].key != kEmptyKey; i = (i + 1) & mask) {
+				if (this->slots[i].key == key) {
+					return this->slots[i].value;
+				}
+			}
+		}
+		return nullptr;
+	}
+
+	// Adds a glyph that isn't in the cache yet, and returns its stable copy.
+	T * Insert(uint32_t faceId, uint32_t point, const T &glyph) {
+		T *value;
+		if (!this->freeStorage.empty()) {
+			value = this->freeStorage.back();
+			this->freeStorage.pop_back();
+			*value = glyph;
+		}
+		else {
+			this->storage.push_back(glyph);
+			value = &this->storage.back();
+		}
+
+		if (point < kDirectSize) {
+			if (faceId >= this->direct.size()) {
+				this->direct.resize(faceId + 1, std::array<T *, kDirectSize>{});
+			}
+			this->direct[faceId][point] = value;
+			return value;
+		}
+
+		// Keep the load factor under 1/2 so probe runs stay short
+		if ((this->numSlotsUsed + 1) * 2 > this->slots.size()) {
+			this->Grow();
+		}
+		this->InsertSlot(make_key(faceId, point), value);
+		return value;
+	}
+
+	// Takes a glyph out of the cache. Pointers to it must not be used after.
+	// Returns false if it wasn't in the cache.
+	bool Remove(uint32_t faceId, uint32_t point) {
+		T *value = nullptr;
+		if (point < kDirectSize) {
+			if (faceId < this->direct.size()) {
+				value = this->direct[faceId][point];
+				this->direct[faceId][point] = nullptr;
+			}
+		}
+		else if (this->slots.size() > 0) {
+			uint64_t key = make_key(faceId, point);
+			size_t mask = this->slots.size() - 1;
+			size_t i = slot_for_key(key, mask);
+			for (; this->slots[i].key != kEmptyKey; i = (i + 1) & mask) {
+				if (this->slots[i].key == key) {
+					value = this->slots[i].value;
+					break;
+				}
+			}
+
+			// Shift later entries of the probe run back into the hole,
+			// unless that would put them before their home slot, so the
+			// run has no gaps for Peek() to stop at
+			if (value) {
+				for (size_t j = (i + 1) & mask; this->slots[j].key != kEmptyKey; j = (j + 1) & mask) {
+					size_t home = slot_for_key(this->slots[j].key, mask);
+					bool homeInRun = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+					if (!homeInRun) {
+						this->slots[i] = this->slots[j];
+						i = j;
+					}
+				}
+				this->slots[i] = Slot{kEmptyKey, nullptr};
+				this->numSlotsUsed--;
+			}
+		}
+
+		if (value) {
+			this->freeStorage.push_back(value);
+		}
+		return value != nullptr;
+	}
+
+	// Calls f(faceId, point, glyph) for every glyph in the cache, in no
+	// particular order
+	template <class F>
+	void ForEach(F f) {
+		for (size_t faceId = 0; faceId < this->direct.size(); faceId++) {
+			for (uint32_t point = 0; point < kDirectSize; point++) {
+				if (this->direct[faceId][point]) {
+					f((uint32_t)faceId, point, *this->direct[faceId][point]);
+				}
+			}
+		}
+		for (size_t i = 0; i < this->slots.size(); i++) {
+			if (this->slots[i].key != kEmptyKey) {
+				f((uint32_t)(this->slots[i].key >> 32), (uint32_t)this->slots[i].key, *this->slots[i].value);
+			}
+		}
+	}
+
+	Stats GetStats() {
+		Stats s = this->stats;
+		s.size = this->storage.size() - this->freeStorage.size();
+		return s;
+	}
+};
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef GLYPH_LOADER_H
+#define GLYPH_LOADER_H
+
+#include "font_file.hpp"
+#include "types.hpp"
+#include "vgrid.hpp"
+#include <string>
+#include <vector>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+// Everything about a glyph that can be worked out without touching the
+// atlases or GL: its metrics in FT units, its quadratic beziers, and its
+// grid. A prepared glyph is turned into an atlas entry by
+// GLFontManager::CommitGlyph().
+struct PreparedGlyph
+{
+	FT_Glyph_Metrics metrics;
+	std::vector<Bezier2> curves;
+	VGrid grid; // Not meaningful if there are no curves
+};
+
+// Loads a glyph's outline from the face and builds its beziers and grid.
+// The grid is the coarsest one, shaped to the glyph's aspect ratio and at
+// most maxGridSize on its long side, where no cell has more than
+// maxCellBeziers beziers. Reuses the storage already in `out`. Returns false
+// if FreeType can't load the glyph.
+bool prepare_glyph(
+	FT_Face face,
+	uint32_t point,
+	uint8_t maxGridSize,
+	uint8_t maxCellBeziers,
+	PreparedGlyph &out);
+
+// Runs prepare_glyph() for each of `points` on up to numThreads threads,
+// the calling one included, and waits for them. Each thread opens its own
+// face of the file and starts on its own share of the points, and once done
+// steals from the others, so a few slow glyphs don't hold up the rest.
+// out[i] and loaded[i] are for points[i], no matter which thread did it.
+// loaded isn't a vector<bool>, which threads can't write apart.
+void prepare_glyphs(
+	std::shared_ptr<FontFile> file,
+	FT_Long faceIndex,
+	const std::vector<uint32_t> &points,
+	unsigned numThreads,
+	uint8_t maxGridSize,
+	uint8_t maxCellBeziers,
+	std::vector<PreparedGlyph> &out,
+	std::vector<uint8_t> &loaded);
+
+// Tracks one GLFontManager::RequestGlyphs() call. The promise is fulfilled
+// once none of its glyphs are waiting on a worker anymore.
+struct GlyphRequest
+{
+	std::promise<void> promise;
+	size_t remaining;
+};
+
+// Pool of worker threads that run prepare_glyph(). FreeType faces can't be
+// shared between threads, so every worker has its own FT_Library and opens
+// its own copy of each face, over the same mapping of the face's file. The
+// copies stay open until ReleaseFace().
+class GlyphLoader
+{
+public:
+	struct Job
+	{
+		uint32_t faceId;
+		std::shared_ptr<FontFile> file;
+		FT_Long faceIndex;
+		uint32_t point;
+	};
+
+	struct Result
+	{
+		uint32_t faceId;
+		uint32_t point;
+		bool loaded; // False if the face or glyph couldn't be loaded
+		PreparedGlyph glyph;
+	};
+
+private:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<Job> jobs;
+	std::vector<Result> results;
+	// Ids of faces each worker should close, see ReleaseFace()
+	std::vector<std::vector<uint32_t>> releases;
+	bool stopping;
+	uint8_t maxGridSize;
+	uint8_t maxCellBeziers;
+
+	void WorkerMain(size_t worker);
+
+public:
+	// Grid sizes are picked as in prepare_glyph()
+	GlyphLoader(unsigned numThreads, uint8_t maxGridSize, uint8_t maxCellBeziers);
+	~GlyphLoader();
+
+	void Push(const Job &job);
+
+	// Has every worker close its copy of the face, and let go of its file.
+	// Only call once no job for the face is queued or running anymore.
+	void ReleaseFace(uint32_t faceId);
+
+	// Moves every result finished so far onto the end of `out`
+	void TakeResults(std::vector<Result> &out);
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef GLYPH_STORE_H
+#define GLYPH_STORE_H
+
+#include "glyph_loader.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// What the store keeps of a prepared glyph: its grid's cells are most of a
+// PreparedGlyph, padded to VGrid::kCellCapacity beziers each, so only the
+// grid's size is kept and the cells are rebuilt from the curves.
+struct StoredGlyph
+{
+	FT_Glyph_Metrics metrics;
+	std::vector<Bezier2> curves;
+	int gridWidth;
+	int gridHeight;
+
+	explicit StoredGlyph(const PreparedGlyph &glyph);
+
+	// Fills `out` with the glyph as prepare_glyph() left it, grid and all
+	void Expand(PreparedGlyph &out) const;
+};
+
+// Prepared glyphs shared between font managers of different GL contexts,
+// which may be on different threads, so each glyph is only prepared once
+// between them. Every manager still packs the glyphs into atlases of its
+// own, and uploads them to its own context. See GLFontManager::Create().
+//
+// Glyphs are stored by font (file path and face index) and codepoint, and
+// stay until the store is destroyed. Looking one up never takes a lock: the
+// table is a fixed array of buckets, each a list that only ever grows at its
+// head, which is swapped in with a compare-and-swap. Only FontId() locks.
+class GlyphStore
+{
+	struct Node
+	{
+		uint64_t key;
+		StoredGlyph glyph;
+		Node *next; // Set before the node is published, and never again
+	};
+
+	static const size_t kBuckets = 1 << 14;
+
+	std::unique_ptr<std::atomic<Node *>[]> buckets;
+	std::atomic<size_t> size;
+
+	std::mutex fontsMutex;
+	std::vector<std::pair<std::string, FT_Long>> fonts; // By font id - 1
+
+public:
+	GlyphStore();
+	~GlyphStore();
+	GlyphStore(const GlyphStore &) = delete;
+	GlyphStore & operator=(const GlyphStore &) = delete;
+
+	// Id that the font's glyphs are stored under, never 0. The same path and
+	// face index always get the same id.
+	uint32_t FontId(const std::string &path, FT_Long faceIndex);
+
+	// Null if the glyph isn't stored. Stored glyphs never change, and live as
+	// long as the store.
+	const StoredGlyph * Find(uint32_t fontId, uint32_t point) const;
+
+	// Adds the glyph, without its grid cells, unless it's already stored
+	void Insert(uint32_t fontId, uint32_t point, const PreparedGlyph &glyph);
+
+	size_t Size() const { return size.load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -9,4 +9,7 @@
 
 std::vector<Bezier2> GetBeziersForOutline(FT_Outline *outline);
 
+// Same as above, but fills `beziers` so its storage can be reused
+void GetBeziersForOutline(FT_Outline *outline, std::vector<Bezier2> &beziers);
+
 #endif
@@ -0,0 +1,80 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include <glew.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Distribution of durations in microseconds, in power of two buckets:
+// bucket 0 counts durations under 1us, bucket i those in [2^(i-1), 2^i) us,
+// and the last bucket everything longer. Fixed size, so adding to it never
+// allocates.
+struct Histogram
+{
+	static const size_t kBuckets = 24; // The last starts at about 4 seconds
+
+	uint64_t buckets[kBuckets];
+	uint64_t count;
+	double totalUs, maxUs;
+
+	Histogram() : buckets{}, count(0), totalUs(0), maxUs(0) { }
+
+	void Add(double us) {
+		size_t bucket = 0;
+		for (uint64_t v = (us > 0) ? (uint64_t)us : 0; v > 0 && bucket < kBuckets - 1; v >>= 1) {
+			bucket++;
+		}
+		this->buckets[bucket]++;
+		this->count++;
+		this->totalUs += us;
+		if (us > this->maxUs) {
+			this->maxUs = us;
+		}
+	}
+
+	double MeanUs() const {
+		return this->count ? this->totalUs / this->count : 0;
+	}
+
+	// Upper bound of the bucket that the given fraction (0 to 1) of
+	// durations fall within, so 0.5 gives a bound on the median
+	double PercentileUs(double fraction) const {
+		uint64_t target = (uint64_t)(fraction * this->count);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < kBuckets - 1; i++) {
+			seen += this->buckets[i];
+			if (seen > target || (seen == this->count && seen > 0)) {
+				return (double)((uint64_t)1 << i);
+			}
+		}
+		return this->maxUs;
+	}
+};
+
+// Times GPU work between Begin() and End() with GL_TIME_ELAPSED queries,
+// without ever waiting on the GPU: Poll() picks up the results of earlier
+// frames once they are available. The queries are only created on first
+// use. A timer can't be running while any other GL_TIME_ELAPSED query is,
+// including other timers.
+class GPUTimer
+{
+	static const size_t kQueries = 4; // Frames that can be waiting on results
+
+	GLuint queries[kQueries];
+	size_t firstPending, numPending; // Ring of queries waiting on results
+	bool created, running;
+
+public:
+	GPUTimer();
+	~GPUTimer();
+
+	// Skips timing if every query is still waiting on its result
+	void Begin();
+	void End();
+
+	// Takes the oldest finished result, in microseconds. Returns false if
+	// there is none yet.
+	bool Poll(double *us);
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Four lanes of floats, and masks of four lanes, on SSE2 or NEON where
+// there is one, with a plain loop otherwise. Only what the glyph
+// preparation kernels need. Every operation rounds the same as the scalar
+// one, so kernels written with these give the same results as scalar code
+// doing the same steps.
+
+#include <stdint.h>
+
+// Inlined even in unoptimized builds, which would otherwise be much slower
+// than the scalar code
+#if defined(__GNUC__)
+#define SIMD_INLINE static inline __attribute__((always_inline))
+#else
+#define SIMD_INLINE static inline
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+
+typedef __m128 f32x4;
+typedef __m128 m32x4;
+
+SIMD_INLINE f32x4 v_load(const float *p) { return _mm_loadu_ps(p); }
+SIMD_INLINE void v_store(float *p, f32x4 v) { _mm_storeu_ps(p, v); }
+SIMD_INLINE f32x4 v_set(float x) { return _mm_set1_ps(x); }
+SIMD_INLINE f32x4 v_add(f32x4 a, f32x4 b) { return _mm_add_ps(a, b); }
+SIMD_INLINE f32x4 v_sub(f32x4 a, f32x4 b) { return _mm_sub_ps(a, b); }
+SIMD_INLINE f32x4 v_mul(f32x4 a, f32x4 b) { return _mm_mul_ps(a, b); }
+SIMD_INLINE f32x4 v_div(f32x4 a, f32x4 b) { return _mm_div_ps(a, b); }
+SIMD_INLINE f32x4 v_min(f32x4 a, f32x4 b) { return _mm_min_ps(a, b); }
+SIMD_INLINE f32x4 v_max(f32x4 a, f32x4 b) { return _mm_max_ps(a, b); }
+SIMD_INLINE f32x4 v_sqrt(f32x4 a) { return _mm_sqrt_ps(a); }
+
+// Comparisons are false for NaN lanes
+SIMD_INLINE m32x4 v_gt(f32x4 a, f32x4 b) { return _mm_cmpgt_ps(a, b); }
+SIMD_INLINE m32x4 v_ge(f32x4 a, f32x4 b) { return _mm_cmpge_ps(a, b); }
+SIMD_INLINE m32x4 v_le(f32x4 a, f32x4 b) { return _mm_cmple_ps(a, b); }
+SIMD_INLINE m32x4 m_and(m32x4 a, m32x4 b) { return _mm_and_ps(a, b); }
+SIMD_INLINE m32x4 m_andnot(m32x4 a, m32x4 b) { return _mm_andnot_ps(b, a); } // a && !b
+// Bit i is set if lane i is
+SIMD_INLINE int m_bits(m32x4 m) { return _mm_movemask_ps(m); }
+// m ? a : b, per lane
+SIMD_INLINE f32x4 v_select(m32x4 m, f32x4 a, f32x4 b)
+{
+	return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+}
+
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+typedef float32x4_t f32x4;
+typedef uint32x4_t m32x4;
+
+SIMD_INLINE f32x4 v_load(const float *p) { return vld1q_f32(p); }
+SIMD_INLINE void v_store(float *p, f32x4 v) { vst1q_f32(p, v); }
+SIMD_INLINE f32x4 v_set(float x) { return vdupq_n_f32(x); }
+SIMD_INLINE f32x4 v_add(f32x4 a, f32x4 b) { return vaddq_f32(a, b); }
+SIMD_INLINE f32x4 v_sub(f32x4 a, f32x4 b) { return vsubq_f32(a, b); }
+SIMD_INLINE f32x4 v_mul(f32x4 a, f32x4 b) { return vmulq_f32(a, b); }
+SIMD_INLINE f32x4 v_div(f32x4 a, f32x4 b) { return vdivq_f32(a, b); }
+SIMD_INLINE f32x4 v_min(f32x4 a, f32x4 b) { return vminq_f32(a, b); }
+SIMD_INLINE f32x4 v_max(f32x4 a, f32x4 b) { return vmaxq_f32(a, b); }
+SIMD_INLINE f32x4 v_sqrt(f32x4 a) { return vsqrtq_f32(a); }
+
+SIMD_INLINE m32x4 v_gt(f32x4 a, f32x4 b) { return vcgtq_f32(a, b); }
+SIMD_INLINE m32x4 v_ge(f32x4 a, f32x4 b) { return vcgeq_f32(a, b); }
+SIMD_INLINE m32x4 v_le(f32x4 a, f32x4 b) { return vcleq_f32(a, b); }
+SIMD_INLINE m32x4 m_and(m32x4 a, m32x4 b) { return vandq_u32(a, b); }
+SIMD_INLINE m32x4 m_andnot(m32x4 a, m32x4 b) { return vbicq_u32(a, b); }
+SIMD_INLINE int m_bits(m32x4 m)
+{
+	static const uint32_t kLaneBits[4] = {1, 2, 4, 8};
+	return vaddvq_u32(vandq_u32(m, vld1q_u32(kLaneBits)));
+}
+SIMD_INLINE f32x4 v_select(m32x4 m, f32x4 a, f32x4 b) { return vbslq_f32(m, a, b); }
+
+#else
+#include <math.h>
+
+typedef struct {
+	float v[4];
+} f32x4;
+typedef struct {
+	bool v[4];
+} m32x4;
+
+#define SIMD_MAP(type, expr) type r; for (int i = 0; i < 4; i++) { r.v[i] = (expr); } return r
+SIMD_INLINE f32x4 v_load(const float *p) { SIMD_MAP(f32x4, p[i]); }
+SIMD_INLINE void v_store(float *p, f32x4 v) { for (int i = 0; i < 4; i++) { p[i] = v.v[i]; } }
+SIMD_INLINE f32x4 v_set(float x) { SIMD_MAP(f32x4, x); }
+SIMD_INLINE f32x4 v_add(f32x4 a, f32x4 b) { SIMD_MAP(f32x4, a.v[i] + b.v[i]); }
+SIMD_INLINE f32x4 v_sub(f32x4 a, f32x4 b) { SIMD_MAP(f32x4, a.v[i] - b.v[i]); }
+SIMD_INLINE f32x4 v_mul(f32x4 a, f32x4 b) { SIMD_MAP(f32x4, a.v[i] * b.v[i]); }
+SIMD_INLINE f32x4 v_div(f32x4 a, f32x4 b) { SIMD_MAP(f32x4, a.v[i] / b.v[i]); }
+SIMD_INLINE f32x4 v_min(f32x4 a, f32x4 b) { SIMD_MAP(f32x4, a.v[i] < b.v[i] ? a.v[i] : b.v[i]); }
+SIMD_INLINE f32x4 v_max(f32x4 a, f32x4 b) { SIMD_MAP(f32x4, a.v[i] > b.v[i] ? a.v[i] : b.v[i]); }
+SIMD_INLINE f32x4 v_sqrt(f32x4 a) { SIMD_MAP(f32x4, sqrtf(a.v[i])); }
+
+SIMD_INLINE m32x4 v_gt(f32x4 a, f32x4 b) { SIMD_MAP(m32x4, a.v[i] > b.v[i]); }
+SIMD_INLINE m32x4 v_ge(f32x4 a, f32x4 b) { SIMD_MAP(m32x4, a.v[i] >= b.v[i]); }
+SIMD_INLINE m32x4 v_le(f32x4 a, f32x4 b) { SIMD_MAP(m32x4, a.v[i] <= b.v[i]); }
+SIMD_INLINE m32x4 m_and(m32x4 a, m32x4 b) { SIMD_MAP(m32x4, a.v[i] && b.v[i]); }
+SIMD_INLINE m32x4 m_andnot(m32x4 a, m32x4 b) { SIMD_MAP(m32x4, a.v[i] && !b.v[i]); }
+SIMD_INLINE int m_bits(m32x4 m) { return m.v[0] | m.v[1] << 1 | m.v[2] << 2 | m.v[3] << 3; }
+SIMD_INLINE f32x4 v_select(m32x4 m, f32x4 a, f32x4 b) { SIMD_MAP(f32x4, m.v[i] ? a.v[i] : b.v[i]); }
+#undef SIMD_MAP
+
+#endif
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef SKYLINE_PACKER_H
+#define SKYLINE_PACKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Packs rectangles into a fixed size 2D area by tracking its "skyline", the
+// height of the tallest rectangle placed in each column span. New rectangles
+// go at the lowest spot they fit, leftmost on ties (bottom-left heuristic),
+// which keeps waste low without having to remember every free rectangle.
+class SkylinePacker
+{
+public:
+	struct Node
+	{
+		uint16_t x, y; // Left end of the span, and the skyline height there
+		uint16_t width;
+	};
+
+private:
+	std::vector<Node> skyline; // Sorted by x, covers the full width
+	uint16_t width, height;
+
+	// Returns the lowest y a w*h rect can sit at with its left side at node
+	// i's x, or -1 if it won't fit there.
+	int FitAt(size_t i, uint16_t w, uint16_t h) const;
+
+public:
+	SkylinePacker() : width(0), height(0) { }
+	SkylinePacker(uint16_t width, uint16_t height);
+
+	// Picks up packing where a packer with the given skyline left off, see
+	// GetSkyline(). Returns an empty packer if the skyline isn't valid.
+	SkylinePacker(uint16_t width, uint16_t height, const std::vector<Node> &skyline);
+
+	// Finds room for a w*h rect and reserves it. Returns false if there is
+	// no space left for it, in which case nothing changes.
+	bool Pack(uint16_t w, uint16_t h, uint16_t &outX, uint16_t &outY);
+
+	// Height of the tallest rect packed so far. Everything above is free.
+	uint16_t UsedHeight() const;
+
+	// The spans of the skyline, left to right, for saving the packer's state
+	const std::vector<Node> & GetSkyline() const { return skyline; }
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef TEXT_LAYOUT_H
+#define TEXT_LAYOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <iterator>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+struct LayoutOptions
+{
+	// Pair kerning from the font's kern table
+	bool kerning;
+	// Tabs move the pen to the next multiple of this, in FT units
+	float tabWidth;
+};
+
+static const LayoutOptions kDefaultLayoutOptions = {true, 2000};
+
+// Where one character of laid out text goes, in FT units
+struct LayoutGlyph
+{
+	uint32_t point;
+	FT_UInt index; // Glyph index in the face, 0 for control characters
+	// Pen position the character starts at. Lines start at x = 0 and go
+	// down by the face's height, like in GLLabel.
+	float x, y;
+	// Kerning between this character and the next, already in the next
+	// one's x
+	float kerning;
+};
+
+// Lays out a run of text in one face from the font's metrics alone: the
+// cmap, advances and kern table, without loading any outlines. It touches
+// no GL or GLFontManager state, so it can run on any thread, as long as
+// nothing else uses the face at the same time (see FontFile for opening
+// a thread its own).
+void layout_text(
+	FT_Face face,
+	const char32_t *text,
+	size_t length,
+	const LayoutOptions &options,
+	std::vector<LayoutGlyph> &out);
+
+// Kerning between two characters of the same face, 0 if off in options
+float layout_kerning(FT_Face face, uint32_t left, uint32_t right, const LayoutOptions &options);
+
+// Where a tab starting at pen position x moves the pen to
+float layout_tab_stop(float x, const LayoutOptions &options);
+
+// Layouts of strings that come up again and again, like table cells and
+// axis ticks, keyed by face id, options and text. Keeps the most recently
+// used kMaxEntries, and never caches texts longer than kMaxLength, which
+// are unlikely to repeat.
+class LayoutCache
+{
+public:
+	struct Stats
+	{
+		uint64_t hits;
+		uint64_t misses;
+		size_t size; // Number of layouts in the cache
+	};
+
+	static const size_t kMaxEntries = 4096;
+	static const size_t kMaxLength = 256;
+
+private:
+	struct Entry
+	{
+		uint64_t hash;
+		uint32_t faceId;
+		LayoutOptions options;
+		std::u32string text;
+		std::vector<LayoutGlyph> glyphs;
+	};
+
+	std::list<Entry> entries; // Most recently used first
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> byHash;
+	std::vector<LayoutGlyph> uncached; // Layout of the last text too long to cache
+	Stats stats;
+
+public:
+	LayoutCache() : stats{} { }
+
+	// Lays out the text with layout_text(), unless it's cached. The result
+	// is only valid until the next call.
+	const std::vector<LayoutGlyph> & Get(FT_Face face, uint32_t faceId, const std::u32string &text, const LayoutOptions &options);
+
+	Stats GetStats() {
+		Stats s = this->stats;
+		s.size = this->entries.size();
+		return s;
+	}
+};
+
+#endif
@@ -1,42 +1,96 @@
 #pragma once
 #include "types.hpp"
+#include <stddef.h>
+#include <stdint.h>
 #include <vector>
-#include <set>
 
 // Reprents a grid that is "overlayed" on top of a glyph, storing some
 // properties about each grid cell. The grid's origin is bottom-left
 // and is stored in row-major order.
+// All cell data lives in flat arrays that are reused when the grid is
+// rebuilt with Build(), so preparing glyph after glyph with the same VGrid
+// doesn't touch the heap once the arrays have grown large enough.
 struct VGrid {
-	// For each cell, a set of bezier curves (indices referring to
-	// input bezier array) that pass through that cell.
-	std::vector<std::set<size_t>> cellBeziers;
+	// Most bezier indices stored per cell. Cells crossed by more beziers
+	// keep the lowest kCellCapacity indices (still counted in cellCounts).
+	static const int kCellCapacity = 32;
+
+	// For each cell, the (ascending) indices of the bezier curves, referring
+	// to the input bezier array, that pass through that cell. Cell i's list
+	// starts at cellBeziers[i * kCellCapacity] and is CellSize(i) long.
+	std::vector<uint16_t> cellBeziers;
+
+	// For each cell, how many beziers pass through it.
+	std::vector<uint16_t> cellCounts;
 
 	// For each cell, a boolean indicating whether the cell's midpoint is
 	// inside the glpyh (true) or outside (false).
 	std::vector<char> cellMids;
 
-	// Size of the grid. Both arrays above are size width*height.
+	// Size of the grid. cellCounts and cellMids are size width*height.
 	int width;
 	int height;
 
+	VGrid() : width(0), height(0) { }
 	VGrid(
 		std::vector<Bezier2> &beziers,
 		Vec2 glyphSize,
 		int gridWidth,
 		int gridHeight);
+
+	// Recomputes the grid for a new set of beziers, reusing its storage.
+	void Build(
+		std::vector<Bezier2> &beziers,
+		Vec2 glyphSize,
+		int gridWidth,
+		int gridHeight);
+
+	size_t CellSize(size_t cellIdx) const {
+		return cellCounts[cellIdx] < kCellCapacity ? cellCounts[cellIdx] : kCellCapacity;
+	}
+	const uint16_t * CellBeziers(size_t cellIdx) const {
+		return &cellBeziers[cellIdx * kCellCapacity];
+	}
+
+	// Most beziers passing through any one cell
+	uint16_t MaxCellSize() const;
 };
 
 struct VGridAtlas {
-	// 2D buffer, size is width*height, row-major, starts at bottom-left
-	uint8_t *data;
+	// Most beziers a glyph's grid can refer to. Cells index beziers with
+	// 16 bit ints, with two values reserved (see write_vgrid_cell_to_buffer).
+	static const size_t kMaxBeziers = UINT16_MAX - 1;
+
+	// 2D buffer, size is width*height*depth, row-major, starts at bottom-left
+	uint16_t *data;
 
 	uint16_t width;
 	uint16_t height;
 
-	// Bytes per pixel, aka. how many bezier curves are allowed per grid
+	// Indices per pixel, aka. how many bezier curves fit directly in a grid
 	// cell. This should probably always be 4, since that's the limit of
-	// bytes per pixel that OpenGL supports (GL_RGBA8).
+	// channels per pixel that OpenGL supports (GL_RGBA16UI).
 	uint8_t depth;
 
-	void WriteVGridAt(VGrid &grid, uint16_t atX, uint16_t atY);
+	// Cells with more than `depth` beziers can instead point to a list of
+	// all their beziers in a separate overflow buffer of 4 byte texels.
+	// See write_vgrid_cell_to_buffer() for the format. Returns the texels
+	// needed for all of the grid's overflow lists, 0 if it needs none.
+	size_t OverflowSize(VGrid &grid);
+
+	// Counted up by WriteVGridAt(): cells written with overflow lists, and
+	// cells that had more beziers than they could hold and lost some.
+	size_t overflowCells;
+	size_t truncatedCells;
+
+	// If `overflow` is null, cells keep only their first `depth` beziers.
+	// Otherwise it must have room for OverflowSize() texels, and
+	// overflowOffset is the texel offset of `overflow` that is written
+	// into the cells pointing into it.
+	void WriteVGridAt(
+		VGrid &grid,
+		uint16_t atX,
+		uint16_t atY,
+		uint8_t *overflow = nullptr,
+		uint32_t overflowOffset = 0);
 };
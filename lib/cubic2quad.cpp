@@ -299,6 +299,22 @@ static void process_segment(
 	out->c1 = p_new(cx, cy);
 }
 
+#define SEGMENT_SAMPLES (10) // number of points + 1
+
+// Finds the values of t between tmin and tmax at which the error of a
+// segment's approximation is checked. Returns how many there are, at most
+// SEGMENT_SAMPLES - 1.
+static int segment_samples(double tmin, double tmax, double out[SEGMENT_SAMPLES])
+{
+	const double dt = (tmax - tmin) / SEGMENT_SAMPLES;
+	int nt = 0;
+	for (double t = tmin + dt; t < tmax - dt && nt < SEGMENT_SAMPLES; t += dt) { // don't check distance on boundary points
+	                                                                              // because they should be the same
+		out[nt++] = t;
+	}
+	return nt;
+}
+
 static bool is_segment_approximation_close(
 	const Point a, const Point b, const Point c, const Point d,
 	double tmin, double tmax,
@@ -321,11 +337,10 @@ static bool is_segment_approximation_close(
 	// But this method allows easy estimation of approximation error, so it is enough
 	// for practical purposes.
 
-	const int n = 10; // number of points + 1
-	const double dt = (tmax - tmin) / n;
-	for (double t = tmin + dt; t < tmax - dt; t += dt) { // don't check distance on boundary points
-	                                                     // because they should be the same
-		const Point point = calc_point(a, b, c, d, t);
+	double ts[SEGMENT_SAMPLES];
+	const int nt = segment_samples(tmin, tmax, ts);
+	for (int i = 0; i < nt; i++) {
+		const Point point = calc_point(a, b, c, d, ts[i]);
 		if (min_distance_to_quad(point, p1, c1, p2) > errorBound) {
 			return false;
 		}
@@ -506,3 +521,243 @@ int cubic2quad(const double in[8], const double errorBound, double out[MAX_DOUBL
 {
 	return cubic_to_quad((const CBezier *)in, errorBound, (QBezier *)out);
 }
+
+// The batched version below does the same search for the number of segments
+// as _cubic_to_quad(), for every section (between inflections) of every cubic
+// at once. Most of the time goes into checking the error at each sample point,
+// so that is first done for all of them together, in single precision and four
+// at a time: a few Newton steps find a point on the quadratic close to the
+// sample, whose distance is never less than the true minimum distance. That
+// settles every sample that is clearly within the error bound. Only the rest
+// are checked again with min_distance_to_quad(), so the outcome, and with it
+// the output, is the same as cubic2quad()'s.
+
+#include "simd.hpp"
+#include <vector>
+
+// Newton steps taken towards the closest point on the quadratic
+#define SAMPLE_NEWTON_STEPS (3)
+
+// Samples within this fraction of the error bound are checked again exactly
+#define SAMPLE_ERROR_MARGIN (1e-3)
+
+// One section of a cubic, between its inflection points (if any)
+typedef struct {
+	Point a, b, c, d; // power coefficients of the section
+	CBezier curve; // the section itself
+	int cubic; // index of the input cubic
+	int segments; // 0 until an approximation is close enough
+	bool failed; // while checking one number of segments
+	QBezier approximation[MAX_SEGMENTS];
+} C2QSection;
+
+// Sample points of every segment being checked, structure of arrays so they
+// can be loaded four at a time. Positions are relative to the first point of
+// the segment's quadratic, which is u*u*q + u*l in terms of u, the parameter
+// on the quadratic.
+typedef struct {
+	size_t count;
+	std::vector<float> x, y; // the sample point
+	std::vector<float> qx, qy; // p1 + p2 - 2 * c1
+	std::vector<float> lx, ly; // 2 * (c1 - p1)
+	std::vector<float> u; // parameter of the sample in the segment, to start at
+	std::vector<float> distSq; // output
+
+	// For checking again exactly
+	std::vector<Point> point;
+	std::vector<int> section, segment;
+} C2QSamples;
+
+// Scratch space, kept per thread like VGrid's
+static thread_local std::vector<C2QSection> tSections;
+static thread_local C2QSamples tSamples;
+
+// Empties the samples, with room for at least `size` of them. The arrays
+// are rounded up to a multiple of four, with anything past count all zeros.
+static void reset_samples(C2QSamples *s, size_t size)
+{
+	const size_t padded = (size + 3) & ~(size_t)3;
+	s->count = 0;
+	s->x.assign(padded, 0);
+	s->y.assign(padded, 0);
+	s->qx.assign(padded, 0);
+	s->qy.assign(padded, 0);
+	s->lx.assign(padded, 0);
+	s->ly.assign(padded, 0);
+	s->u.assign(padded, 0);
+	s->distSq.resize(padded);
+	s->point.resize(padded);
+	s->section.resize(padded);
+	s->segment.resize(padded);
+}
+
+static void add_sample(C2QSamples *s, const Point point, const QBezier *q, double u, int section, int segment)
+{
+	const Point rel = p_sub(point, q->p1);
+	const Point quad = p_sub(p_add(q->p1, q->p2), p_mul(q->c1, 2));
+	const Point lin = p_mul(p_sub(q->c1, q->p1), 2);
+	const size_t i = s->count++;
+	s->x[i] = rel.x;
+	s->y[i] = rel.y;
+	s->qx[i] = quad.x;
+	s->qy[i] = quad.y;
+	s->lx[i] = lin.x;
+	s->ly[i] = lin.y;
+	s->u[i] = u;
+	s->point[i] = point;
+	s->section[i] = section;
+	s->segment[i] = segment;
+}
+
+// Fills in distSq for every sample
+static void sample_distances(C2QSamples *s)
+{
+	const f32x4 zero = v_set(0), one = v_set(1), two = v_set(2);
+	for (size_t i = 0; i < s->count; i += 4) {
+		const f32x4 x = v_load(&s->x[i]), y = v_load(&s->y[i]);
+		const f32x4 qx = v_load(&s->qx[i]), qy = v_load(&s->qy[i]);
+		const f32x4 lx = v_load(&s->lx[i]), ly = v_load(&s->ly[i]);
+		f32x4 u = v_load(&s->u[i]);
+
+		// Minimizing |f(u) - point|^2, whose derivative is f'(u).(f(u) - point)
+		for (int step = 0; step < SAMPLE_NEWTON_STEPS; step++) {
+			const f32x4 dx = v_sub(v_mul(v_add(v_mul(qx, u), lx), u), x);
+			const f32x4 dy = v_sub(v_mul(v_add(v_mul(qy, u), ly), u), y);
+			const f32x4 fx = v_add(v_mul(v_mul(two, qx), u), lx);
+			const f32x4 fy = v_add(v_mul(v_mul(two, qy), u), ly);
+			const f32x4 d1 = v_add(v_mul(fx, dx), v_mul(fy, dy));
+			const f32x4 d2 = v_add(v_add(v_mul(fx, fx), v_mul(fy, fy)),
+				v_mul(two, v_add(v_mul(qx, dx), v_mul(qy, dy))));
+			// Only step where the function curves upwards
+			const f32x4 du = v_select(v_gt(d2, zero), v_div(d1, d2), zero);
+			u = v_min(v_max(v_sub(u, du), zero), one);
+		}
+
+		const f32x4 dx = v_sub(v_mul(v_add(v_mul(qx, u), lx), u), x);
+		const f32x4 dy = v_sub(v_mul(v_add(v_mul(qy, u), ly), u), y);
+		f32x4 distSq = v_add(v_mul(dx, dx), v_mul(dy, dy));
+
+		// Either end might be closer
+		distSq = v_min(distSq, v_add(v_mul(x, x), v_mul(y, y)));
+		const f32x4 ex = v_sub(v_add(qx, lx), x), ey = v_sub(v_add(qy, ly), y);
+		distSq = v_min(distSq, v_add(v_mul(ex, ex), v_mul(ey, ey)));
+		v_store(&s->distSq[i], distSq);
+	}
+}
+
+static void push_section(std::vector<C2QSection> *sections, const CBezier *cb, int cubic)
+{
+	C2QSection section;
+	Point pc[4];
+	calc_power_coefficients(cb->p1, cb->c1, cb->c2, cb->p2, pc);
+	section.a = pc[0];
+	section.b = pc[1];
+	section.c = pc[2];
+	section.d = pc[3];
+	section.curve = *cb;
+	section.cubic = cubic;
+	section.segments = 0;
+	section.failed = false;
+	sections->push_back(section);
+}
+
+int cubic2quad_batch(const double *in, int count, const double errorBound, double *out, int *outCounts)
+{
+	std::vector<C2QSection> &sections = tSections;
+	C2QSamples &samples = tSamples;
+	sections.clear();
+
+	// Split at inflections, like cubic_to_quad()
+	for (int i = 0; i < count; i++) {
+		const CBezier *cb = (const CBezier *)(in + i * 8);
+		double inflections[MAX_INFLECTIONS];
+		const int numInflections = solve_inflections(cb, inflections);
+
+		CBezier curve = *cb;
+		double prevPoint = 0;
+		CBezier split[2];
+		for (int j = 0; j < numInflections; j++) {
+			subdivide_cubic(&curve, 1 - (1 - inflections[j]) / (1 - prevPoint), split);
+			push_section(&sections, &split[0], i);
+			curve = split[1];
+			prevPoint = inflections[j];
+		}
+		push_section(&sections, &curve, i);
+	}
+
+	const float marginSq = (float)(errorBound * errorBound * (1 - SAMPLE_ERROR_MARGIN));
+	for (int segmentsCount = 1; segmentsCount <= MAX_SEGMENTS; segmentsCount++) {
+		size_t numSearching = 0;
+		for (size_t i = 0; i < sections.size(); i++) {
+			numSearching += sections[i].segments == 0;
+		}
+		if (numSearching == 0) {
+			break;
+		}
+		reset_samples(&samples, numSearching * segmentsCount * (SEGMENT_SAMPLES - 1));
+
+		for (size_t i = 0; i < sections.size(); i++) {
+			C2QSection *s = &sections[i];
+			if (s->segments != 0) {
+				continue;
+			}
+
+			for (int j = 0; j < segmentsCount; j++) {
+				double t = (double)j/(double)segmentsCount;
+				process_segment(s->a, s->b, s->c, s->d, t, t + 1.0/(double)segmentsCount, &s->approximation[j]);
+			}
+			if (segmentsCount == 1 && (
+				p_dot(p_sub(s->approximation[0].c1, s->curve.p1), p_sub(s->curve.c1, s->curve.p1)) < 0 ||
+				p_dot(p_sub(s->approximation[0].c1, s->curve.p2), p_sub(s->curve.c2, s->curve.p2)) < 0)) {
+				s->failed = true;
+				continue;
+			}
+			s->failed = false;
+
+			// Same points as _is_approximation_close()
+			const double dt = 1.0 / segmentsCount;
+			for (int j = 0; j < segmentsCount; j++) {
+				const double tmin = j * dt, tmax = (j + 1) * dt;
+				double ts[SEGMENT_SAMPLES];
+				const int nt = segment_samples(tmin, tmax, ts);
+				for (int k = 0; k < nt; k++) {
+					const Point point = calc_point(s->a, s->b, s->c, s->d, ts[k]);
+					add_sample(&samples, point, &s->approximation[j], (ts[k] - tmin) / (tmax - tmin), i, j);
+				}
+			}
+		}
+
+		sample_distances(&samples);
+		for (size_t i = 0; i < samples.count; i++) {
+			C2QSection *s = &sections[samples.section[i]];
+			if (samples.distSq[i] <= marginSq || s->failed) {
+				continue;
+			}
+			const QBezier *q = &s->approximation[samples.segment[i]];
+			if (min_distance_to_quad(samples.point[i], q->p1, q->c1, q->p2) > errorBound) {
+				s->failed = true;
+			}
+		}
+
+		for (size_t i = 0; i < sections.size(); i++) {
+			if (sections[i].segments == 0 && !sections[i].failed) {
+				sections[i].segments = segmentsCount;
+			}
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		outCounts[i] = 0;
+	}
+	int nq = 0;
+	QBezier *result = (QBezier *)out;
+	for (size_t i = 0; i < sections.size(); i++) {
+		const C2QSection *s = &sections[i];
+		const int segments = s->segments ? s->segments : MAX_SEGMENTS;
+		for (int j = 0; j < segments; j++) {
+			result[nq++] = s->approximation[j];
+		}
+		outCounts[s->cubic] += segments;
+	}
+	return nq;
+}
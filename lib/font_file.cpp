@@ -0,0 +1,51 @@
+#include "font_file.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+
+FontFile::~FontFile() {
+	munmap((void *)this->data, this->size);
+}
+
+std::shared_ptr<FontFile> FontFile::Map(const std::string &path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return nullptr;
+	}
+	struct stat st;
+	void *mapped = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		return nullptr;
+	}
+	return std::shared_ptr<FontFile>(new FontFile((const uint8_t *)mapped, st.st_size));
+}
+
+uint64_t FontFile::Hash() const {
+	if (this->hash) {
+		return this->hash;
+	}
+
+	// FNV-1a, a word at a time since fonts can be tens of megabytes
+	uint64_t hash = 14695981039346656037ull;
+	size_t i = 0;
+	for (; i + 8 <= this->size; i += 8) {
+		uint64_t word;
+		memcpy(&word, this->data + i, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ull;
+	}
+	for (; i < this->size; i++) {
+		hash = (hash ^ this->data[i]) * 1099511628211ull;
+	}
+	this->hash = hash ? hash : 1;
+	return this->hash;
+}
+
+FT_Error FontFile::OpenFace(FT_Library ft, FT_Long faceIndex, FT_Face *face) const {
+	return FT_New_Memory_Face(ft, this->data, this->size, faceIndex, face);
+}
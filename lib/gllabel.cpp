@@ -20,685 +20,3108 @@
 #include "vgrid.hpp"
 #include "outline.hpp"
 #include <set>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <glm/gtc/type_ptr.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define sq(x) ((x)*(x))
 
-static GLuint loadShaderProgram(const char* vPath, const char* fPath);
-
 std::shared_ptr<GLFontManager> GLFontManager::singleton = nullptr;
 
-static const char* kGlyphVertexShaderPath = "./shaders/glyphVertex.glsl";
-static const char* kGlyphFragmentShaderPath = "./shaders/glyphFragment.glsl";
+std::string GLFontManager::shaderCacheDir;
+
+// kGlyphVertexShaderSource, kGlyphFragmentShaderSource and the texture
+// shader's sources, generated from shaders/ by the Makefile
+#include "glyph_shaders.inc"
+
+// Fragment shader variant for each GLFontManager::Quality. See kSamples in
+// the shader.
+static const char* kGlyphShaderQualityDefines[GLFontManager::kNumQualities] = {
+	"#define kSamples 2\n",
+	"#define kSamples 3\n",
+	"#define kSamples 4\n",
+	"#define kSamples 0\n",
+};
 
-static const uint8_t kGridMaxSize = 20;
-static const uint16_t kGridAtlasSize = 256; // Fits exactly 1024 8x8 grids
-static const uint16_t kBezierAtlasSize = 256; // Fits around 700-1000 glyphs, depending on their curves
+static const uint8_t kGridMaxSize = 20; // Finest grid, on a glyph's long side
+static const uint16_t kGridAtlasSize = 1024; // Fits exactly 16384 8x8 grids
 static const uint8_t kAtlasChannels = 4; // Must be 4 (RGBA), otherwise code breaks
+static const size_t kGridTexelBytes = kAtlasChannels * sizeof(uint16_t); // RGBA16UI
+// Keeps glyph data offsets well within the ints the shaders index with
+static const size_t kMaxGlyphDataSize = 1 << 30;
+static const size_t kStagingBufSize = 1 << 21; // Fits many frames of new glyphs
+
+// Glyph data starts with four header pixels: the grid's XY position in the
+// grid atlas, the grid's width and height, the grid atlas layer (plus two
+// unused bytes), and the glyph's width and height in FT units. See
+// write_glyph_data_to_buffer().
+// The first header in the glyph data is all zeros, for glyphs without any
+// curves. Their quads come out empty, so they never reach the fragment shader.
+static const uint8_t kGlyphHeaderPixels = 4;
+
+// Every glyph's data starts on an even texel, so the vertex shader can read
+// the header as two RGBA16UI texels instead of four RG16UI ones. Returns the
+// offset for a glyph appended after what's there.
+static size_t next_glyph_data_offset(const std::vector<uint8_t>& glyphData) {
+	return ((glyphData.size() / kAtlasChannels) + 1) & ~(size_t)1;
+}
+
+// Microseconds from `start` to now, for the stats timings
+static double us_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Texel offset of a glyph's data in the manager's glyph data buffer.
+static uint32_t glyph_data_offset(GLFontManager::Glyph *glyph) {
+	if (glyph->atlasIndex == UINT16_MAX) {
+		return 0; // Glyph has no curves and isn't in any atlas
+	}
+	return glyph->glyphDataOffset;
+}
+
+// Lets go of the glyphs of characters [from, to) of a line
+static void release_glyphs(GLFontManager* manager, const std::vector<GLFontManager::Glyph*>& glyphs, size_t from, size_t to) {
+	for (size_t i = from; i < to; i++) {
+		if (glyphs[i]) {
+			manager->ReleaseGlyph(glyphs[i]);
+		}
+	}
+}
+
+std::atomic<uint64_t> GLLabel::lastVersion(0);
+
+// Instance slots given to a line of `size` characters, leaving it room to
+// grow before it has to move
+static size_t line_capacity(size_t size) {
+	return size + size / 2 + 8;
+}
+
+// Palette entries every label starts with, see GLLabel::palette
+static const uint8_t kSelectionColor = 0;
+static const uint8_t kCaretColor = 1;
+static const uint8_t kFirstTextColor = 2;
+
+static GLLabel::Color to_color(glm::vec4 color) {
+	return GLLabel::Color{
+		(uint8_t)(color.r * 255),
+		(uint8_t)(color.g * 255),
+		(uint8_t)(color.b * 255),
+		(uint8_t)(color.a * 255)};
+}
+
+glm::vec2 GLLabel::PenAfter(const Line& line, size_t column) {
+	glm::vec2 pen = line.instances[column].pos;
+	GLFontManager::Glyph* glyph = line.glyphs[column];
+	if (glyph) {
+		pen += -glm::vec2(glyph->offset[0], glyph->offset[1]) + glm::vec2(glyph->advance + line.kerning[column], 0);
+	}
+	return pen;
+}
+
+glm::vec2 GLLabel::PenBefore(const Line& line, size_t column) {
+	if (column == 0) {
+		return glm::vec2(0, 0);
+	}
+	return PenAfter(line, column - 1);
+}
+
+// Points the bound vertex array's attributes at the instances of the bound
+// GL_ARRAY_BUFFER, starting from instance `first`
+void GLLabel::PointInstanceAttribs(size_t stride, size_t first) {
+	const char* base = (const char*)(first * stride);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, base + offsetof(GLLabel::GlyphInstance, pos));
+	glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, stride, base + offsetof(GLLabel::GlyphInstance, glyphDataOffset));
+	glVertexAttribIPointer(4, 1, GL_UNSIGNED_INT, stride, base + offsetof(GLLabel::GlyphInstance, lineAndColor));
+	if (stride == sizeof(OverlayInstance)) {
+		glVertexAttribPointer(5, 2, GL_FLOAT, GL_FALSE, stride, base + offsetof(OverlayInstance, size));
+	}
+}
 
-GLLabel::GLLabel()
-	: showingCaret(false), caretPosition(0), prevTime(0) {
+GLLabel::GLLabel(std::shared_ptr<GLFontManager> manager)
+	: textLength(0), lineOffsetsDirty(true), cullChunksDirty(true), culling(true), drawIndirectBufCapacity(0), coverageCache(), instanceBufferUsed(0), instanceBufferCapacity(0),
+	showingCaret(false), caretPosition(0), prevTime(0), caretTime(0),
+	selectionStart(0), selectionEnd(0), paletteVersion(++GLLabel::lastVersion), uploadedPaletteVersion(0), numSelectionRects(0),
+	hasCaretOverlay(false), caretGlyph(nullptr), overlayBufferCapacity(0), overlayVersion(++GLLabel::lastVersion),
+	builtOverlayVersion(0), uploadedOverlayVersion(0),
+	asyncGlyphs(false), seenGlyphCommits(0), quality(Quality::High), seenAtlasGeneration(0), layoutOptions(kDefaultLayoutOptions), stats(), version(++GLLabel::lastVersion) {
 	// this->lastColor = {0,0,0,255};
-	this->manager = GLFontManager::GetFontManager();
+	this->manager = manager ? manager : GLFontManager::GetFontManager();
 	// this->lastFace = this->manager->GetDefaultFont();
 	// this->manager->LoadASCII(this->lastFace);
 
-	glGenBuffers(1, &this->vertBuffer);
-	glGenBuffers(1, &this->caretBuffer);
+	Line line{};
+	line.id = this->NewLineId();
+	this->lines.push_back(line);
+
+	this->palette.push_back(Color{0, 0, 255, 50}); // kSelectionColor
+	this->palette.push_back(Color{0, 0, 255, 100}); // kCaretColor
+	this->paletteUses.assign(kFirstTextColor, PaletteUse{0, true});
+
+	glGenBuffers(1, &this->instanceBuffer);
+	glGenBuffers(1, &this->overlayBuffer);
+	glGenBuffers(1, &this->drawIndirectBuf);
+
+	glGenBuffers(1, &this->lineOffsetBuf);
+	glBindBuffer(GL_TEXTURE_BUFFER, this->lineOffsetBuf);
+	glGenTextures(1, &this->lineOffsetBufTex);
+	glBindTexture(GL_TEXTURE_BUFFER, this->lineOffsetBufTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32F, this->lineOffsetBuf);
+
+	glGenBuffers(1, &this->paletteBuf);
+	glBindBuffer(GL_TEXTURE_BUFFER, this->paletteBuf);
+	glGenTextures(1, &this->paletteBufTex);
+	glBindTexture(GL_TEXTURE_BUFFER, this->paletteBufTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8, this->paletteBuf);
+	this->manager->ResetRenderState();
+
+	// Every attribute is per instance, which the vertex shader expands
+	// into a quad. Overlays also have their own size.
+	auto setupVertexArray = [this](GLuint* vertexArray, GLuint buffer, size_t stride, size_t first) {
+		glGenVertexArrays(1, vertexArray);
+		this->manager->BindVertexArray(*vertexArray);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		PointInstanceAttribs(stride, first);
+		GLuint attribs[] = {0, 1, 4, 5};
+		size_t numAttribs = (stride == sizeof(OverlayInstance)) ? 4 : 3;
+		for (size_t i = 0; i < numAttribs; i++) {
+			glEnableVertexAttribArray(attribs[i]);
+			glVertexAttribDivisor(attribs[i], 1);
+		}
+	};
+	setupVertexArray(&this->vertexArray, this->instanceBuffer, sizeof(GlyphInstance), 0);
+	setupVertexArray(&this->caretVertexArray, this->overlayBuffer, sizeof(OverlayInstance), 0);
+	setupVertexArray(&this->selectionVertexArray, this->overlayBuffer, sizeof(OverlayInstance), 1);
 }
 
 GLLabel::~GLLabel() {
-	glDeleteBuffers(1, &this->vertBuffer);
-	glDeleteBuffers(1, &this->caretBuffer);
+	for (size_t i = 0; i < this->lines.size(); i++) {
+		release_glyphs(this->manager.get(), this->lines[i].glyphs, 0, this->lines[i].glyphs.size());
+	}
+	if (this->caretGlyph) {
+		this->manager->ReleaseGlyph(this->caretGlyph);
+	}
+
+	glDeleteBuffers(1, &this->instanceBuffer);
+	glDeleteBuffers(1, &this->overlayBuffer);
+	glDeleteBuffers(1, &this->drawIndirectBuf);
+	if (this->coverageCache.texture) {
+		glDeleteFramebuffers(1, &this->coverageCache.framebuffer);
+		glDeleteTextures(1, &this->coverageCache.texture);
+	}
+	GLuint vertexArrays[] = {this->vertexArray, this->caretVertexArray, this->selectionVertexArray};
+	glDeleteVertexArrays(3, vertexArrays);
+	this->manager->ResetRenderState();
+	glDeleteTextures(1, &this->lineOffsetBufTex);
+	glDeleteBuffers(1, &this->lineOffsetBuf);
+	glDeleteTextures(1, &this->paletteBufTex);
+	glDeleteBuffers(1, &this->paletteBuf);
 }
 
-void GLLabel::InsertText(std::u32string text, size_t index, glm::vec4 color, FT_Face face) {
-	if (index > this->text.size()) {
-		index = this->text.size();
+size_t GLLabel::FindLine(size_t index, size_t* column) {
+	for (size_t i = 0; i + 1 < this->lines.size(); i++) {
+		if (index < this->lines[i].text.size()) {
+			*column = index;
+			return i;
+		}
+		index -= this->lines[i].text.size();
+	}
+
+	*column = std::min(index, this->lines.back().text.size());
+	return this->lines.size() - 1;
+}
+
+uint32_t GLLabel::NewLineId() {
+	if (!this->freeLineIds.empty()) {
+		uint32_t id = this->freeLineIds.back();
+		this->freeLineIds.pop_back();
+		return id;
+	}
+	this->lineOffsets.push_back(glm::vec2(0, 0));
+	return this->lineOffsets.size() - 1;
+}
+
+// Grows the line's bounds to take in the quad of the glyph at `column`
+void GLLabel::ExtendBounds(Line& line, size_t column) {
+	GLFontManager::Glyph* glyph = line.glyphs[column];
+	if (!glyph || glyph->atlasIndex == UINT16_MAX) {
+		return; // Draws nothing
+	}
+	glm::vec2 pos = line.instances[column].pos;
+	line.boundsMin = glm::min(line.boundsMin, pos);
+	line.boundsMax = glm::max(line.boundsMax, pos + glm::vec2(glyph->size[0], glyph->size[1]));
+}
+
+// Positions the characters of the line from `fromColumn` on, relative to
+// the start of the line
+void GLLabel::LayoutLine(Line& line, size_t fromColumn) {
+	glm::vec2 pen(0, 0);
+	if (fromColumn > 0) {
+		pen = PenAfter(line, fromColumn - 1);
+	}
+
+	line.boundsMin = glm::vec2(INFINITY, INFINITY);
+	line.boundsMax = glm::vec2(-INFINITY, -INFINITY);
+	for (size_t i = 0; i < fromColumn; i++) {
+		ExtendBounds(line, i);
+	}
+
+	for (size_t i = fromColumn; i < line.text.size(); i++) {
+		GlyphInstance& instance = line.instances[i];
+		GLFontManager::Glyph* glyph = line.glyphs[i];
+		instance.SetLineId(line.id);
+
+		if (line.text[i] == '\t') {
+			pen.x = layout_tab_stop(pen.x, this->layoutOptions);
+		}
+
+		if (glyph) {
+			instance.pos = pen + glm::vec2(glyph->offset[0], glyph->offset[1]);
+			pen.x += glyph->advance + line.kerning[i];
+		}
+		else {
+			instance.pos = pen;
+		}
+		ExtendBounds(line, i);
+	}
+
+	line.dirty = true;
+	this->cullChunksDirty = true;
+}
+
+void GLLabel::UpdateKerning(Line& line, size_t column) {
+	line.kerning[column] = 0;
+	if (column + 1 < line.text.size()) {
+		line.kerning[column] = this->manager->GetKerning(
+			line.glyphs[column], line.text[column],
+			line.glyphs[column + 1], line.text[column + 1], this->layoutOptions);
+	}
+}
+
+void GLLabel::SetLayoutOptions(const LayoutOptions& options) {
+	this->layoutOptions = options;
+	for (size_t i = 0; i < this->lines.size(); i++) {
+		Line& line = this->lines[i];
+		for (size_t column = 0; column < line.text.size(); column++) {
+			this->UpdateKerning(line, column);
+		}
+		this->LayoutLine(line, 0);
+	}
+	version = overlayVersion = ++GLLabel::lastVersion;
+}
+
+void GLLabel::UpdateLineOffsets() {
+	glm::vec2 origin(0, 0);
+	for (size_t i = 0; i < this->lines.size(); i++) {
+		this->lineOffsets[this->lines[i].id] = origin;
+		origin.y -= this->lines[i].height;
+	}
+	this->lineOffsetsDirty = true;
+	this->cullChunksDirty = true;
+}
+
+std::u32string GLLabel::GetText() {
+	std::u32string text;
+	text.reserve(this->textLength);
+	for (size_t i = 0; i < this->lines.size(); i++) {
+		text += this->lines[i].text;
 	}
+	return text;
+}
 
-	this->text.insert(index, text);
-	this->glyphs.insert(this->glyphs.begin() + index, text.size(), nullptr);
+void GLLabel::InsertText(std::u32string text, size_t index, glm::vec4 color, FT_Face face) {
+	this->InsertText(text, index, this->FindColor(to_color(color), false), face);
+}
 
-	size_t prevCapacity = this->verts.capacity();
-	GlyphVertex emptyVert{};
-	this->verts.insert(this->verts.begin() + index * 6, text.size() * 6, emptyVert);
+void GLLabel::InsertText(std::u32string text, size_t index, uint8_t color, FT_Face face) {
+	if (color >= this->palette.size()) {
+		std::cerr << "WARN: No color " << (int)color << " in the label's palette\n";
+		return;
+	}
+	if (index > this->textLength) {
+		index = this->textLength;
+	}
 
-	glm::vec2 appendOffset(0, 0);
-	if (index > 0) {
-		appendOffset = this->verts[(index - 1) * 6].pos;
-		if (this->glyphs[index - 1]) {
-			appendOffset += -glm::vec2(this->glyphs[index - 1]->offset[0], this->glyphs[index - 1]->offset[1]) + glm::vec2(this->glyphs[index - 1]->advance, 0);
+	for (size_t i = 0; i < this->pendingGlyphs.size(); i++) {
+		if (this->pendingGlyphs[i].index >= index) {
+			this->pendingGlyphs[i].index += text.size();
 		}
 	}
-	glm::vec2 initialAppendOffset = appendOffset;
+
+	size_t column;
+	size_t lineIdx = this->FindLine(index, &column);
+
+	// Take the rest of the line out, the new text goes in front of it
+	Line& first = this->lines[lineIdx];
+	std::u32string tailText = first.text.substr(column);
+	std::vector<GlyphInstance> tailInstances(first.instances.begin() + column, first.instances.end());
+	std::vector<GLFontManager::Glyph*> tailGlyphs(first.glyphs.begin() + column, first.glyphs.end());
+	std::vector<float> tailKerning(first.kerning.begin() + column, first.kerning.end());
+	float tailHeight = first.height;
+	first.text.erase(column);
+	first.instances.erase(first.instances.begin() + column, first.instances.end());
+	first.glyphs.erase(first.glyphs.begin() + column, first.glyphs.end());
+	first.kerning.erase(first.kerning.begin() + column, first.kerning.end());
+
+	// Kerning within the new text comes from its layout, and only the pairs
+	// where it meets the old text need working out separately
+	const std::vector<LayoutGlyph>& layout = this->manager->GetLayout(face, text, this->layoutOptions);
+
+	this->paletteUses[color].chars += text.size();
+	size_t layoutFrom = column;
+	bool splitLines = false;
 
 	for (size_t i = 0; i < text.size(); i++) {
-		if (text[i] == '\r') {
-			this->verts[(index + i) * 6].pos = appendOffset;
-			continue;
+		GlyphInstance instance{};
+		instance.SetColorIndex(color);
+
+		GLFontManager::Glyph* glyph = nullptr;
+		if (text[i] != '\r' && text[i] != '\n' && text[i] != '\t') {
+			if (this->asyncGlyphs) {
+				bool pending;
+				glyph = this->manager->GetGlyphOrRequest(face, text[i], &pending);
+				if (pending) {
+					this->pendingGlyphs.push_back(PendingGlyph{index + i, face});
+					glyph = this->manager->GetGlyphForCodepoint(face, 0);
+				}
+			}
+			else {
+				glyph = this->manager->GetGlyphForCodepoint(face, text[i]);
+			}
+			if (glyph) {
+				instance.glyphDataOffset = glyph_data_offset(glyph);
+				this->manager->RetainGlyph(glyph);
+			}
 		}
-		else if (text[i] == '\n') {
-			appendOffset.x = 0;
-			appendOffset.y -= face->height;
-			this->verts[(index + i) * 6].pos = appendOffset;
-			continue;
+
+		Line& line = this->lines[lineIdx];
+		line.text.push_back(text[i]);
+		line.instances.push_back(instance);
+		line.glyphs.push_back(glyph);
+		line.kerning.push_back(layout[i].kerning);
+		if (i == 0 && column > 0) {
+			this->UpdateKerning(line, column - 1);
 		}
-		else if (text[i] == '\t') {
-			appendOffset.x += 2000;
-			this->verts[(index + i) * 6].pos = appendOffset;
-			continue;
+
+		if (text[i] == '\n') {
+			line.height = face->height;
+			this->LayoutLine(line, layoutFrom);
+
+			Line next{};
+			next.id = this->NewLineId();
+			this->lines.insert(this->lines.begin() + lineIdx + 1, next);
+			lineIdx++;
+			layoutFrom = 0;
+			splitLines = true;
+		}
+	}
+
+	Line& last = this->lines[lineIdx];
+	last.text += tailText;
+	last.instances.insert(last.instances.end(), tailInstances.begin(), tailInstances.end());
+	size_t lastColumn = last.text.size() - tailText.size();
+	last.glyphs.insert(last.glyphs.end(), tailGlyphs.begin(), tailGlyphs.end());
+	last.kerning.insert(last.kerning.end(), tailKerning.begin(), tailKerning.end());
+	last.height = tailHeight;
+	if (lastColumn > 0 && !text.empty()) {
+		this->UpdateKerning(last, lastColumn - 1);
+	}
+	this->LayoutLine(last, layoutFrom);
+
+	if (splitLines) {
+		this->UpdateLineOffsets();
+	}
+
+	this->textLength += text.size();
+	caretTime = 0;
+	version = overlayVersion = ++GLLabel::lastVersion;
+}
+
+void GLLabel::RemoveText(size_t index, size_t length) {
+	if (index >= this->textLength) {
+		return;
+	}
+	if (index + length > this->textLength) {
+		length = this->textLength - index;
+	}
+
+	for (size_t i = 0; i < this->pendingGlyphs.size(); i++) {
+		PendingGlyph& pending = this->pendingGlyphs[i];
+		if (pending.index >= index + length) {
+			pending.index -= length;
+		}
+		else if (pending.index >= index) {
+			this->pendingGlyphs.erase(this->pendingGlyphs.begin() + i);
+			i--;
+		}
+	}
+
+	size_t startColumn, endColumn;
+	size_t startLine = this->FindLine(index, &startColumn);
+	size_t endLine = this->FindLine(index + length, &endColumn);
+
+	Line& first = this->lines[startLine];
+	if (startLine == endLine) {
+		release_glyphs(this->manager.get(), first.glyphs, startColumn, endColumn);
+		this->ReleaseColors(first, startColumn, endColumn);
+		first.text.erase(startColumn, endColumn - startColumn);
+		first.instances.erase(first.instances.begin() + startColumn, first.instances.begin() + endColumn);
+		first.glyphs.erase(first.glyphs.begin() + startColumn, first.glyphs.begin() + endColumn);
+		first.kerning.erase(first.kerning.begin() + startColumn, first.kerning.begin() + endColumn);
+	}
+	else {
+		// Join what's left of the first and last lines, and drop the ones
+		// in between
+		Line& end = this->lines[endLine];
+		release_glyphs(this->manager.get(), first.glyphs, startColumn, first.glyphs.size());
+		release_glyphs(this->manager.get(), end.glyphs, 0, endColumn);
+		this->ReleaseColors(first, startColumn, first.instances.size());
+		this->ReleaseColors(end, 0, endColumn);
+		for (size_t i = startLine + 1; i < endLine; i++) {
+			release_glyphs(this->manager.get(), this->lines[i].glyphs, 0, this->lines[i].glyphs.size());
+			this->ReleaseColors(this->lines[i], 0, this->lines[i].instances.size());
+		}
+		first.text.erase(startColumn);
+		first.instances.erase(first.instances.begin() + startColumn, first.instances.end());
+		first.glyphs.erase(first.glyphs.begin() + startColumn, first.glyphs.end());
+		first.kerning.erase(first.kerning.begin() + startColumn, first.kerning.end());
+		first.text.append(end.text, endColumn, std::u32string::npos);
+		first.instances.insert(first.instances.end(), end.instances.begin() + endColumn, end.instances.end());
+		first.glyphs.insert(first.glyphs.end(), end.glyphs.begin() + endColumn, end.glyphs.end());
+		first.kerning.insert(first.kerning.end(), end.kerning.begin() + endColumn, end.kerning.end());
+		first.height = end.height;
+
+		for (size_t i = startLine + 1; i <= endLine; i++) {
+			this->freeLineIds.push_back(this->lines[i].id);
+			if (this->lines[i].bufferCapacity > 0) {
+				this->staleRegions.push_back(std::make_pair(this->lines[i].bufferStart, this->lines[i].bufferCapacity));
+			}
+		}
+		this->lines.erase(this->lines.begin() + startLine + 1, this->lines.begin() + endLine + 1);
+		this->UpdateLineOffsets();
+	}
+	if (startColumn > 0) {
+		this->UpdateKerning(this->lines[startLine], startColumn - 1);
+	}
+	this->LayoutLine(this->lines[startLine], startColumn);
+
+	this->textLength -= length;
+	caretTime = 0;
+	version = overlayVersion = ++GLLabel::lastVersion;
+}
+
+void GLLabel::UploadLines() {
+	// Compact the buffer once most of it is gaps, moving every line
+	bool reupload = false;
+	if (this->instanceBufferUsed > line_capacity(this->textLength * 2)) {
+		this->instanceBufferUsed = 0;
+		for (size_t i = 0; i < this->lines.size(); i++) {
+			this->lines[i].bufferCapacity = 0;
+		}
+		reupload = true;
+	}
+
+	// Lines that outgrew their slots move to the end of the buffer
+	for (size_t i = 0; i < this->lines.size(); i++) {
+		Line& line = this->lines[i];
+		if (line.instances.size() > line.bufferCapacity || (reupload && line.bufferCapacity == 0)) {
+			if (line.bufferCapacity > 0) {
+				this->staleRegions.push_back(std::make_pair(line.bufferStart, line.bufferCapacity));
+			}
+			line.bufferStart = this->instanceBufferUsed;
+			line.bufferCapacity = line_capacity(line.instances.size());
+			this->instanceBufferUsed += line.bufferCapacity;
+			line.dirty = true;
+		}
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, this->instanceBuffer);
+	if (this->instanceBufferUsed > this->instanceBufferCapacity) {
+		this->instanceBufferCapacity = std::max(this->instanceBufferCapacity * 2, this->instanceBufferUsed);
+		glBufferData(GL_ARRAY_BUFFER, this->instanceBufferCapacity * sizeof(GlyphInstance), NULL, GL_DYNAMIC_DRAW);
+		reupload = true;
+	}
+
+	std::vector<GlyphInstance> upload;
+	if (reupload) {
+		// Everything at once, gaps included
+		upload.resize(this->instanceBufferUsed, GlyphInstance{});
+		for (size_t i = 0; i < this->lines.size(); i++) {
+			Line& line = this->lines[i];
+			std::copy(line.instances.begin(), line.instances.end(), upload.begin() + line.bufferStart);
+			line.dirty = false;
+		}
+		if (!upload.empty()) {
+			glBufferSubData(GL_ARRAY_BUFFER, 0, upload.size() * sizeof(GlyphInstance), &upload[0]);
+		}
+		this->staleRegions.clear();
+		this->stats.uploadedBytes += upload.size() * sizeof(GlyphInstance);
+		this->stats.reuploads++;
+	}
+	else {
+		for (size_t i = 0; i < this->staleRegions.size(); i++) {
+			upload.assign(this->staleRegions[i].second, GlyphInstance{});
+			glBufferSubData(GL_ARRAY_BUFFER, this->staleRegions[i].first * sizeof(GlyphInstance),
+				upload.size() * sizeof(GlyphInstance), &upload[0]);
+			this->stats.uploadedBytes += upload.size() * sizeof(GlyphInstance);
+		}
+		this->staleRegions.clear();
+
+		// A line's whole slot is uploaded, to clear out anything it had
+		// past its current end
+		for (size_t i = 0; i < this->lines.size(); i++) {
+			Line& line = this->lines[i];
+			if (!line.dirty) {
+				continue;
+			}
+			upload.assign(line.instances.begin(), line.instances.end());
+			upload.resize(line.bufferCapacity, GlyphInstance{});
+			glBufferSubData(GL_ARRAY_BUFFER, line.bufferStart * sizeof(GlyphInstance),
+				upload.size() * sizeof(GlyphInstance), &upload[0]);
+			this->stats.uploadedBytes += upload.size() * sizeof(GlyphInstance);
+			line.dirty = false;
+		}
+	}
+
+	if (this->lineOffsetsDirty) {
+		glBindBuffer(GL_TEXTURE_BUFFER, this->lineOffsetBuf);
+		glBufferData(GL_TEXTURE_BUFFER, this->lineOffsets.size() * sizeof(glm::vec2),
+			&this->lineOffsets[0], GL_DYNAMIC_DRAW);
+		this->stats.uploadedBytes += this->lineOffsets.size() * sizeof(glm::vec2);
+		this->lineOffsetsDirty = false;
+	}
+}
+
+// Whether any of a box (in the label's plane) might be in view once drawn
+// with `transform`. It's out if all its corners are beyond the same side
+// of the clip volume.
+static bool box_in_view(const glm::mat4& transform, glm::vec2 min, glm::vec2 max) {
+	if (min.x > max.x) {
+		return false;
+	}
+	glm::vec4 corners[4] = {
+		transform * glm::vec4(min.x, min.y, 0, 1),
+		transform * glm::vec4(max.x, min.y, 0, 1),
+		transform * glm::vec4(min.x, max.y, 0, 1),
+		transform * glm::vec4(max.x, max.y, 0, 1)};
+	for (int axis = 0; axis < 3; axis++) {
+		bool allBelow = true, allAbove = true;
+		for (int i = 0; i < 4; i++) {
+			allBelow = allBelow && corners[i][axis] < -corners[i].w;
+			allAbove = allAbove && corners[i][axis] > corners[i].w;
+		}
+		if (allBelow || allAbove) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Empty instances drawn through between two lines' slots cost less than
+// another draw call up to about this many
+static const size_t kMaxDrawRangeGap = 256;
+
+void GLLabel::FindDrawRanges(const glm::mat4& transform) {
+	this->drawRanges.clear();
+	this->stats.culledLines = 0;
+	if (!this->culling || this->lines.size() <= kCullChunkLines) {
+		if (this->instanceBufferUsed > 0) {
+			this->drawRanges.push_back(std::make_pair(0, this->instanceBufferUsed));
+		}
+		return;
+	}
+
+	if (this->cullChunksDirty) {
+		this->cullChunks.resize((this->lines.size() + kCullChunkLines - 1) / kCullChunkLines);
+		for (size_t i = 0; i < this->cullChunks.size(); i++) {
+			CullChunk& chunk = this->cullChunks[i];
+			chunk.boundsMin = glm::vec2(INFINITY, INFINITY);
+			chunk.boundsMax = glm::vec2(-INFINITY, -INFINITY);
+			size_t end = std::min((i + 1) * kCullChunkLines, this->lines.size());
+			for (size_t j = i * kCullChunkLines; j < end; j++) {
+				const Line& line = this->lines[j];
+				if (line.boundsMin.x <= line.boundsMax.x) {
+					glm::vec2 origin = this->lineOffsets[line.id];
+					chunk.boundsMin = glm::min(chunk.boundsMin, origin + line.boundsMin);
+					chunk.boundsMax = glm::max(chunk.boundsMax, origin + line.boundsMax);
+				}
+			}
 		}
+		this->cullChunksDirty = false;
+	}
 
-		GLFontManager::Glyph* glyph = this->manager->GetGlyphForCodepoint(face, text[i]);
-		if (!glyph) {
-			this->verts[(index + i) * 6].pos = appendOffset;
+	for (size_t i = 0; i < this->cullChunks.size(); i++) {
+		size_t end = std::min((i + 1) * kCullChunkLines, this->lines.size());
+		if (!box_in_view(transform, this->cullChunks[i].boundsMin, this->cullChunks[i].boundsMax)) {
+			this->stats.culledLines += end - i * kCullChunkLines;
 			continue;
 		}
+		for (size_t j = i * kCullChunkLines; j < end; j++) {
+			const Line& line = this->lines[j];
+			glm::vec2 origin = this->lineOffsets[line.id];
+			if (!box_in_view(transform, origin + line.boundsMin, origin + line.boundsMax)) {
+				this->stats.culledLines++;
+				continue;
+			}
+			this->drawRanges.push_back(std::make_pair(line.bufferStart, line.instances.size()));
+		}
+	}
 
-		GlyphVertex v[6]{}; // Insertion code depends on v[0] equaling appendOffset (therefore it is also set before continue;s above)
-		v[0].pos = glm::vec2(0, 0);
-		v[1].pos = glm::vec2(glyph->size[0], 0);
-		v[2].pos = glm::vec2(0, glyph->size[1]);
-		v[3].pos = glm::vec2(glyph->size[0], glyph->size[1]);
-		v[4].pos = glm::vec2(0, glyph->size[1]);
-		v[5].pos = glm::vec2(glyph->size[0], 0);
-		for (unsigned int j = 0; j < 6; j++) {
-			v[j].pos += appendOffset;
-			v[j].pos[0] += glyph->offset[0];
-			v[j].pos[1] += glyph->offset[1];
-
-			v[j].color = { (uint8_t)(color.r * 255), (uint8_t)(color.g * 255), (uint8_t)(color.b * 255), (uint8_t)(color.a * 255) };
-
-			// Encode both the bezier position and the norm coord into one int
-			// This theoretically could overflow, but the atlas position will
-			// never be over half the size of a uint16, so it's fine.
-			unsigned int k = (j < 4) ? j : 6 - j;
-			unsigned int normX = k & 1;
-			unsigned int normY = k > 1;
-			unsigned int norm = (normX << 1) + normY;
-			v[j].data = (glyph->bezierAtlasPos[0] << 2) + norm;
-			this->verts[(index + i) * 6 + j] = v[j];
-		}
-
-		appendOffset.x += glyph->advance;
-		this->glyphs[index + i] = glyph;
-	}
-
-	// Shift everything after, if necessary
-	glm::vec2 deltaAppend = appendOffset - initialAppendOffset;
-	for (size_t i = index + text.size(); i < this->text.size(); i++) {
-		// If a newline is reached and no change in the y has happened, all
-		// glyphs which need to be moved have been moved.
-		if (this->text[i] == '\n') {
-			if (deltaAppend.y == 0) {
-				break;
+	// Lines mostly sit in the buffer in order, so this is usually one range
+	std::sort(this->drawRanges.begin(), this->drawRanges.end());
+	size_t merged = 0;
+	for (size_t i = 1; i < this->drawRanges.size(); i++) {
+		std::pair<size_t, size_t>& last = this->drawRanges[merged];
+		size_t lastEnd = last.first + last.second;
+		if (this->drawRanges[i].first <= lastEnd + kMaxDrawRangeGap) {
+			last.second = this->drawRanges[i].first + this->drawRanges[i].second - last.first;
+		}
+		else {
+			this->drawRanges[++merged] = this->drawRanges[i];
+		}
+	}
+	if (!this->drawRanges.empty()) {
+		this->drawRanges.resize(merged + 1);
+	}
+}
+
+void GLLabel::DrawRanges() {
+	if (this->drawRanges.size() == 1 && this->drawRanges[0].first == 0) {
+		glDrawArraysInstanced(GL_TRIANGLES, 0, 6, this->drawRanges[0].second);
+		return;
+	}
+
+	// One call for every range, as long as instances can start mid-buffer.
+	// Before GL 4.2 baseInstance is reserved and must be 0 without
+	// ARB_base_instance, which would draw every range from the first line.
+	if (GLEW_ARB_multi_draw_indirect && (GLEW_ARB_base_instance || GLEW_VERSION_4_2)) {
+		struct DrawArraysIndirectCommand
+		{
+			GLuint count, instanceCount, first, baseInstance;
+		};
+		std::vector<DrawArraysIndirectCommand> commands(this->drawRanges.size());
+		for (size_t i = 0; i < this->drawRanges.size(); i++) {
+			commands[i].count = 6;
+			commands[i].instanceCount = this->drawRanges[i].second;
+			commands[i].first = 0;
+			commands[i].baseInstance = this->drawRanges[i].first;
+		}
+		size_t size = commands.size() * sizeof(DrawArraysIndirectCommand);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, this->drawIndirectBuf);
+		if (size > this->drawIndirectBufCapacity) {
+			this->drawIndirectBufCapacity = std::max(this->drawIndirectBufCapacity * 2, size);
+			glBufferData(GL_DRAW_INDIRECT_BUFFER, this->drawIndirectBufCapacity, NULL, GL_STREAM_DRAW);
+		}
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, size, &commands[0]);
+		glMultiDrawArraysIndirect(GL_TRIANGLES, 0, commands.size(), 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		return;
+	}
+
+	// Otherwise the instance attributes are pointed at each range in turn,
+	// and back at the start of the buffer after
+	glBindBuffer(GL_ARRAY_BUFFER, this->instanceBuffer);
+	for (size_t i = 0; i < this->drawRanges.size(); i++) {
+		PointInstanceAttribs(sizeof(GlyphInstance), this->drawRanges[i].first);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, 6, this->drawRanges[i].second);
+	}
+	PointInstanceAttribs(sizeof(GlyphInstance), 0);
+}
+
+void GLLabel::SetCoverageCache(bool cache) {
+	this->coverageCache.enabled = cache;
+	if (!cache && this->coverageCache.texture) {
+		glDeleteFramebuffers(1, &this->coverageCache.framebuffer);
+		glDeleteTextures(1, &this->coverageCache.texture);
+		this->coverageCache = CoverageCache{};
+	}
+}
+
+// How far the scale can drift from the one the coverage cache was rendered
+// at before it's rendered again, as a fraction of it
+static const float kCoverageCacheDrift = 0.05f;
+// Biggest coverage cache, in pixels (16 MiB). Labels that would need more,
+// say when zoomed far into, are drawn as they are instead.
+static const float kMaxCoverageCachePixels = 2048 * 2048;
+
+bool GLLabel::DrawCoverageCache(const glm::mat4& transform) {
+	// Only scaling and translating, so the texture's pixels line up with
+	// the framebuffer's
+	if (transform[0][1] != 0 || transform[1][0] != 0
+		|| transform[0][3] != 0 || transform[1][3] != 0 || transform[3][3] != 1) {
+		return false;
+	}
+
+	// Window coordinates of label space p are windowOrigin + toWindow * p
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glm::vec2 viewportSize(viewport[2], viewport[3]);
+	glm::vec2 toWindow = glm::vec2(transform[0][0], transform[1][1]) * viewportSize / 2.0f;
+	glm::vec2 windowOrigin = glm::vec2(viewport[0], viewport[1])
+		+ (glm::vec2(transform[3][0], transform[3][1]) + 1.0f) * viewportSize / 2.0f;
+	if (toWindow.x == 0 || toWindow.y == 0) {
+		return false;
+	}
+
+	CoverageCache& cache = this->coverageCache;
+	glm::vec2 scale = glm::abs(toWindow);
+	glm::vec2 drift = glm::abs(scale / cache.scale - 1.0f);
+	bool stale = cache.version != this->version || cache.paletteVersion != this->paletteVersion
+		|| cache.quality != this->quality
+		|| drift.x > kCoverageCacheDrift || drift.y > kCoverageCacheDrift;
+
+	if (stale) {
+		glm::vec2 boundsMin(INFINITY, INFINITY), boundsMax(-INFINITY, -INFINITY);
+		for (size_t i = 0; i < this->lines.size(); i++) {
+			const Line& line = this->lines[i];
+			if (line.boundsMin.x <= line.boundsMax.x) {
+				glm::vec2 origin = this->lineOffsets[line.id];
+				boundsMin = glm::min(boundsMin, origin + line.boundsMin);
+				boundsMax = glm::max(boundsMax, origin + line.boundsMax);
 			}
-			if (deltaAppend.x < 0) {
-				deltaAppend.x = 0;
+		}
+
+		// Whole pixels around the text, and one more on each side for the
+		// antialiasing
+		glm::vec2 pixelMin(0, 0), pixelMax(0, 0);
+		if (boundsMin.x <= boundsMax.x) {
+			glm::vec2 a = windowOrigin + toWindow * boundsMin;
+			glm::vec2 b = windowOrigin + toWindow * boundsMax;
+			pixelMin = glm::floor(glm::min(a, b)) - 1.0f;
+			pixelMax = glm::ceil(glm::max(a, b)) + 1.0f;
+		}
+		glm::vec2 size = pixelMax - pixelMin;
+		GLint maxSize = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+		if (size.x > maxSize || size.y > maxSize || size.x * size.y > kMaxCoverageCachePixels) {
+			return false;
+		}
+
+		if (!cache.texture) {
+			glGenTextures(1, &cache.texture);
+			glGenFramebuffers(1, &cache.framebuffer);
+		}
+		glActiveTexture(GL_TEXTURE5);
+		glBindTexture(GL_TEXTURE_2D, cache.texture);
+		if (cache.width != (GLsizei)size.x || cache.height != (GLsizei)size.y) {
+			cache.width = size.x;
+			cache.height = size.y;
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, cache.width, cache.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+		cache.version = this->version;
+		cache.paletteVersion = this->paletteVersion;
+		cache.quality = this->quality;
+		cache.scale = scale;
+		cache.rect = glm::vec4((pixelMin - windowOrigin) / toWindow, (pixelMax - windowOrigin) / toWindow);
+		this->stats.coverageCacheUpdates++;
+
+		if (cache.width > 0 && cache.height > 0) {
+			GLint framebuffer = 0;
+			glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+			GLboolean scissor = glIsEnabled(GL_SCISSOR_TEST);
+			GLint blend[4];
+			glGetIntegerv(GL_BLEND_SRC_RGB, &blend[0]);
+			glGetIntegerv(GL_BLEND_DST_RGB, &blend[1]);
+			glGetIntegerv(GL_BLEND_SRC_ALPHA, &blend[2]);
+			glGetIntegerv(GL_BLEND_DST_ALPHA, &blend[3]);
+
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, cache.framebuffer);
+			glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, cache.texture, 0);
+			glViewport(0, 0, cache.width, cache.height);
+			glDisable(GL_SCISSOR_TEST);
+			GLfloat clear[4] = {0, 0, 0, 0};
+			glClearBufferfv(GL_COLOR, 0, clear);
+
+			// Premultiplied, so it blends over what's under the label the
+			// same as the glyphs themselves would
+			glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+			// Label space to the texture's pixels
+			glm::mat4 toTexture(1.0);
+			toTexture[0][0] = 2 * toWindow.x / size.x;
+			toTexture[1][1] = 2 * toWindow.y / size.y;
+			toTexture[3][0] = 2 * (windowOrigin.x - pixelMin.x) / size.x - 1;
+			toTexture[3][1] = 2 * (windowOrigin.y - pixelMin.y) / size.y - 1;
+			this->manager->SetShaderTransform(toTexture);
+			this->manager->UseInstanceSize(false);
+			this->manager->BindVertexArray(this->vertexArray);
+			glDrawArraysInstanced(GL_TRIANGLES, 0, 6, this->instanceBufferUsed);
+
+			glBlendFuncSeparate(blend[0], blend[1], blend[2], blend[3]);
+			if (scissor) {
+				glEnable(GL_SCISSOR_TEST);
 			}
+			glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+		}
+	}
+
+	if (cache.width > 0 && cache.height > 0 && !this->manager->DrawTexture(cache.texture, transform, cache.rect)) {
+		// Still using the glyph shader, for drawing the text as it is
+		this->manager->SetShaderTransform(transform);
+		return false;
+	}
+	this->stats.coverageCacheDraws++;
+	return true;
+}
+
+void GLLabel::Update() {
+	this->manager->CommitPreparedGlyphs();
+	if (this->pendingGlyphs.empty() || this->seenGlyphCommits == this->manager->glyphCommits) {
+		return;
+	}
+	this->seenGlyphCommits = this->manager->glyphCommits;
+
+	// Reinserting a character leaves the indices of all other pending
+	// characters where they were, so it's safe to walk a copy of the list.
+	std::vector<PendingGlyph> pending;
+	pending.swap(this->pendingGlyphs);
+	for (size_t i = 0; i < pending.size(); i++) {
+		size_t column;
+		Line& line = this->lines[this->FindLine(pending[i].index, &column)];
+		std::u32string c(1, line.text[column]);
+		if (this->manager->IsGlyphPending(pending[i].face, c[0])) {
+			this->pendingGlyphs.push_back(pending[i]);
+			continue;
 		}
 
-		for (unsigned int j = 0; j < 6; j++) {
-			this->verts[i * 6 + j].pos += deltaAppend;
+		// The color it has now, which may have changed since it was inserted
+		uint8_t color = line.instances[column].ColorIndex();
+		this->RemoveText(pending[i].index, 1);
+		this->InsertText(c, pending[i].index, color, pending[i].face);
+	}
+}
+
+void GLLabel::SetSelection(size_t start, size_t end) {
+	this->selectionStart = std::min(start, end);
+	this->selectionEnd = std::max(start, end);
+	this->overlayVersion = ++GLLabel::lastVersion;
+}
+
+void GLLabel::SetSelectionColor(glm::vec4 color) {
+	this->SetColor(kSelectionColor, color);
+}
+
+uint8_t GLLabel::FindColor(Color color, bool style) {
+	for (size_t i = kFirstTextColor; !style && i < this->palette.size(); i++) {
+		const Color& c = this->palette[i];
+		if (!this->paletteUses[i].style && c.r == color.r && c.g == color.g && c.b == color.b && c.a == color.a) {
+			return i;
 		}
 	}
 
-	glBindBuffer(GL_ARRAY_BUFFER, this->vertBuffer);
+	size_t entry = this->palette.size();
+	for (size_t i = kFirstTextColor; i < this->palette.size(); i++) {
+		if (!this->paletteUses[i].style && this->paletteUses[i].chars == 0) {
+			entry = i;
+			break;
+		}
+	}
+	if (entry < kPaletteSize) {
+		if (entry == this->palette.size()) {
+			this->palette.push_back(color);
+			this->paletteUses.push_back(PaletteUse{0, style});
+		}
+		this->palette[entry] = color;
+		this->paletteUses[entry].style = style;
+		this->paletteVersion = ++GLLabel::lastVersion;
+		return entry;
+	}
 
-	if (this->verts.capacity() != prevCapacity) {
-		// If the capacity changed, completely reupload the buffer
-		glBufferData(GL_ARRAY_BUFFER, this->verts.capacity() * sizeof(GlyphVertex), NULL, GL_DYNAMIC_DRAW);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, this->verts.size() * sizeof(GlyphVertex), &this->verts[0]);
+	// Full, and every entry is in use
+	size_t closest = kFirstTextColor;
+	int closestDistance = INT32_MAX;
+	for (size_t i = kFirstTextColor; i < this->palette.size(); i++) {
+		const Color& c = this->palette[i];
+		int dr = c.r - color.r, dg = c.g - color.g, db = c.b - color.b, da = c.a - color.a;
+		int distance = dr * dr + dg * dg + db * db + da * da;
+		if (distance < closestDistance) {
+			closest = i;
+			closestDistance = distance;
+		}
 	}
-	else {
-		// Otherwise only upload the changed parts
-		glBufferSubData(GL_ARRAY_BUFFER,
-			index * 6 * sizeof(GlyphVertex),
-			(this->verts.size() - index * 6) * sizeof(GlyphVertex),
-			&this->verts[index * 6]);
+	return closest;
+}
+
+void GLLabel::ReleaseColors(const Line& line, size_t from, size_t to) {
+	for (size_t i = from; i < to; i++) {
+		this->paletteUses[line.instances[i].ColorIndex()].chars--;
 	}
-	caretTime = 0;
 }
 
-void GLLabel::RemoveText(size_t index, size_t length) {
-	if (index >= this->text.size()) {
+uint8_t GLLabel::AddColor(glm::vec4 color) {
+	return this->FindColor(to_color(color), true);
+}
+
+void GLLabel::SetColor(uint8_t color, glm::vec4 value) {
+	if (color >= this->palette.size()) {
+		std::cerr << "WARN: No color " << (int)color << " in the label's palette\n";
+		return;
+	}
+	this->palette[color] = to_color(value);
+	this->paletteVersion = ++GLLabel::lastVersion;
+}
+
+glm::vec4 GLLabel::GetColor(uint8_t color) {
+	if (color >= this->palette.size()) {
+		return glm::vec4(0, 0, 0, 0);
+	}
+	const Color& c = this->palette[color];
+	return glm::vec4(c.r, c.g, c.b, c.a) / 255.0f;
+}
+
+void GLLabel::SetTextColor(size_t index, size_t length, uint8_t color) {
+	if (color >= this->palette.size()) {
+		std::cerr << "WARN: No color " << (int)color << " in the label's palette\n";
+		return;
+	}
+	if (index >= this->textLength || length == 0) {
+		return;
+	}
+	length = std::min(length, this->textLength - index);
+
+	size_t column;
+	for (size_t i = this->FindLine(index, &column); length > 0; i++, column = 0) {
+		Line& line = this->lines[i];
+		size_t end = std::min(line.instances.size(), column + length);
+		this->ReleaseColors(line, column, end);
+		for (size_t j = column; j < end; j++) {
+			line.instances[j].SetColorIndex(color);
+		}
+		this->paletteUses[color].chars += end - column;
+		length -= end - column;
+		line.dirty = true;
+	}
+	version = ++GLLabel::lastVersion;
+}
+
+void GLLabel::UploadPalette() {
+	if (this->uploadedPaletteVersion == this->paletteVersion) {
+		return;
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, this->paletteBuf);
+	glBufferData(GL_TEXTURE_BUFFER, this->palette.size() * sizeof(Color), &this->palette[0], GL_DYNAMIC_DRAW);
+	this->stats.uploadedBytes += this->palette.size() * sizeof(Color);
+	this->uploadedPaletteVersion = this->paletteVersion;
+}
+
+bool GLLabel::AdvanceCaret(float time) {
+	this->caretTime += time - this->prevTime;
+	this->prevTime = time;
+	return !(((int)(this->caretTime * 3 / 2)) % 2);
+}
+
+void GLLabel::BuildOverlays() {
+	if (this->builtOverlayVersion == this->overlayVersion) {
+		return;
+	}
+	this->builtOverlayVersion = this->overlayVersion;
+	this->overlays.assign(1, OverlayInstance{});
+	this->numSelectionRects = 0;
+	this->hasCaretOverlay = false;
+
+	// Highlights are as tall as the caret. The caret's glyph is retained
+	// like the text's, so it's never evicted from under the overlays.
+	GLFontManager::Glyph* pipe = this->manager->GetGlyphForCodepoint(this->manager->GetDefaultFont(), '|');
+	if (pipe != this->caretGlyph) {
+		if (pipe) {
+			this->manager->RetainGlyph(pipe);
+		}
+		if (this->caretGlyph) {
+			this->manager->ReleaseGlyph(this->caretGlyph);
+		}
+		this->caretGlyph = pipe;
+	}
+	if (!pipe) {
+		return;
+	}
+
+	size_t start = std::min(this->selectionStart, this->textLength);
+	size_t end = std::min(this->selectionEnd, this->textLength);
+	GLFontManager::Glyph* solid = (start < end) ? this->manager->GetSolidGlyph() : nullptr;
+	size_t lineStart = 0;
+	for (size_t i = 0; solid && i < this->lines.size() && lineStart < end; i++) {
+		const Line& line = this->lines[i];
+		size_t lineEnd = lineStart + line.text.size();
+		if (lineEnd > start) {
+			float x0 = PenBefore(line, std::max(start, lineStart) - lineStart).x;
+			float x1 = PenBefore(line, std::min(end, lineEnd) - lineStart).x;
+
+			OverlayInstance rect{};
+			rect.glyph.pos = glm::vec2(x0, pipe->offset[1]);
+			rect.glyph.glyphDataOffset = glyph_data_offset(solid);
+			rect.glyph.SetColorIndex(kSelectionColor);
+			rect.glyph.SetLineId(line.id);
+			rect.size = glm::vec2(x1 - x0, pipe->size[1]);
+			if (rect.size.x > 0) {
+				this->overlays.push_back(rect);
+			}
+		}
+		lineStart = lineEnd;
+	}
+	this->numSelectionRects = this->overlays.size() - 1;
+
+	if (this->showingCaret) {
+		size_t column;
+		const Line& line = this->lines[this->FindLine(this->caretPosition, &column)];
+
+		OverlayInstance caret{};
+		caret.glyph.pos = PenBefore(line, column) + glm::vec2(pipe->offset[0], pipe->offset[1]);
+		caret.glyph.glyphDataOffset = glyph_data_offset(pipe);
+		caret.glyph.SetColorIndex(kCaretColor);
+		caret.glyph.SetLineId(line.id);
+		this->overlays[0] = caret;
+		this->hasCaretOverlay = true;
+	}
+}
+
+void GLLabel::RefreshGlyphData() {
+	uint64_t generation = this->manager->GetAtlasGeneration();
+	if (this->seenAtlasGeneration == generation) {
+		return;
+	}
+	this->seenAtlasGeneration = generation;
+
+	for (size_t i = 0; i < this->lines.size(); i++) {
+		Line& line = this->lines[i];
+		for (size_t j = 0; j < line.instances.size(); j++) {
+			if (line.glyphs[j]) {
+				line.instances[j].glyphDataOffset = glyph_data_offset(line.glyphs[j]);
+			}
+		}
+		line.dirty = true;
+	}
+	version = overlayVersion = ++GLLabel::lastVersion;
+	this->BuildOverlays();
+}
+
+void GLLabel::UploadOverlays() {
+	if (this->uploadedOverlayVersion == this->builtOverlayVersion) {
 		return;
 	}
-	if (index + length > this->text.size()) {
-		length = this->text.size() - index;
+	this->uploadedOverlayVersion = this->builtOverlayVersion;
+
+	glBindBuffer(GL_ARRAY_BUFFER, this->overlayBuffer);
+	if (this->overlays.size() > this->overlayBufferCapacity) {
+		this->overlayBufferCapacity = std::max(this->overlayBufferCapacity * 2, this->overlays.size());
+		glBufferData(GL_ARRAY_BUFFER, this->overlayBufferCapacity * sizeof(OverlayInstance), NULL, GL_DYNAMIC_DRAW);
+	}
+	glBufferSubData(GL_ARRAY_BUFFER, 0, this->overlays.size() * sizeof(OverlayInstance), &this->overlays[0]);
+	this->stats.uploadedBytes += this->overlays.size() * sizeof(OverlayInstance);
+}
+
+void GLLabel::Render(float time, glm::mat4 transform) {
+	double gpuUs;
+	while (this->renderTimer.Poll(&gpuUs)) {
+		this->stats.renderGpuTime.Add(gpuUs);
+		this->manager->stats.renderGpuTime.Add(gpuUs);
+	}
+	if (this->manager->GPUTimingsEnabled()) {
+		this->renderTimer.Begin();
+	}
+
+	this->Update();
+	bool caretOn = this->AdvanceCaret(time);
+
+	// Before uploading the atlases, since it may need new glyphs. Uploading
+	// may compact the atlases, moving the glyphs' data, so the instances only
+	// go to the GPU after.
+	this->BuildOverlays();
+	this->manager->UploadAtlases();
+	this->RefreshGlyphData();
+
+	this->UploadLines();
+	this->UploadOverlays();
+	this->UploadPalette();
+
+	auto useGlyphShader = [this, &transform]() {
+		if (!this->manager->UseGlyphShader(this->quality)) {
+			return false;
+		}
+		this->manager->UseAtlasTextures();
+		this->manager->UseBlending();
+		this->manager->SetShaderTransform(transform);
+		this->manager->UseTransformBuffer(0);
+		this->manager->UseLineOffsetBuffer(this->lineOffsetBufTex);
+		this->manager->UsePaletteBuffer(this->paletteBufTex);
+		return true;
+	};
+	if (!useGlyphShader()) {
+		this->renderTimer.End();
+		return;
+	}
+
+	// Highlights go under the text, and the caret over it
+	if (this->numSelectionRects > 0) {
+		this->manager->UseInstanceSize(true);
+		this->manager->BindVertexArray(this->selectionVertexArray);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, 6, this->numSelectionRects);
+	}
+	bool cached = this->coverageCache.enabled && this->DrawCoverageCache(transform);
+	if (cached) {
+		this->drawRanges.clear();
+		this->stats.culledLines = 0;
+	}
+	else {
+		this->FindDrawRanges(transform);
+		if (!this->drawRanges.empty()) {
+			this->manager->UseInstanceSize(false);
+			this->manager->BindVertexArray(this->vertexArray);
+			this->DrawRanges();
+		}
+	}
+	if (this->hasCaretOverlay && caretOn) {
+		if (cached) {
+			useGlyphShader(); // Drawing the cache left it
+		}
+		this->manager->UseInstanceSize(true);
+		this->manager->BindVertexArray(this->caretVertexArray);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, 6, 1);
+	}
+
+	this->renderTimer.End();
+	this->stats.renders++;
+	this->stats.glyphs = 0;
+	for (size_t i = 0; i < this->drawRanges.size(); i++) {
+		this->stats.glyphs += this->drawRanges[i].second;
+	}
+	this->stats.drawRanges = this->drawRanges.size();
+}
+
+
+GLFontManager::GLFontManager(std::shared_ptr<GlyphStore> store)
+	: lastFaceId(0), store(store), glyphCommits(0), stats(), cpuTimings(false), gpuTimings(false),
+	memoryBudget(0), compactAbove(0), residencyClock(0), atlasGeneration(0), hasSolidGlyph(false), defaultFace(nullptr),
+	dirtyGlyphDataMin(0), dirtyGlyphDataMax(0), gridAtlasLayers(0), maxGridAtlasLayers(0), glyphDataCapacity(0), maxGlyphDataSize(0), maxTextureBufferSize(0),
+	stagingBufOffset(0), textureProgram(0), textureProgramFailed(false), uTextureTransform(0), uTextureRect(0), textureVertexArray(0) {
+	if (FT_Init_FreeType(&this->ft) != FT_Err_Ok) {
+		std::cerr << "Failed to load freetype\n";
+	}
+
+	// Let the driver compile every variant at once, off this thread
+	if (GLEW_ARB_parallel_shader_compile) {
+		glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+	}
+	for (size_t i = 0; i < kNumQualities; i++) {
+		this->StartGlyphShader(this->glyphShaders[i], kGlyphShaderQualityDefines[i]);
+	}
+
+	// https://www.khronos.org/opengl/wiki/Buffer_Texture
+	GLint maxTexBufferSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexBufferSize);
+	this->maxTextureBufferSize = maxTexBufferSize;
+	this->maxGlyphDataSize = std::min((size_t)maxTexBufferSize, kMaxGlyphDataSize);
+
+	glGenBuffers(1, &this->glyphDataBufId);
+	glBindBuffer(GL_TEXTURE_BUFFER, this->glyphDataBufId);
+	glGenTextures(1, &this->glyphDataBufTexId);
+	glBindTexture(GL_TEXTURE_BUFFER, this->glyphDataBufTexId);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RG16UI, this->glyphDataBufId);
+	glGenTextures(1, &this->glyphHeaderBufTexId);
+	glBindTexture(GL_TEXTURE_BUFFER, this->glyphHeaderBufTexId);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA16UI, this->glyphDataBufId);
+
+	// Header of the empty glyph, see kGlyphHeaderPixels
+	this->glyphData.resize(kGlyphHeaderPixels * kAtlasChannels);
+
+	glGenTextures(1, &this->gridAtlasId);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, this->gridAtlasId);
+	// Integer textures can't be filtered
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &this->maxGridAtlasLayers);
+
+	glGenBuffers(1, &this->stagingBufId);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->stagingBufId);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, kStagingBufSize, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	// All of the above bound things without keeping track
+	this->ResetRenderState();
+}
+
+GLFontManager::~GLFontManager() {
+	for (size_t i = 0; i < this->atlases.size(); i++) {
+		delete[] this->atlases[i].gridAtlas;
+	}
+	glDeleteTextures(1, &this->gridAtlasId);
+	glDeleteTextures(1, &this->glyphDataBufTexId);
+	glDeleteTextures(1, &this->glyphHeaderBufTexId);
+	glDeleteBuffers(1, &this->glyphDataBufId);
+	glDeleteBuffers(1, &this->stagingBufId);
+	for (size_t i = 0; i < kNumQualities; i++) {
+		glDeleteProgram(this->glyphShaders[i].program);
+	}
+	if (this->textureProgram) {
+		glDeleteProgram(this->textureProgram);
+		glDeleteVertexArrays(1, &this->textureVertexArray);
+	}
+	FT_Done_FreeType(this->ft);
+}
+
+std::shared_ptr<GLFontManager> GLFontManager::GetFontManager() {
+	if (!GLFontManager::singleton) {
+		GLFontManager::singleton = GLFontManager::Create();
+	}
+	return GLFontManager::singleton;
+}
+
+std::shared_ptr<GLFontManager> GLFontManager::Create(std::shared_ptr<GlyphStore> store) {
+	return std::shared_ptr<GLFontManager>(new GLFontManager(store));
+}
+
+FT_Face GLFontManager::GetFontFromPath(std::string fontPath, FT_Long faceIndex) {
+	// Already open, or another face of the same file is, whose mapping can
+	// be shared
+	std::shared_ptr<FontFile> file;
+	for (size_t i = 0; i < this->faceSources.size(); i++) {
+		FaceSource& source = this->faceSources[i];
+		if (!source.file || source.path != fontPath) {
+			continue;
+		}
+		if (source.index == faceIndex) {
+			source.refCount++;
+			return this->faces[i];
+		}
+		file = source.file;
+	}
+
+	if (!file) {
+		file = FontFile::Map(fontPath);
+	}
+	FT_Face face;
+	if (!file || file->OpenFace(this->ft, faceIndex, &face)) {
+		return nullptr;
+	}
+	FaceSource source{fontPath, faceIndex, file, 1, 0};
+	if (this->store) {
+		source.storeFontId = this->store->FontId(fontPath, faceIndex);
+	}
+
+	// Take over the face id of the same font in a loaded atlas file, or of
+	// the same face closed earlier, so its glyphs are found in the glyph
+	// cache
+	for (size_t i = 0; i < this->bakedFaces.size(); i++) {
+		BakedFace baked = this->bakedFaces[i];
+		const FaceSource& bakedSource = this->faceSources[baked.faceId];
+		if (bakedSource.path != fontPath || bakedSource.index != faceIndex) {
+			continue;
+		}
+		this->bakedFaces.erase(this->bakedFaces.begin() + i);
+		if (face->num_glyphs == baked.numGlyphs && face->units_per_EM == baked.unitsPerEM
+			&& file->Size() == baked.fileSize && file->Hash() == baked.fileHash) {
+			this->faces[baked.faceId] = face;
+			this->faceSources[baked.faceId] = source;
+			return face;
+		}
+		std::cerr << "WARN: Font " << fontPath << " changed since its glyphs were cached\n";
+		break;
+	}
+
+	this->faceSources[this->GetFaceId(face)] = source;
+	return face;
+}
+
+FT_Face GLFontManager::GetFontFromName(std::string fontName) {
+	for (size_t i = 0; i < this->faces.size(); i++) {
+		FT_Face face = this->faces[i];
+		if (!face || !face->family_name) {
+			continue;
+		}
+		std::string family = face->family_name;
+		if (fontName == family || (face->style_name && fontName == family + " " + face->style_name)) {
+			if (this->faceSources[i].file) {
+				this->faceSources[i].refCount++;
+			}
+			return face;
+		}
+	}
+	return this->GetFontFromPath(fontName);
+}
+
+void GLFontManager::ReleaseFont(FT_Face face) {
+	if (!face || face == this->defaultFace) {
+		return;
+	}
+	auto it = std::find(this->faces.begin(), this->faces.end(), face);
+	if (it == this->faces.end()) {
+		return;
+	}
+	uint32_t faceId = it - this->faces.begin();
+	FaceSource& source = this->faceSources[faceId];
+	if (!source.file || --source.refCount > 0) {
+		return;
+	}
+
+	this->bakedFaces.push_back(BakedFace{faceId, face->num_glyphs, face->units_per_EM,
+		source.file->Size(), source.file->Hash()});
+	this->faces[faceId] = nullptr;
+	FT_Done_Face(face);
+	source.file = nullptr; // Unmapped once the workers are done with it too
+	if (this->loader) {
+		this->workerFacesToRelease.push_back(faceId);
+		this->ReleaseWorkerFaces();
+	}
+}
+
+// Has the workers close the faces closed by ReleaseFont() that none of the
+// glyphs they are working on are from
+void GLFontManager::ReleaseWorkerFaces() {
+	std::vector<uint32_t>& faceIds = this->workerFacesToRelease;
+	for (size_t i = 0; i < faceIds.size();) {
+		auto it = this->faceGlyphsInFlight.find(faceIds[i]);
+		if (it != this->faceGlyphsInFlight.end() && it->second > 0) {
+			i++;
+			continue;
+		}
+		this->loader->ReleaseFace(faceIds[i]);
+		faceIds[i] = faceIds.back();
+		faceIds.pop_back();
+	}
+}
+
+FT_Face GLFontManager::GetDefaultFont() {
+	// TODO
+	if (!defaultFace) {
+		defaultFace = GLFontManager::GetFontFromPath("fonts/LiberationSans-Regular.ttf");
+	}
+	return defaultFace;
+}
+
+GLFontManager::AtlasGroup* GLFontManager::GetOpenAtlasGroup() {
+	if (this->atlases.size() == 0 || this->atlases[this->atlases.size() - 1].full) {
+		if (this->atlases.size() >= (size_t)this->maxGridAtlasLayers) {
+			std::cerr << "WARN: Out of grid atlas layers ("
+				<< "max: " << this->maxGridAtlasLayers << ")\n";
+			return nullptr;
+		}
+
+		AtlasGroup group{};
+		group.gridAtlas = new uint16_t[sq(kGridAtlasSize) * kAtlasChannels]();
+		group.gridPacker = SkylinePacker(kGridAtlasSize, kGridAtlasSize);
+		this->atlases.push_back(group);
+	}
+
+	return &this->atlases[this->atlases.size() - 1];
+}
+
+#pragma pack(push, 1)
+struct bitmapdata {
+	char magic[2];
+	uint32_t size;
+	uint16_t res1;
+	uint16_t res2;
+	uint32_t offset;
+
+	uint32_t biSize;
+	uint32_t width;
+	uint32_t height;
+	uint16_t planes;
+	uint16_t bitCount;
+	uint32_t compression;
+	uint32_t imageSizeBytes;
+	uint32_t xpelsPerMeter;
+	uint32_t ypelsPerMeter;
+	uint32_t clrUsed;
+	uint32_t clrImportant;
+};
+#pragma pack(pop)
+
+void writeBMP(const char* path, uint32_t width, uint32_t height, uint16_t channels, uint8_t* data) {
+	FILE* f = fopen(path, "wb");
+	if (!f) {
+		std::cerr << "WARN: Failed to write " << path << "\n";
+		return;
+	}
+
+	bitmapdata head;
+	head.magic[0] = 'B';
+	head.magic[1] = 'M';
+	head.size = sizeof(bitmapdata) + width * height * channels;
+	head.res1 = 0;
+	head.res2 = 0;
+	head.offset = sizeof(bitmapdata);
+	head.biSize = 40;
+	head.width = width;
+	head.height = height;
+	head.planes = 1;
+	head.bitCount = 8 * channels;
+	head.compression = 0;
+	head.imageSizeBytes = width * height * channels;
+	head.xpelsPerMeter = 0;
+	head.ypelsPerMeter = 0;
+	head.clrUsed = 0;
+	head.clrImportant = 0;
+
+	fwrite(&head, sizeof(head), 1, f);
+	fwrite(data, head.imageSizeBytes, 1, f);
+	fclose(f);
+}
+
+// A bezier is written as 6 16-bit integers (12 bytes). Increments buffer by
+// the number of bytes written (always 12). Coords are scaled from
+// [0,glyphSize] to [0,UINT16_MAX].
+void write_bezier_to_buffer(uint16_t** pbuffer, Bezier2* bezier, Vec2* glyphSize) {
+	uint16_t* buffer = *pbuffer;
+	buffer[0] = bezier->e0.x * UINT16_MAX / glyphSize->w;
+	buffer[1] = bezier->e0.y * UINT16_MAX / glyphSize->h;
+	buffer[2] = bezier->c.x * UINT16_MAX / glyphSize->w;
+	buffer[3] = bezier->c.y * UINT16_MAX / glyphSize->h;
+	buffer[4] = bezier->e1.x * UINT16_MAX / glyphSize->w;
+	buffer[5] = bezier->e1.y * UINT16_MAX / glyphSize->h;
+	*pbuffer += 6;
+}
+
+void write_glyph_data_to_buffer(
+	uint8_t* buffer8,
+	std::vector<Bezier2>& beziers,
+	Vec2& glyphSize,
+	uint16_t gridX,
+	uint16_t gridY,
+	uint16_t gridWidth,
+	uint16_t gridHeight,
+	uint16_t gridLayer) {
+
+	uint16_t* buffer = (uint16_t*)buffer8;
+	buffer[0] = gridX;
+	buffer[1] = gridY;
+	buffer[2] = gridWidth;
+	buffer[3] = gridHeight;
+	buffer[4] = gridLayer;
+	buffer[5] = 0;
+	buffer[6] = glyphSize.w;
+	buffer[7] = glyphSize.h;
+	buffer += kGlyphHeaderPixels * 2;
+
+	for (size_t i = 0; i < beziers.size(); i++) {
+		write_bezier_to_buffer(&buffer, &beziers[i], &glyphSize);
+	}
+}
+
+static void mark_grid_dirty(
+	GLFontManager::AtlasGroup* atlas,
+	uint16_t x,
+	uint16_t y,
+	uint16_t width,
+	uint16_t height) {
+	if (atlas->dirtyGridMin[0] >= atlas->dirtyGridMax[0]) {
+		atlas->dirtyGridMin[0] = x;
+		atlas->dirtyGridMin[1] = y;
+		atlas->dirtyGridMax[0] = x + width;
+		atlas->dirtyGridMax[1] = y + height;
+		return;
+	}
+	atlas->dirtyGridMin[0] = std::min(atlas->dirtyGridMin[0], x);
+	atlas->dirtyGridMin[1] = std::min(atlas->dirtyGridMin[1], y);
+	atlas->dirtyGridMax[0] = std::max(atlas->dirtyGridMax[0], uint16_t(x + width));
+	atlas->dirtyGridMax[1] = std::max(atlas->dirtyGridMax[1], uint16_t(y + height));
+}
+
+static void mark_glyph_data_dirty(
+	GLFontManager* manager,
+	uint32_t offset,
+	uint32_t length) {
+	if (manager->dirtyGlyphDataMin >= manager->dirtyGlyphDataMax) {
+		manager->dirtyGlyphDataMin = offset;
+		manager->dirtyGlyphDataMax = offset + length;
+		return;
+	}
+	manager->dirtyGlyphDataMin = std::min(manager->dirtyGlyphDataMin, offset);
+	manager->dirtyGlyphDataMax = std::max(manager->dirtyGlyphDataMax, offset + length);
+}
+
+GLFontManager::Glyph* GLFontManager::GetGlyphForCodepoint(FT_Face face, uint32_t point) {
+	uint32_t faceId = this->GetFaceId(face);
+	GLFontManager::Glyph* cached = this->glyphs.Find(faceId, point);
+	if (cached) {
+		cached->lastUsed = this->residencyClock;
+		return cached;
+	}
+	return this->LoadGlyph(face, faceId, point);
+}
+
+// Prepares and commits a glyph on this thread, for cache misses that can't
+// wait on the worker threads
+GLFontManager::Glyph* GLFontManager::LoadGlyph(FT_Face face, uint32_t faceId, uint32_t point) {
+	std::chrono::steady_clock::time_point start;
+	if (this->cpuTimings) {
+		start = std::chrono::steady_clock::now();
+	}
+
+	// The store doesn't keep grid cells, so they're rebuilt from the curves
+	const StoredGlyph* stored = this->FindStored(faceId, point);
+	if (stored) {
+		stored->Expand(this->scratchGlyph);
+		this->stats.glyphsShared++;
+		return this->CommitGlyph(faceId, point, this->scratchGlyph);
+	}
+
+	GLFontManager::Glyph* glyph = nullptr;
+	if (prepare_glyph(face, point, kGridMaxSize, kAtlasChannels, this->scratchGlyph)) {
+		glyph = this->CommitGlyph(faceId, point, this->scratchGlyph);
+		if (this->faceSources[faceId].storeFontId) {
+			this->store->Insert(this->faceSources[faceId].storeFontId, point, this->scratchGlyph);
+		}
+	}
+
+	this->stats.glyphsPrepared++;
+	if (this->cpuTimings) {
+		this->stats.glyphLoadTime.Add(us_since(start));
+	}
+	return glyph;
+}
+
+GLFontManager::Glyph* GLFontManager::GetSolidGlyph() {
+	if (this->hasSolidGlyph) {
+		return &this->solidGlyph;
+	}
+
+	size_t glyphDataOffset = next_glyph_data_offset(this->glyphData);
+	if (glyphDataOffset + kGlyphHeaderPixels > this->maxGlyphDataSize) {
+		std::cerr << "WARN: Out of glyph data space ("
+			<< "max: " << this->maxGlyphDataSize << " texels)\n";
+		return nullptr;
+	}
+
+	AtlasGroup* atlas = this->GetOpenAtlasGroup();
+	if (!atlas) {
+		return nullptr;
+	}
+	uint16_t gridPos[2];
+	while (!atlas->gridPacker.Pack(1, 1, gridPos[0], gridPos[1])) {
+		atlas->full = true;
+		atlas = this->GetOpenAtlasGroup();
+		if (!atlas) {
+			return nullptr;
+		}
+	}
+
+	// A single cell with no curves, whose middle is inside the glyph
+	VGrid grid;
+	grid.width = 1;
+	grid.height = 1;
+	grid.cellBeziers.resize(VGrid::kCellCapacity);
+	grid.cellCounts.assign(1, 0);
+	grid.cellMids.assign(1, true);
+
+	VGridAtlas gridAtlas{};
+	gridAtlas.data = atlas->gridAtlas;
+	gridAtlas.width = kGridAtlasSize;
+	gridAtlas.height = kGridAtlasSize;
+	gridAtlas.depth = kAtlasChannels;
+	gridAtlas.WriteVGridAt(grid, gridPos[0], gridPos[1]);
+
+	this->glyphData.resize((glyphDataOffset + kGlyphHeaderPixels) * kAtlasChannels);
+	std::vector<Bezier2> noCurves;
+	Vec2 glyphSize(1, 1);
+	write_glyph_data_to_buffer(
+		&this->glyphData[glyphDataOffset * kAtlasChannels],
+		noCurves,
+		glyphSize,
+		gridPos[0],
+		gridPos[1],
+		1,
+		1,
+		this->atlases.size() - 1);
+
+	this->solidGlyph = Glyph{};
+	this->solidGlyph.glyphDataOffset = glyphDataOffset;
+	this->solidGlyph.atlasIndex = this->atlases.size() - 1;
+	this->solidGlyph.size[0] = 1;
+	this->solidGlyph.size[1] = 1;
+	this->solidGlyph.faceId = UINT32_MAX; // Kerns with nothing
+	this->hasSolidGlyph = true;
+
+	mark_glyph_data_dirty(this, glyphDataOffset, kGlyphHeaderPixels);
+	mark_grid_dirty(atlas, gridPos[0], gridPos[1], 1, 1);
+	return &this->solidGlyph;
+}
+
+// Places a prepared glyph into the atlases and the glyph cache
+GLFontManager::Glyph* GLFontManager::CommitGlyph(
+	uint32_t faceId,
+	uint32_t point,
+	PreparedGlyph& prepared) {
+	FT_Glyph_Metrics& metrics = prepared.metrics;
+	FT_Pos glyphWidth = metrics.width;
+	FT_Pos glyphHeight = metrics.height;
+	std::vector<Bezier2>& curves = prepared.curves;
+	VGrid& grid = prepared.grid;
+
+	// TODO: Integrate with AtlasGroup / replace AtlasGroup
+	VGridAtlas gridAtlas{};
+	gridAtlas.width = kGridAtlasSize;
+	gridAtlas.height = kGridAtlasSize;
+	gridAtlas.depth = kAtlasChannels;
+
+	// Although the data is represented as a 32bit texture, it's actually
+	// two 16bit ints per pixel, each with an x and y coordinate for
+	// the bezier. Every six 16bit ints (3 pixels) is a full bezier
+	// Plus the header pixels for grid position information, and after the
+	// beziers, the lists of any grid cells with too many beziers to fit in
+	// their texel.
+	uint32_t curvesPixelLength = kGlyphHeaderPixels + curves.size() * 3;
+	uint32_t bezierPixelLength = curvesPixelLength;
+	if (curves.size() > 0) {
+		bezierPixelLength += gridAtlas.OverflowSize(grid);
+	}
+
+	bool tooManyCurves = curves.size() > VGridAtlas::kMaxBeziers;
+
+	if (curves.size() == 0 || tooManyCurves) {
+		if (tooManyCurves) {
+			std::cerr << "WARN: Glyph " << point << " has too many curves\n";
+		}
+
+		GLFontManager::Glyph glyph{};
+		glyph.atlasIndex = UINT16_MAX;
+		glyph.size[0] = glyphWidth;
+		glyph.size[1] = glyphHeight;
+		glyph.offset[0] = metrics.horiBearingX;
+		glyph.offset[1] = metrics.horiBearingY - glyphHeight;
+		glyph.advance = metrics.horiAdvance;
+		glyph.faceId = faceId;
+		glyph.lastUsed = this->residencyClock;
+		this->stats.glyphsCommitted++;
+		return this->glyphs.Insert(faceId, point, glyph);
+	}
+
+	AtlasGroup* atlas = this->GetOpenAtlasGroup();
+	if (!atlas) {
+		return nullptr;
+	}
+
+	size_t glyphDataOffset = next_glyph_data_offset(this->glyphData);
+	if (glyphDataOffset + bezierPixelLength > this->maxGlyphDataSize) {
+		std::cerr << "WARN: Out of glyph data space ("
+			<< "max: " << this->maxGlyphDataSize << " texels)\n";
+		return nullptr;
+	}
+
+	// Find an open position in the grid atlas. A group that can't fit this
+	// glyph is rarely going to fit the next, so stop trying it.
+	uint16_t gridPos[2];
+	while (!atlas->gridPacker.Pack(grid.width, grid.height, gridPos[0], gridPos[1])) {
+		atlas->full = true;
+		atlas = this->GetOpenAtlasGroup(); // Should only ever happen once per glyph
+		if (!atlas) {
+			return nullptr;
+		}
+	}
+
+	this->glyphData.resize((glyphDataOffset + bezierPixelLength) * kAtlasChannels);
+	uint8_t* bezierData = &this->glyphData[glyphDataOffset * kAtlasChannels];
+
+	Vec2 glyphSize(glyphWidth, glyphHeight);
+	write_glyph_data_to_buffer(
+		bezierData,
+		curves,
+		glyphSize,
+		gridPos[0], // pos of grid within atlas
+		gridPos[1],
+		grid.width, //size of vGrid
+		grid.height,
+		this->atlases.size() - 1);
+
+	gridAtlas.data = atlas->gridAtlas;
+	gridAtlas.WriteVGridAt(grid, gridPos[0], gridPos[1],
+		bezierData + curvesPixelLength * kAtlasChannels, curvesPixelLength);
+	this->stats.overflowCells += gridAtlas.overflowCells;
+	this->stats.truncatedCells += gridAtlas.truncatedCells;
+	this->stats.glyphsCommitted++;
+	this->stats.committedBeziers += curves.size();
+
+	GLFontManager::Glyph glyph{};
+	glyph.glyphDataOffset = glyphDataOffset;
+	glyph.atlasIndex = this->atlases.size() - 1;
+	glyph.size[0] = glyphWidth;
+	glyph.size[1] = glyphHeight;
+	glyph.offset[0] = metrics.horiBearingX;
+	glyph.offset[1] = metrics.horiBearingY - glyphHeight;
+	glyph.advance = metrics.horiAdvance;
+	glyph.faceId = faceId;
+	glyph.lastUsed = this->residencyClock;
+	GLFontManager::Glyph* inserted = this->glyphs.Insert(faceId, point, glyph);
+
+	mark_glyph_data_dirty(this, glyphDataOffset, bezierPixelLength);
+	mark_grid_dirty(atlas, gridPos[0], gridPos[1], grid.width, grid.height);
+
+	return inserted;
+}
+
+// Faces are few and labels tend to use the same one for long runs, so a
+// linear search starting from the last face used is plenty.
+uint32_t GLFontManager::GetFaceId(FT_Face face) {
+	if (this->lastFaceId < this->faces.size() && this->faces[this->lastFaceId] == face) {
+		return this->lastFaceId;
+	}
+	for (size_t i = 0; i < this->faces.size(); i++) {
+		if (this->faces[i] == face) {
+			this->lastFaceId = i;
+			return i;
+		}
+	}
+	this->faces.push_back(face);
+	this->faceSources.push_back(FaceSource{});
+	this->lastFaceId = this->faces.size() - 1;
+	return this->lastFaceId;
+}
+
+const std::vector<LayoutGlyph>& GLFontManager::GetLayout(
+	FT_Face face,
+	const std::u32string& text,
+	const LayoutOptions& options) {
+	return this->layouts.Get(face, this->GetFaceId(face), text, options);
+}
+
+float GLFontManager::GetKerning(
+	const Glyph* left,
+	uint32_t leftPoint,
+	const Glyph* right,
+	uint32_t rightPoint,
+	const LayoutOptions& options) {
+	if (!left || !right || left->faceId != right->faceId || left->faceId >= this->faces.size()) {
+		return 0;
+	}
+	FT_Face face = this->faces[left->faceId];
+	return face ? layout_kerning(face, leftPoint, rightPoint, options) : 0;
+}
+
+GlyphCache<GLFontManager::Glyph>::Stats GLFontManager::GetGlyphCacheStats() {
+	return this->glyphs.GetStats();
+}
+
+GLFontManager::Stats GLFontManager::GetStats() {
+	Stats s = this->stats;
+	s.cache = this->glyphs.GetStats();
+	s.layoutCache = this->layouts.GetStats();
+
+	for (size_t i = 0; i < this->atlases.size(); i++) {
+		const AtlasGroup& atlas = this->atlases[i];
+		const std::vector<SkylinePacker::Node>& skyline = atlas.gridPacker.GetSkyline();
+		size_t area = 0;
+		for (size_t j = 0; j < skyline.size(); j++) {
+			area += (size_t)skyline[j].width * skyline[j].y;
+		}
+		s.atlases.push_back(AtlasFill{
+			atlas.gridPacker.UsedHeight(),
+			(float)area / ((size_t)kGridAtlasSize * kGridAtlasSize),
+			atlas.full});
+	}
+	s.glyphDataTexels = this->glyphData.size() / kAtlasChannels;
+	s.maxGlyphDataTexels = this->maxGlyphDataSize;
+	s.residentBytes = this->MemoryUsed();
+	return s;
+}
+
+void GLFontManager::SetTimingsEnabled(bool cpu, bool gpu) {
+	this->cpuTimings = cpu;
+	this->gpuTimings = gpu;
+}
+
+void GLFontManager::SetMemoryBudget(size_t bytes) {
+	this->memoryBudget = bytes;
+	this->compactAbove = bytes;
+}
+
+// Bytes taken by the grid atlases and glyph data. The GPU copies take about
+// the same, plus the room they are given to grow.
+size_t GLFontManager::MemoryUsed() {
+	return this->atlases.size() * sq((size_t)kGridAtlasSize) * kGridTexelBytes + this->glyphData.size();
+}
+
+// A glyph with curves, as Compact() sees it
+struct ResidentGlyph {
+	GLFontManager::Glyph* glyph;
+	uint32_t faceId, point; // Cache key, unused for the solid glyph
+	uint32_t dataLength; // texels
+	uint16_t gridPos[2], gridSize[2], gridLayer; // From its header
+	bool keep;
+};
+
+// Evicts the least recently used glyphs that aren't retained, until the
+// rest should fit in three quarters of the budget, then packs the rest into
+// new atlas groups and glyph data without the holes the others left. The
+// glyphs are updated in place, and atlasGeneration bumped so labels pick up
+// their new offsets. Leaves everything as it was if the rest doesn't fit.
+void GLFontManager::Compact() {
+	std::vector<ResidentGlyph> resident;
+	ResidentGlyph r{};
+	this->glyphs.ForEach([&](uint32_t faceId, uint32_t point, Glyph& glyph) {
+		if (glyph.atlasIndex != UINT16_MAX) {
+			r.glyph = &glyph;
+			r.faceId = faceId;
+			r.point = point;
+			resident.push_back(r);
+		}
+	});
+	if (this->hasSolidGlyph) {
+		r.glyph = &this->solidGlyph;
+		resident.push_back(r);
+	}
+
+	// Glyph data is appended glyph by glyph, so each glyph's runs up to the
+	// next one's
+	std::sort(resident.begin(), resident.end(), [](const ResidentGlyph& a, const ResidentGlyph& b) {
+		return a.glyph->glyphDataOffset < b.glyph->glyphDataOffset;
+	});
+	size_t keptArea = 0, keptData = kGlyphHeaderPixels;
+	for (size_t i = 0; i < resident.size(); i++) {
+		ResidentGlyph& r = resident[i];
+		uint32_t end = (i + 1 < resident.size())
+			? resident[i + 1].glyph->glyphDataOffset
+			: this->glyphData.size() / kAtlasChannels;
+		r.dataLength = end - r.glyph->glyphDataOffset;
+		const uint16_t* header = (const uint16_t*)&this->glyphData[r.glyph->glyphDataOffset * kAtlasChannels];
+		r.gridPos[0] = header[0];
+		r.gridPos[1] = header[1];
+		r.gridSize[0] = header[2];
+		r.gridSize[1] = header[3];
+		r.gridLayer = header[4];
+		r.keep = true;
+		keptArea += (size_t)r.gridSize[0] * r.gridSize[1];
+		keptData += r.dataLength;
+	}
+
+	// Packing never fills a group completely, so assume some waste
+	const size_t layerBytes = sq((size_t)kGridAtlasSize) * kGridTexelBytes;
+	const size_t packedLayerArea = sq((size_t)kGridAtlasSize) * 7 / 8;
+	auto estimate = [&]() {
+		return (keptArea + packedLayerArea - 1) / packedLayerArea * layerBytes + keptData * kAtlasChannels;
+	};
+
+	std::vector<ResidentGlyph*> cold;
+	for (size_t i = 0; i < resident.size(); i++) {
+		if (resident[i].glyph->refCount == 0 && resident[i].glyph != &this->solidGlyph) {
+			cold.push_back(&resident[i]);
+		}
+	}
+	std::sort(cold.begin(), cold.end(), [](const ResidentGlyph* a, const ResidentGlyph* b) {
+		return a->glyph->lastUsed < b->glyph->lastUsed;
+	});
+	size_t target = this->memoryBudget / 4 * 3;
+	size_t evicted = 0;
+	for (; evicted < cold.size() && estimate() > target; evicted++) {
+		ResidentGlyph& r = *cold[evicted];
+		r.keep = false;
+		keptArea -= (size_t)r.gridSize[0] * r.gridSize[1];
+		keptData -= r.dataLength;
+	}
+
+	// Don't try again until there's a fair bit more, in case the retained
+	// glyphs alone are over the budget
+	if (evicted == 0) {
+		this->compactAbove = std::max(this->memoryBudget, this->MemoryUsed() + this->memoryBudget / 4);
+		return;
+	}
+
+	// Tallest grids first leave the flattest skylines
+	std::vector<ResidentGlyph*> order;
+	for (size_t i = 0; i < resident.size(); i++) {
+		if (resident[i].keep) {
+			order.push_back(&resident[i]);
+		}
+	}
+	std::stable_sort(order.begin(), order.end(), [](const ResidentGlyph* a, const ResidentGlyph* b) {
+		return a->gridSize[1] > b->gridSize[1];
+	});
+
+	std::vector<AtlasGroup> packed;
+	std::vector<std::array<uint16_t, 3>> newGrids(resident.size()); // XY and layer
+	for (size_t i = 0; i < order.size(); i++) {
+		ResidentGlyph& r = *order[i];
+		uint16_t x, y;
+		if (packed.empty() || !packed.back().gridPacker.Pack(r.gridSize[0], r.gridSize[1], x, y)) {
+			if (!packed.empty()) {
+				packed.back().full = true;
+			}
+			if (packed.size() >= (size_t)this->maxGridAtlasLayers) {
+				std::cerr << "WARN: Can't compact the grid atlases\n";
+				for (size_t j = 0; j < packed.size(); j++) {
+					delete[] packed[j].gridAtlas;
+				}
+				this->compactAbove = std::max(this->memoryBudget, this->MemoryUsed() + this->memoryBudget / 4);
+				return;
+			}
+			AtlasGroup group{};
+			group.gridAtlas = new uint16_t[sq(kGridAtlasSize) * kAtlasChannels]();
+			group.gridPacker = SkylinePacker(kGridAtlasSize, kGridAtlasSize);
+			packed.push_back(group);
+			packed.back().gridPacker.Pack(r.gridSize[0], r.gridSize[1], x, y); // Grids always fit an empty group
+		}
+
+		const uint16_t* from = this->atlases[r.gridLayer].gridAtlas;
+		uint16_t* to = packed.back().gridAtlas;
+		for (uint16_t row = 0; row < r.gridSize[1]; row++) {
+			memcpy(to + ((y + row) * kGridAtlasSize + x) * kAtlasChannels,
+				from + ((r.gridPos[1] + row) * kGridAtlasSize + r.gridPos[0]) * kAtlasChannels,
+				r.gridSize[0] * kGridTexelBytes);
+		}
+		newGrids[&r - &resident[0]] = {x, y, (uint16_t)(packed.size() - 1)};
+	}
+
+	// Kept glyph data stays in the same order, with headers pointing at the
+	// new grids. Bezier indices and overflow lists are relative to the start
+	// of the glyph's data, so the rest moves as it is.
+	std::vector<uint8_t> glyphData(kGlyphHeaderPixels * kAtlasChannels);
+	glyphData.reserve(keptData * kAtlasChannels);
+	for (size_t i = 0; i < resident.size(); i++) {
+		ResidentGlyph& r = resident[i];
+		if (!r.keep) {
+			this->glyphs.Remove(r.faceId, r.point);
+			continue;
+		}
+		uint32_t offset = glyphData.size() / kAtlasChannels;
+		const uint8_t* data = &this->glyphData[r.glyph->glyphDataOffset * kAtlasChannels];
+		glyphData.insert(glyphData.end(), data, data + r.dataLength * kAtlasChannels);
+
+		uint16_t* header = (uint16_t*)&glyphData[offset * kAtlasChannels];
+		header[0] = newGrids[i][0];
+		header[1] = newGrids[i][1];
+		header[4] = newGrids[i][2];
+		r.glyph->glyphDataOffset = offset;
+		r.glyph->atlasIndex = newGrids[i][2];
+	}
+
+	for (size_t i = 0; i < this->atlases.size(); i++) {
+		delete[] this->atlases[i].gridAtlas;
+	}
+	this->atlases.swap(packed);
+	this->glyphData.swap(glyphData);
+
+	// UploadAtlases() reallocates the GPU copies to fit, and sends them
+	// everything again
+	this->gridAtlasLayers = 0;
+	this->glyphDataCapacity = 0;
+	this->dirtyGlyphDataMin = this->dirtyGlyphDataMax = 0;
+
+	this->atlasGeneration++;
+	this->failedGlyphs.clear(); // They might fit now
+	this->stats.evictedGlyphs += evicted;
+	this->stats.compactions++;
+	this->compactAbove = std::max(this->memoryBudget, this->MemoryUsed() + this->memoryBudget / 4);
+}
+
+static uint64_t glyph_key(uint32_t faceId, uint32_t point) {
+	return ((uint64_t)faceId << 32) | point;
+}
+
+// The glyph as another manager prepared it, if any, see Create()
+const StoredGlyph* GLFontManager::FindStored(uint32_t faceId, uint32_t point) {
+	uint32_t storeFontId = this->faceSources[faceId].storeFontId;
+	return storeFontId ? this->store->Find(storeFontId, point) : nullptr;
+}
+
+// Hands a glyph to the worker threads, unless they already have it. The
+// request, if any, is told once the glyph is committed. Returns false if the
+// face has no file the workers can open, or if the glyph is in the store,
+// where LoadGlyph() takes it from without waiting.
+bool GLFontManager::QueueGlyph(
+	uint32_t faceId,
+	uint32_t point,
+	std::shared_ptr<GlyphRequest> request) {
+	const FaceSource& source = this->faceSources[faceId];
+	if (!source.file || this->FindStored(faceId, point)) {
+		return false;
+	}
+
+	uint64_t key = glyph_key(faceId, point);
+	auto it = this->glyphsInFlight.find(key);
+	if (it == this->glyphsInFlight.end()) {
+		if (!this->loader) {
+			// Leave a core for the GL thread
+			unsigned numThreads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+			this->loader.reset(new GlyphLoader(numThreads, kGridMaxSize, kAtlasChannels));
+		}
+		this->loader->Push(GlyphLoader::Job{faceId, source.file, source.index, point});
+		this->faceGlyphsInFlight[faceId]++;
+		this->stats.glyphsQueued++;
+		it = this->glyphsInFlight.emplace(key, std::vector<std::shared_ptr<GlyphRequest>>()).first;
+	}
+
+	if (request) {
+		it->second.push_back(request);
+		request->remaining++;
+	}
+	return true;
+}
+
+std::shared_future<void> GLFontManager::RequestGlyphs(FT_Face face, std::u32string codepoints) {
+	std::shared_ptr<GlyphRequest> request = std::make_shared<GlyphRequest>();
+	request->remaining = 0;
+	std::shared_future<void> future = request->promise.get_future().share();
+
+	uint32_t faceId = this->GetFaceId(face);
+	for (size_t i = 0; i < codepoints.size(); i++) {
+		if (this->glyphs.Peek(faceId, codepoints[i])
+			|| this->failedGlyphs.count(glyph_key(faceId, codepoints[i]))) {
+			continue;
+		}
+		if (!this->QueueGlyph(faceId, codepoints[i], request)) {
+			this->GetGlyphForCodepoint(face, codepoints[i]);
+		}
+	}
+
+	if (request->remaining == 0) {
+		request->promise.set_value();
+	}
+	return future;
+}
+
+GLFontManager::Glyph* GLFontManager::GetGlyphOrRequest(FT_Face face, uint32_t point, bool* pending) {
+	*pending = false;
+
+	uint32_t faceId = this->GetFaceId(face);
+	GLFontManager::Glyph* cached = this->glyphs.Find(faceId, point);
+	if (cached) {
+		cached->lastUsed = this->residencyClock;
+		return cached;
+	}
+	if (this->failedGlyphs.count(glyph_key(faceId, point))) {
+		return nullptr;
+	}
+	if (this->QueueGlyph(faceId, point, nullptr)) {
+		*pending = true;
+		return nullptr;
+	}
+	return this->LoadGlyph(face, faceId, point);
+}
+
+bool GLFontManager::IsGlyphPending(FT_Face face, uint32_t point) {
+	return this->glyphsInFlight.count(glyph_key(this->GetFaceId(face), point)) > 0;
+}
+
+void GLFontManager::CommitPreparedGlyphs() {
+	if (!this->loader) {
+		return;
+	}
+
+	std::vector<GlyphLoader::Result> results;
+	this->loader->TakeResults(results);
+
+	for (size_t i = 0; i < results.size(); i++) {
+		GlyphLoader::Result& result = results[i];
+		this->faceGlyphsInFlight[result.faceId]--;
+
+		// The glyph might have been loaded synchronously in the meantime
+		uint64_t key = glyph_key(result.faceId, result.point);
+		if (!this->glyphs.Peek(result.faceId, result.point)) {
+			if (!result.loaded || !this->CommitGlyph(result.faceId, result.point, result.glyph)) {
+				this->failedGlyphs.insert(key);
+				this->stats.glyphsFailed++;
+			}
+			uint32_t storeFontId = this->faceSources[result.faceId].storeFontId;
+			if (result.loaded && storeFontId) {
+				this->store->Insert(storeFontId, result.point, result.glyph);
+			}
+		}
+
+		auto it = this->glyphsInFlight.find(key);
+		if (it != this->glyphsInFlight.end()) {
+			for (size_t j = 0; j < it->second.size(); j++) {
+				if (--it->second[j]->remaining == 0) {
+					it->second[j]->promise.set_value();
+				}
+			}
+			this->glyphsInFlight.erase(it);
+		}
+	}
+
+	if (results.size() > 0) {
+		this->glyphCommits++;
+	}
+	if (!this->workerFacesToRelease.empty()) {
+		this->ReleaseWorkerFaces();
+	}
+}
+
+void GLFontManager::PreloadRange(FT_Face face, uint32_t first, uint32_t last) {
+	std::vector<uint32_t> codepoints;
+	for (uint64_t point = first; point <= last; point++) {
+		codepoints.push_back(point);
+	}
+	this->PreloadSet(face, codepoints);
+}
+
+void GLFontManager::PreloadSet(FT_Face face, std::vector<uint32_t> codepoints) {
+	if (!face) {
+		return;
+	}
+
+	// Codepoint order, not the caller's, so the atlases pack the same for
+	// the same set. Codepoints missing from the font would each get their
+	// own copy of the missing glyph, so only 0 is kept of those.
+	uint32_t faceId = this->GetFaceId(face);
+	std::sort(codepoints.begin(), codepoints.end());
+	codepoints.erase(std::unique(codepoints.begin(), codepoints.end()), codepoints.end());
+	// Glyphs in the store are taken from there, in the same order as the
+	// rest so the atlases still pack the same
+	std::vector<uint32_t> points, unstored;
+	for (size_t i = 0; i < codepoints.size(); i++) {
+		uint32_t point = codepoints[i];
+		if ((point == 0 || FT_Get_Char_Index(face, point) != 0) && !this->glyphs.Peek(faceId, point)) {
+			points.push_back(point);
+			if (!this->FindStored(faceId, point)) {
+				unstored.push_back(point);
+			}
+		}
+	}
+
+	const FaceSource& source = this->faceSources[faceId];
+	if (!source.file) {
+		for (size_t i = 0; i < points.size(); i++) {
+			this->LoadGlyph(face, faceId, points[i]);
+		}
+		this->UploadAtlases();
+		return;
+	}
+
+	std::vector<PreparedGlyph> prepared;
+	std::vector<uint8_t> loaded;
+	prepare_glyphs(source.file, source.index, unstored, std::max(std::thread::hardware_concurrency(), 1u),
+		kGridMaxSize, kAtlasChannels, prepared, loaded);
+
+	for (size_t i = 0, j = 0; i < points.size(); i++) {
+		if (j == unstored.size() || unstored[j] != points[i]) {
+			this->LoadGlyph(face, faceId, points[i]);
+			continue;
+		}
+		if (!loaded[j] || !this->CommitGlyph(faceId, points[i], prepared[j])) {
+			this->failedGlyphs.insert(glyph_key(faceId, points[i]));
+			this->stats.glyphsFailed++;
+		}
+		if (loaded[j] && source.storeFontId) {
+			this->store->Insert(source.storeFontId, points[i], prepared[j]);
+		}
+		j++;
+	}
+	this->stats.glyphsPrepared += unstored.size();
+	this->UploadAtlases();
+}
+
+void GLFontManager::LoadASCII(FT_Face face) {
+	std::vector<uint32_t> codepoints(1, 0);
+	for (uint32_t i = 32; i < 128; i++) {
+		codepoints.push_back(i);
+	}
+	this->PreloadSet(face, codepoints);
+}
+
+// Atlas files (see GLFontManager::SaveAtlas()) start with an
+// AtlasFileHeader, followed by these sections, each padded to 4 bytes:
+//   numFaces times an AtlasFileFace, then its path
+//   numAtlases times an AtlasFileAtlas, then its skyline nodes, then the
+//     rows of its grid atlas up to usedHeight, which hold every grid in it
+//   numGlyphs AtlasFileGlyphs
+//   glyphDataSize texels of glyph data
+// Everything is in the native byte order, same as what is sent to the GPU.
+// Bump kAtlasFileVersion whenever the layout of any of it changes, including
+// the grid and glyph data formats.
+static const char kAtlasFileMagic[8] = {'G', 'L', 'L', 'A', 'T', 'L', 'A', 'S'};
+static const uint32_t kAtlasFileVersion = 3;
+
+// The glyph fields kept in the file. Glyph itself isn't written, so fields
+// the running manager adds to it don't change the file's layout.
+struct AtlasFileGlyphInfo {
+	uint16_t size[2];
+	int16_t offset[2];
+	uint32_t glyphDataOffset;
+	uint16_t atlasIndex;
+	int16_t advance;
+};
+
+struct AtlasFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint16_t gridAtlasSize;
+	uint8_t atlasChannels;
+	uint8_t glyphHeaderPixels;
+	uint32_t numFaces;
+	uint32_t numAtlases;
+	uint32_t numGlyphs;
+	uint32_t glyphDataSize; // texels
+	uint32_t hasSolidGlyph;
+	AtlasFileGlyphInfo solidGlyph;
+};
+
+struct AtlasFileFace {
+	uint32_t pathLength;
+	int32_t numGlyphs;
+	uint32_t unitsPerEM;
+	int32_t faceIndex;
+	uint64_t fileSize;
+	uint64_t fileHash; // See FontFile::Hash()
+};
+
+struct AtlasFileAtlas {
+	uint16_t usedHeight;
+	uint16_t full;
+	uint32_t numNodes;
+};
+
+struct AtlasFileGlyph {
+	uint32_t faceId; // Index of the face in the file
+	uint32_t point;
+	AtlasFileGlyphInfo glyph;
+};
+
+static AtlasFileGlyphInfo to_file_glyph(const GLFontManager::Glyph& glyph) {
+	AtlasFileGlyphInfo info{};
+	info.size[0] = glyph.size[0];
+	info.size[1] = glyph.size[1];
+	info.offset[0] = glyph.offset[0];
+	info.offset[1] = glyph.offset[1];
+	info.glyphDataOffset = glyph.glyphDataOffset;
+	info.atlasIndex = glyph.atlasIndex;
+	info.advance = glyph.advance;
+	return info;
+}
+
+// Residency fields start cleared, since nothing holds the glyph yet
+static GLFontManager::Glyph from_file_glyph(const AtlasFileGlyphInfo& info, uint32_t faceId) {
+	GLFontManager::Glyph glyph{};
+	glyph.size[0] = info.size[0];
+	glyph.size[1] = info.size[1];
+	glyph.offset[0] = info.offset[0];
+	glyph.offset[1] = info.offset[1];
+	glyph.glyphDataOffset = info.glyphDataOffset;
+	glyph.atlasIndex = info.atlasIndex;
+	glyph.advance = info.advance;
+	glyph.faceId = faceId;
+	return glyph;
+}
+
+static void append_bytes(std::vector<uint8_t>& out, const void* data, size_t size) {
+	out.insert(out.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+	out.resize((out.size() + 3) & ~(size_t)3);
+}
+
+// Reads an atlas file section by section, see AtlasFileHeader
+struct AtlasFileReader {
+	const uint8_t* pos;
+	const uint8_t* end;
+
+	// Returns a pointer to the next `size` bytes, or null past the end
+	const uint8_t* Take(size_t size) {
+		size_t padded = (size + 3) & ~(size_t)3;
+		if (padded > (size_t)(this->end - this->pos)) {
+			return nullptr;
+		}
+		const uint8_t* data = this->pos;
+		this->pos += padded;
+		return data;
+	}
+
+	template <class T>
+	bool Read(T* value) {
+		const uint8_t* data = this->Take(sizeof(T));
+		if (data) {
+			memcpy(value, data, sizeof(T));
+		}
+		return data != nullptr;
+	}
+};
+
+bool GLFontManager::SaveAtlas(std::string path) {
+	AtlasFileHeader header{};
+	memcpy(header.magic, kAtlasFileMagic, sizeof(header.magic));
+	header.version = kAtlasFileVersion;
+	header.gridAtlasSize = kGridAtlasSize;
+	header.atlasChannels = kAtlasChannels;
+	header.glyphHeaderPixels = kGlyphHeaderPixels;
+	header.numAtlases = this->atlases.size();
+	header.glyphDataSize = this->glyphData.size() / kAtlasChannels;
+	header.hasSolidGlyph = this->hasSolidGlyph;
+	header.solidGlyph = to_file_glyph(this->solidGlyph);
+
+	std::vector<uint8_t> out(sizeof(AtlasFileHeader));
+
+	// Index of each face in the file, or UINT32_MAX if it's left out
+	std::vector<uint32_t> fileFaceIds(this->faces.size(), UINT32_MAX);
+	for (size_t i = 0; i < this->faces.size(); i++) {
+		AtlasFileFace fileFace{};
+		const FaceSource& source = this->faceSources[i];
+		if (this->faces[i]) {
+			if (!source.file) {
+				continue;
+			}
+			fileFace.numGlyphs = this->faces[i]->num_glyphs;
+			fileFace.unitsPerEM = this->faces[i]->units_per_EM;
+			fileFace.fileSize = source.file->Size();
+			fileFace.fileHash = source.file->Hash();
+		}
+		else {
+			// Baked faces that were never opened, or were closed since, are
+			// passed on as they are
+			auto baked = std::find_if(this->bakedFaces.begin(), this->bakedFaces.end(),
+				[i](const BakedFace& b) { return b.faceId == i; });
+			if (baked == this->bakedFaces.end()) {
+				continue;
+			}
+			fileFace.numGlyphs = baked->numGlyphs;
+			fileFace.unitsPerEM = baked->unitsPerEM;
+			fileFace.fileSize = baked->fileSize;
+			fileFace.fileHash = baked->fileHash;
+		}
+		if (source.path.empty()) {
+			continue;
+		}
+
+		fileFace.pathLength = source.path.size();
+		fileFace.faceIndex = source.index;
+		fileFaceIds[i] = header.numFaces++;
+		append_bytes(out, &fileFace, sizeof(fileFace));
+		append_bytes(out, source.path.data(), fileFace.pathLength);
+	}
+
+	for (size_t i = 0; i < this->atlases.size(); i++) {
+		AtlasGroup& atlas = this->atlases[i];
+		const std::vector<SkylinePacker::Node>& skyline = atlas.gridPacker.GetSkyline();
+		AtlasFileAtlas fileAtlas{};
+		fileAtlas.usedHeight = atlas.gridPacker.UsedHeight();
+		fileAtlas.full = atlas.full;
+		fileAtlas.numNodes = skyline.size();
+		append_bytes(out, &fileAtlas, sizeof(fileAtlas));
+		append_bytes(out, &skyline[0], skyline.size() * sizeof(SkylinePacker::Node));
+		append_bytes(out, atlas.gridAtlas, fileAtlas.usedHeight * kGridAtlasSize * kGridTexelBytes);
+	}
+
+	this->glyphs.ForEach([&](uint32_t faceId, uint32_t point, const Glyph& glyph) {
+		if (fileFaceIds[faceId] != UINT32_MAX) {
+			AtlasFileGlyph fileGlyph{fileFaceIds[faceId], point, to_file_glyph(glyph)};
+			append_bytes(out, &fileGlyph, sizeof(fileGlyph));
+			header.numGlyphs++;
+		}
+	});
+
+	append_bytes(out, &this->glyphData[0], this->glyphData.size());
+	memcpy(&out[0], &header, sizeof(header));
+
+	std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file.is_open() || !file.write((const char*)&out[0], out.size())) {
+		std::cerr << "WARN: Can't write atlas file " << path << "\n";
+		return false;
+	}
+	return true;
+}
+
+// Checks an atlas file and, if it's fine, loads it into the empty manager
+static bool load_atlas_file(GLFontManager* manager, const uint8_t* data, size_t size) {
+	AtlasFileReader reader{data, data + size};
+	AtlasFileHeader header;
+	if (!reader.Read(&header)
+		|| memcmp(header.magic, kAtlasFileMagic, sizeof(header.magic)) != 0
+		|| header.version != kAtlasFileVersion
+		|| header.gridAtlasSize != kGridAtlasSize
+		|| header.atlasChannels != kAtlasChannels
+		|| header.glyphHeaderPixels != kGlyphHeaderPixels
+		|| header.numAtlases > (size_t)manager->maxGridAtlasLayers
+		|| header.glyphDataSize < kGlyphHeaderPixels
+		|| header.glyphDataSize > manager->maxGlyphDataSize) {
+		return false;
 	}
 
-	glm::vec2 startOffset(0, 0);
-	if (index > 0) {
-		startOffset = this->verts[(index - 1) * 6].pos;
-		if (this->glyphs[index - 1]) {
-			startOffset += -glm::vec2(this->glyphs[index - 1]->offset[0], this->glyphs[index - 1]->offset[1]) + glm::vec2(this->glyphs[index - 1]->advance, 0);
+	// Find every section before changing anything, so a truncated file
+	// leaves the manager as it was
+	std::vector<std::pair<AtlasFileFace, std::string>> faces(header.numFaces);
+	for (size_t i = 0; i < faces.size(); i++) {
+		const uint8_t* path;
+		if (!reader.Read(&faces[i].first) || !(path = reader.Take(faces[i].first.pathLength))) {
+			return false;
 		}
+		faces[i].second.assign((const char*)path, faces[i].first.pathLength);
 	}
 
-	// Since all the glyphs between index-1 and index+length have been erased,
-	// the end offset will be at index until it gets shifted back
-	glm::vec2 endOffset(0, 0);
-	// if (this->glyphs[index+length-1])
-	// {
-	endOffset = this->verts[index * 6].pos;
-	if (this->glyphs[index + length - 1]) {
-		endOffset += -glm::vec2(this->glyphs[index + length - 1]->offset[0], this->glyphs[index + length - 1]->offset[1]) + glm::vec2(this->glyphs[index + length - 1]->advance, 0);
+	struct LoadedAtlas {
+		AtlasFileAtlas info;
+		std::vector<SkylinePacker::Node> skyline;
+		const uint8_t* rows;
+	};
+	std::vector<LoadedAtlas> atlases(header.numAtlases);
+	for (size_t i = 0; i < atlases.size(); i++) {
+		LoadedAtlas& atlas = atlases[i];
+		const uint8_t* nodes;
+		if (!reader.Read(&atlas.info)
+			|| atlas.info.usedHeight > kGridAtlasSize
+			|| atlas.info.numNodes > kGridAtlasSize
+			|| !(nodes = reader.Take(atlas.info.numNodes * sizeof(SkylinePacker::Node)))
+			|| !(atlas.rows = reader.Take(atlas.info.usedHeight * kGridAtlasSize * kGridTexelBytes))) {
+			return false;
+		}
+		atlas.skyline.resize(atlas.info.numNodes);
+		memcpy(atlas.skyline.data(), nodes, atlas.info.numNodes * sizeof(SkylinePacker::Node));
 	}
-	// }
 
-	this->text.erase(index, length);
-	this->glyphs.erase(this->glyphs.begin() + index, this->glyphs.begin() + (index + length));
-	this->verts.erase(this->verts.begin() + index * 6, this->verts.begin() + (index + length) * 6);
+	const uint8_t* glyphs = reader.Take((size_t)header.numGlyphs * sizeof(AtlasFileGlyph));
+	const uint8_t* glyphData = reader.Take((size_t)header.glyphDataSize * kAtlasChannels);
+	if (!glyphs || !glyphData) {
+		return false;
+	}
 
-	glm::vec2 deltaOffset = endOffset - startOffset;
-	// Shift everything after, if necessary
-	for (size_t i = index; i < this->text.size(); i++) {
-		if (this->text[i] == '\n') {
-			deltaOffset.x = 0;
+	// Glyphs have to stay within the atlases and glyph data, and start on
+	// even texels (see next_glyph_data_offset()). So do the grids their
+	// headers point to.
+	auto glyphFits = [&](const AtlasFileGlyphInfo& glyph) {
+		if (glyph.glyphDataOffset > header.glyphDataSize - kGlyphHeaderPixels
+			|| glyph.glyphDataOffset % 2 != 0) {
+			return false;
 		}
-
-		for (unsigned int j = 0; j < 6; j++) {
-			this->verts[i * 6 + j].pos -= deltaOffset;
+		if (glyph.atlasIndex == UINT16_MAX) {
+			return true;
+		}
+		if (glyph.atlasIndex >= header.numAtlases) {
+			return false;
+		}
+		uint16_t gridHeader[5];
+		memcpy(gridHeader, glyphData + (size_t)glyph.glyphDataOffset * kAtlasChannels, sizeof(gridHeader));
+		uint32_t x = gridHeader[0], y = gridHeader[1], w = gridHeader[2], h = gridHeader[3];
+		return gridHeader[4] == glyph.atlasIndex
+			&& w <= kGridMaxSize && h <= kGridMaxSize
+			&& x + w <= kGridAtlasSize
+			&& y + h <= atlases[glyph.atlasIndex].info.usedHeight;
+	};
+	for (size_t i = 0; i < header.numGlyphs; i++) {
+		AtlasFileGlyph fileGlyph;
+		memcpy(&fileGlyph, glyphs + i * sizeof(AtlasFileGlyph), sizeof(fileGlyph));
+		if (fileGlyph.faceId >= header.numFaces || !glyphFits(fileGlyph.glyph)) {
+			return false;
 		}
 	}
-
-	glBindBuffer(GL_ARRAY_BUFFER, this->vertBuffer);
-	if (this->verts.size() > 0) {
-		glBufferSubData(GL_ARRAY_BUFFER,
-			index * 6 * sizeof(GlyphVertex),
-			(this->verts.size() - index * 6) * sizeof(GlyphVertex),
-			&this->verts[index * 6]);
+	if (header.hasSolidGlyph && !glyphFits(header.solidGlyph)) {
+		return false;
 	}
 
-	caretTime = 0;
-}
-
-void GLLabel::Render(float time, glm::mat4 transform) {
-	float deltaTime = time - prevTime;
-	this->caretTime += deltaTime;
-
-	this->manager->UseGlyphShader();
-	this->manager->UploadAtlases();
-	this->manager->UseAtlasTextures(0); // TODO: Textures based on each glyph
-	this->manager->SetShaderTransform(transform);
-
-	glEnable(GL_BLEND);
-	glBindBuffer(GL_ARRAY_BUFFER, this->vertBuffer);
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, pos));
-	glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, data));
-	glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, color));
-
-	glDrawArrays(GL_TRIANGLES, 0, this->verts.size());
-
-	if (this->showingCaret && !(((int)(this->caretTime * 3 / 2)) % 2)) {
-		GLFontManager::Glyph* pipe = this->manager->GetGlyphForCodepoint(this->manager->GetDefaultFont(), '|');
-
-		size_t index = this->caretPosition;
-
-		glm::vec2 offset(0, 0);
-		if (index > 0) {
-			offset = this->verts[(index - 1) * 6].pos;
-			if (this->glyphs[index - 1]) {
-				offset += -glm::vec2(this->glyphs[index - 1]->offset[0], this->glyphs[index - 1]->offset[1]) + glm::vec2(this->glyphs[index - 1]->advance, 0);
+	// Faces that are already open keep their id, the rest get one waiting
+	// for GetFontFromPath()
+	std::vector<uint32_t> faceIds(faces.size());
+	for (size_t i = 0; i < faces.size(); i++) {
+		const AtlasFileFace& fileFace = faces[i].first;
+		faceIds[i] = UINT32_MAX;
+		for (size_t j = 0; j < manager->faces.size(); j++) {
+			FT_Face face = manager->faces[j];
+			const GLFontManager::FaceSource& source = manager->faceSources[j];
+			if (face && source.file && source.path == faces[i].second && source.index == fileFace.faceIndex
+				&& face->num_glyphs == fileFace.numGlyphs && face->units_per_EM == fileFace.unitsPerEM
+				&& source.file->Size() == fileFace.fileSize && source.file->Hash() == fileFace.fileHash) {
+				faceIds[i] = j;
+				break;
 			}
 		}
-
-		GlyphVertex x[6]{};
-		x[0].pos = glm::vec2(0, 0);
-		x[1].pos = glm::vec2(pipe->size[0], 0);
-		x[2].pos = glm::vec2(0, pipe->size[1]);
-		x[3].pos = glm::vec2(pipe->size[0], pipe->size[1]);
-		x[4].pos = glm::vec2(0, pipe->size[1]);
-		x[5].pos = glm::vec2(pipe->size[0], 0);
-		for (unsigned int j = 0; j < 6; j++) {
-			x[j].pos += offset;
-			x[j].pos[0] += pipe->offset[0];
-			x[j].pos[1] += pipe->offset[1];
-
-			x[j].color = { 0,0,255,100 };
-
-			// Encode both the bezier position and the norm coord into one int
-			// This theoretically could overflow, but the atlas position will
-			// never be over half the size of a uint16, so it's fine.
-			unsigned int k = (j < 4) ? j : 6 - j;
-			unsigned int normX = k & 1;
-			unsigned int normY = k > 1;
-			unsigned int norm = (normX << 1) + normY;
-			x[j].data = (pipe->bezierAtlasPos[0] << 2) + norm;
-			// this->verts[(index + i)*6 + j] = v[j];
+		if (faceIds[i] == UINT32_MAX) {
+			faceIds[i] = manager->faces.size();
+			manager->faces.push_back(nullptr);
+			GLFontManager::FaceSource source{};
+			source.path = faces[i].second;
+			source.index = fileFace.faceIndex;
+			manager->faceSources.push_back(source);
+			manager->bakedFaces.push_back(GLFontManager::BakedFace{
+				faceIds[i], fileFace.numGlyphs, (FT_UShort)fileFace.unitsPerEM,
+				fileFace.fileSize, fileFace.fileHash});
 		}
-
-		glBindBuffer(GL_ARRAY_BUFFER, this->caretBuffer);
-		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, pos));
-		glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, data));
-		glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(GLLabel::GlyphVertex), (void*)offsetof(GLLabel::GlyphVertex, color));
-
-		glBufferData(GL_ARRAY_BUFFER, 6 * sizeof(GlyphVertex), &x[0], GL_STREAM_DRAW);
-		glDrawArrays(GL_TRIANGLES, 0, 6);
 	}
 
-	glDisableVertexAttribArray(0);
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(2);
-	glDisable(GL_BLEND);
-	prevTime = time;
-}
-
-
-GLFontManager::GLFontManager() : defaultFace(nullptr) {
-	if (FT_Init_FreeType(&this->ft) != FT_Err_Ok) {
-		std::cerr << "Failed to load freetype\n";
+	for (size_t i = 0; i < atlases.size(); i++) {
+		const LoadedAtlas& loaded = atlases[i];
+		GLFontManager::AtlasGroup group{};
+		group.gridAtlas = new uint16_t[sq(kGridAtlasSize) * kAtlasChannels]();
+		memcpy(group.gridAtlas, loaded.rows, loaded.info.usedHeight * kGridAtlasSize * kGridTexelBytes);
+		group.gridPacker = SkylinePacker(kGridAtlasSize, kGridAtlasSize, loaded.skyline);
+		group.full = loaded.info.full;
+		if (loaded.info.usedHeight > 0) {
+			mark_grid_dirty(&group, 0, 0, kGridAtlasSize, loaded.info.usedHeight);
+		}
+		manager->atlases.push_back(group);
 	}
 
-	this->glyphShader = loadShaderProgram(kGlyphVertexShaderPath, kGlyphFragmentShaderPath);
-	this->uGridAtlas = glGetUniformLocation(glyphShader, "uGridAtlas");
-	this->uGlyphData = glGetUniformLocation(glyphShader, "uGlyphData");
-	this->uTransform = glGetUniformLocation(glyphShader, "uTransform");
-
-	this->UseGlyphShader();
-	glUniform1i(this->uGridAtlas, 0);
-	glUniform1i(this->uGlyphData, 1);
-
-	glm::mat4 iden = glm::mat4(1.0);
-	glUniformMatrix4fv(this->uTransform, 1, GL_FALSE, glm::value_ptr(iden));
-}
+	for (size_t i = 0; i < header.numGlyphs; i++) {
+		AtlasFileGlyph fileGlyph;
+		memcpy(&fileGlyph, glyphs + i * sizeof(AtlasFileGlyph), sizeof(fileGlyph));
+		uint32_t faceId = faceIds[fileGlyph.faceId];
+		manager->glyphs.Insert(faceId, fileGlyph.point, from_file_glyph(fileGlyph.glyph, faceId));
+	}
 
-GLFontManager::~GLFontManager() {
-	// TODO: Destroy atlases
-	glDeleteProgram(this->glyphShader);
-	FT_Done_FreeType(this->ft);
-}
+	manager->glyphData.assign(glyphData, glyphData + (size_t)header.glyphDataSize * kAtlasChannels);
+	mark_glyph_data_dirty(manager, 0, header.glyphDataSize);
 
-std::shared_ptr<GLFontManager> GLFontManager::GetFontManager() {
-	if (!GLFontManager::singleton) {
-		GLFontManager::singleton = std::shared_ptr<GLFontManager>(new GLFontManager());
+	if (header.hasSolidGlyph) {
+		manager->solidGlyph = from_file_glyph(header.solidGlyph, UINT32_MAX); // Kerns with nothing
+		manager->hasSolidGlyph = true;
 	}
-	return GLFontManager::singleton;
+	return true;
 }
 
-// TODO: FT_Faces don't get destroyed... FT_Done_FreeType cleans them eventually,
-// but maybe use shared pointers?
-FT_Face GLFontManager::GetFontFromPath(std::string fontPath) {
-	FT_Face face;
-	return FT_New_Face(this->ft, fontPath.c_str(), 0, &face) ? nullptr : face;
-}
+bool GLFontManager::LoadAtlas(std::string path) {
+	// Glyph data offsets and atlas indices are used as they are in the file
+	if (!this->atlases.empty() || this->hasSolidGlyph || this->glyphs.GetStats().size > 0) {
+		std::cerr << "WARN: Atlas files can only be loaded before any glyphs\n";
+		return false;
+	}
 
-FT_Face GLFontManager::GetFontFromName(std::string fontName) {
-	std::string path = fontName; // TODO
-	return GLFontManager::GetFontFromPath(path);
-}
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	void* mapped = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		std::cerr << "WARN: Can't map atlas file " << path << "\n";
+		return false;
+	}
 
-FT_Face GLFontManager::GetDefaultFont() {
-	// TODO
-	if (!defaultFace) {
-		defaultFace = GLFontManager::GetFontFromPath("fonts/LiberationSans-Regular.ttf");
+	bool loaded = load_atlas_file(this, (const uint8_t*)mapped, st.st_size);
+	munmap(mapped, st.st_size);
+	if (!loaded) {
+		std::cerr << "WARN: Atlas file " << path << " is invalid or from another version\n";
 	}
-	return defaultFace;
+	return loaded;
 }
 
-GLFontManager::AtlasGroup* GLFontManager::GetOpenAtlasGroup() {
-	if (this->atlases.size() == 0 || this->atlases[this->atlases.size() - 1].full) {
-		AtlasGroup group{};
-		group.glyphDataBuf = new uint8_t[sq(kBezierAtlasSize) * kAtlasChannels]();
-		group.gridAtlas = new uint8_t[sq(kGridAtlasSize) * kAtlasChannels]();
-		group.uploaded = true;
-
-		// https://www.khronos.org/opengl/wiki/Buffer_Texture
-		// TODO: Check GL_MAX_TEXTURE_BUFFER_SIZE
-		glGenBuffers(1, &group.glyphDataBufId);
-		glBindBuffer(GL_TEXTURE_BUFFER, group.glyphDataBufId);
-		glGenTextures(1, &group.glyphDataBufTexId);
-		glBindTexture(GL_TEXTURE_BUFFER, group.glyphDataBufTexId);
-		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8, group.glyphDataBufId);
-
-		glGenTextures(1, &group.gridAtlasId);
-		glBindTexture(GL_TEXTURE_2D, group.gridAtlasId);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, kGridAtlasSize, kGridAtlasSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, group.gridAtlas);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
-		this->atlases.push_back(group);
+void GLFontManager::WriteAtlasBMPs(std::string prefix) {
+	std::vector<uint8_t> pixels(sq(kGridAtlasSize) * kAtlasChannels);
+	for (size_t i = 0; i < this->atlases.size(); i++) {
+		const uint16_t* grid = this->atlases[i].gridAtlas;
+		for (size_t j = 0; j < pixels.size(); j++) {
+			pixels[j] = grid[j] & 0xFF;
+		}
+		std::string path = prefix + std::to_string(i) + ".bmp";
+		writeBMP(path.c_str(), kGridAtlasSize, kGridAtlasSize, kAtlasChannels, &pixels[0]);
 	}
-
-	return &this->atlases[this->atlases.size() - 1];
 }
 
-#pragma pack(push, 1)
-struct bitmapdata {
-	char magic[2];
-	uint32_t size;
-	uint16_t res1;
-	uint16_t res2;
-	uint32_t offset;
-
-	uint32_t biSize;
-	uint32_t width;
-	uint32_t height;
-	uint16_t planes;
-	uint16_t bitCount;
-	uint32_t compression;
-	uint32_t imageSizeBytes;
-	uint32_t xpelsPerMeter;
-	uint32_t ypelsPerMeter;
-	uint32_t clrUsed;
-	uint32_t clrImportant;
-};
-#pragma pack(pop)
-
-void writeBMP(const char* path, uint32_t width, uint32_t height, uint16_t channels, uint8_t* data) {
-	FILE* f = fopen(path, "wb");
+// Reserves `size` bytes of the staging buffer and maps them for writing. The
+// staging buffer is bound to GL_PIXEL_UNPACK_BUFFER, and must be unmapped
+// before the range is used as the source of an upload. Space is handed out
+// as a ring; when it wraps around, the buffer is orphaned so the driver can
+// hand back fresh storage instead of waiting on uploads still reading the old
+// contents. Returns nullptr (with nothing bound) if the data doesn't fit, in
+// which case it should be uploaded straight from client memory.
+uint8_t* GLFontManager::MapStagingRange(size_t size, size_t* offset) {
+	if (size > kStagingBufSize) {
+		return nullptr;
+	}
 
-	bitmapdata head;
-	head.magic[0] = 'B';
-	head.magic[1] = 'M';
-	head.size = sizeof(bitmapdata) + width * height * channels;
-	head.res1 = 0;
-	head.res2 = 0;
-	head.offset = sizeof(bitmapdata);
-	head.biSize = 40;
-	head.width = width;
-	head.height = height;
-	head.planes = 1;
-	head.bitCount = 8 * channels;
-	head.compression = 0;
-	head.imageSizeBytes = width * height * channels;
-	head.xpelsPerMeter = 0;
-	head.ypelsPerMeter = 0;
-	head.clrUsed = 0;
-	head.clrImportant = 0;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->stagingBufId);
+	if (this->stagingBufOffset + size > kStagingBufSize) {
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, kStagingBufSize, NULL, GL_STREAM_DRAW);
+		this->stagingBufOffset = 0;
+	}
 
-	fwrite(&head, sizeof(head), 1, f);
-	fwrite(data, head.imageSizeBytes, 1, f);
-	fclose(f);
-}
+	*offset = this->stagingBufOffset;
+	this->stagingBufOffset += (size + 3) & ~(size_t)3; // Keep ranges 4-aligned
 
-// A bezier is written as 6 16-bit integers (12 bytes). Increments buffer by
-// the number of bytes written (always 12). Coords are scaled from
-// [0,glyphSize] to [0,UINT16_MAX].
-void write_bezier_to_buffer(uint16_t** pbuffer, Bezier2* bezier, Vec2* glyphSize) {
-	uint16_t* buffer = *pbuffer;
-	buffer[0] = bezier->e0.x * UINT16_MAX / glyphSize->w;
-	buffer[1] = bezier->e0.y * UINT16_MAX / glyphSize->h;
-	buffer[2] = bezier->c.x * UINT16_MAX / glyphSize->w;
-	buffer[3] = bezier->c.y * UINT16_MAX / glyphSize->h;
-	buffer[4] = bezier->e1.x * UINT16_MAX / glyphSize->w;
-	buffer[5] = bezier->e1.y * UINT16_MAX / glyphSize->h;
-	*pbuffer += 6;
+	void* ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, *offset, size,
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	if (!ptr) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	return (uint8_t*)ptr;
 }
 
-void write_glyph_data_to_buffer(
-	uint8_t* buffer8,
-	std::vector<Bezier2>& beziers,
-	Vec2& glyphSize,
-	uint16_t gridX,
-	uint16_t gridY,
-	uint16_t gridWidth,
-	uint16_t gridHeight) {
+void GLFontManager::UploadAtlases() {
+	std::chrono::steady_clock::time_point start;
+	if (this->cpuTimings) {
+		start = std::chrono::steady_clock::now();
+	}
+	size_t uploadedBytes = 0;
 
-	uint16_t* buffer = (uint16_t*)buffer8;
-	buffer[0] = gridX;
-	buffer[1] = gridY;
-	buffer[2] = gridWidth;
-	buffer[3] = gridHeight;
-	buffer += 4;
+	this->CommitPreparedGlyphs();
 
-	for (size_t i = 0; i < beziers.size(); i++) {
-		write_bezier_to_buffer(&buffer, &beziers[i], &glyphSize);
+	this->residencyClock++;
+	if (this->memoryBudget > 0 && this->MemoryUsed() > this->compactAbove) {
+		this->Compact();
 	}
-}
 
-GLFontManager::Glyph* GLFontManager::GetGlyphForCodepoint(FT_Face face, uint32_t point) {
-	auto faceIt = this->glyphs.find(face);
-	if (faceIt != this->glyphs.end()) {
-		auto glyphIt = faceIt->second.find(point);
-		if (glyphIt != faceIt->second.end()) {
-			return &glyphIt->second;
+	// New atlas groups need a bigger texture. Reallocate it with room to
+	// spare, since that means copying every group again.
+	if (this->atlases.size() > this->gridAtlasLayers) {
+		this->gridAtlasLayers = std::min(
+			std::max(this->gridAtlasLayers * 2, this->atlases.size()),
+			(size_t)this->maxGridAtlasLayers);
+
+		glBindTexture(GL_TEXTURE_2D_ARRAY, this->gridAtlasId);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA16UI,
+			kGridAtlasSize, kGridAtlasSize, this->gridAtlasLayers,
+			0, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, NULL);
+		this->stats.reallocations++;
+
+		// The packer fills the atlas from the bottom up, so only the rows
+		// up to its skyline have anything in them
+		for (size_t i = 0; i < this->atlases.size(); i++) {
+			uint16_t usedHeight = this->atlases[i].gridPacker.UsedHeight();
+			if (usedHeight > 0) {
+				mark_grid_dirty(&this->atlases[i], 0, 0, kGridAtlasSize, usedHeight);
+			}
 		}
 	}
 
-	AtlasGroup* atlas = this->GetOpenAtlasGroup();
-
-	// Load the glyph. FT_LOAD_NO_SCALE implies that FreeType should not
-	// render the glyph to a bitmap, and ensures that metrics and outline
-	// points are represented in font units instead of em.
-	FT_UInt glyphIndex = FT_Get_Char_Index(face, point);
-	if (FT_Load_Glyph(face, glyphIndex, FT_LOAD_NO_SCALE)) {
-		return nullptr;
+	// Same for the glyph data buffer once it runs out of room
+	size_t glyphDataSize = this->glyphData.size() / kAtlasChannels;
+	if (glyphDataSize > this->glyphDataCapacity) {
+		this->glyphDataCapacity = std::min(
+			std::max(this->glyphDataCapacity * 2, glyphDataSize),
+			this->maxGlyphDataSize);
+
+		glBindBuffer(GL_TEXTURE_BUFFER, this->glyphDataBufId);
+		glBufferData(GL_TEXTURE_BUFFER, this->glyphDataCapacity * kAtlasChannels,
+			NULL, GL_STREAM_DRAW);
+		this->stats.reallocations++;
+		mark_glyph_data_dirty(this, 0, glyphDataSize);
 	}
 
-	FT_Pos glyphWidth = face->glyph->metrics.width;
-	FT_Pos glyphHeight = face->glyph->metrics.height;
-	uint8_t gridWidth = kGridMaxSize;
-	uint8_t gridHeight = kGridMaxSize;
-
-	std::vector<Bezier2> curves = GetBeziersForOutline(&face->glyph->outline);
-	VGrid grid(curves, Vec2(glyphWidth, glyphHeight), gridWidth, gridHeight);
-
-	// Although the data is represented as a 32bit texture, it's actually
-	// two 16bit ints per pixel, each with an x and y coordinate for
-	// the bezier. Every six 16bit ints (3 pixels) is a full bezier
-	// Plus two pixels for grid position information
-	uint16_t bezierPixelLength = 2 + curves.size() * 3;
-
-	bool tooManyCurves = uint32_t(bezierPixelLength) > sq(uint32_t(kBezierAtlasSize));
-
-	if (curves.size() == 0 || tooManyCurves) {
-		if (tooManyCurves) {
-			std::cerr << "WARN: Glyph " << point << " has too many curves\n";
+	if (this->dirtyGlyphDataMin < this->dirtyGlyphDataMax) {
+		size_t start = this->dirtyGlyphDataMin * kAtlasChannels;
+		size_t size = (this->dirtyGlyphDataMax - this->dirtyGlyphDataMin) * kAtlasChannels;
+
+		size_t stagingOffset;
+		uint8_t* staging = this->MapStagingRange(size, &stagingOffset);
+		glBindBuffer(GL_TEXTURE_BUFFER, this->glyphDataBufId);
+		if (staging) {
+			memcpy(staging, &this->glyphData[start], size);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glCopyBufferSubData(GL_PIXEL_UNPACK_BUFFER, GL_TEXTURE_BUFFER,
+				stagingOffset, start, size);
+		}
+		else {
+			glBufferSubData(GL_TEXTURE_BUFFER, start, size, &this->glyphData[start]);
 		}
+		uploadedBytes += size;
 
-		GLFontManager::Glyph glyph{};
-		glyph.bezierAtlasPos[1] = -1;
-		glyph.size[0] = glyphWidth;
-		glyph.size[1] = glyphHeight;
-		glyph.offset[0] = face->glyph->metrics.horiBearingX;
-		glyph.offset[1] = face->glyph->metrics.horiBearingY - glyphHeight;
-		glyph.advance = face->glyph->metrics.horiAdvance;
-		this->glyphs[face][point] = glyph;
-		return &this->glyphs[face][point];
+		this->dirtyGlyphDataMin = this->dirtyGlyphDataMax = 0;
 	}
 
-	// Find an open position in the bezier atlas
-	if (atlas->glyphDataBufOffset + bezierPixelLength > sq(kBezierAtlasSize)) {
-		atlas->full = true;
-		atlas->uploaded = false;
-		atlas = this->GetOpenAtlasGroup();
-	}
+	for (size_t i = 0; i < this->atlases.size(); i++) {
+		AtlasGroup& atlas = this->atlases[i];
+
+		if (atlas.dirtyGridMin[0] < atlas.dirtyGridMax[0]) {
+			uint16_t x = atlas.dirtyGridMin[0];
+			uint16_t y = atlas.dirtyGridMin[1];
+			uint16_t w = atlas.dirtyGridMax[0] - x;
+			uint16_t h = atlas.dirtyGridMax[1] - y;
+			size_t rowBytes = w * kGridTexelBytes;
+
+			// The staged copy is tightly packed, so the rows of the dirty
+			// rectangle are copied out one at a time.
+			size_t stagingOffset;
+			uint8_t* staging = this->MapStagingRange(rowBytes * h, &stagingOffset);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, this->gridAtlasId);
+			if (staging) {
+				for (uint16_t row = 0; row < h; row++) {
+					memcpy(staging + row * rowBytes,
+						atlas.gridAtlas + ((y + row) * kGridAtlasSize + x) * kAtlasChannels,
+						rowBytes);
+				}
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x, y, i, w, h, 1,
+					GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, (void*)stagingOffset);
+			}
+			else {
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, kGridAtlasSize);
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x, y, i, w, h, 1,
+					GL_RGBA_INTEGER, GL_UNSIGNED_SHORT,
+					atlas.gridAtlas + (y * kGridAtlasSize + x) * kAtlasChannels);
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			}
+			uploadedBytes += rowBytes * h;
 
-	// Find an open position in the grid atlas
-	if (atlas->nextGridPos[0] + kGridMaxSize > kGridAtlasSize) {
-		atlas->nextGridPos[1] += kGridMaxSize;
-		atlas->nextGridPos[0] = 0;
-		if (atlas->nextGridPos[1] >= kGridAtlasSize) {
-			atlas->full = true;
-			atlas->uploaded = false;
-			atlas = this->GetOpenAtlasGroup(); // Should only ever happen once per glyph
+			atlas.dirtyGridMin[0] = atlas.dirtyGridMax[0] = 0;
+			atlas.dirtyGridMin[1] = atlas.dirtyGridMax[1] = 0;
 		}
 	}
 
-	uint8_t* bezierData = atlas->glyphDataBuf + (atlas->glyphDataBufOffset * kAtlasChannels);
-
-	Vec2 glyphSize(glyphWidth, glyphHeight);
-	write_glyph_data_to_buffer(
-		bezierData,
-		curves,
-		glyphSize,
-		atlas->nextGridPos[0], // pos of grid within atlas?
-		atlas->nextGridPos[1],
-		kGridMaxSize, //size of vGrid
-		kGridMaxSize);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-	// TODO: Integrate with AtlasGroup / replace AtlasGroup
-	VGridAtlas gridAtlas{};
-	gridAtlas.data = atlas->gridAtlas;
-	gridAtlas.width = kGridAtlasSize;
-	gridAtlas.height = kGridAtlasSize;
-	gridAtlas.depth = kAtlasChannels;
-	gridAtlas.WriteVGridAt(grid, atlas->nextGridPos[0], atlas->nextGridPos[1]);
+	if (uploadedBytes > 0) {
+		this->stats.uploads++;
+		this->stats.uploadedBytes += uploadedBytes;
+		if (this->cpuTimings) {
+			this->stats.uploadTime.Add(us_since(start));
+		}
+	}
+}
 
-	GLFontManager::Glyph glyph{};
-	glyph.bezierAtlasPos[0] = atlas->glyphDataBufOffset;
-	glyph.bezierAtlasPos[1] = this->atlases.size() - 1;
-	glyph.size[0] = glyphWidth;
-	glyph.size[1] = glyphHeight;
-	glyph.offset[0] = face->glyph->metrics.horiBearingX;
-	glyph.offset[1] = face->glyph->metrics.horiBearingY - glyphHeight;
-	glyph.advance = face->glyph->metrics.horiAdvance;
-	this->glyphs[face][point] = glyph;
+void GLFontManager::ResetRenderState() {
+	this->renderState = RenderState{};
+}
 
-	atlas->glyphDataBufOffset += bezierPixelLength;
-	atlas->nextGridPos[0] += kGridMaxSize;
-	atlas->uploaded = false;
+bool GLFontManager::UseGlyphShader(Quality quality) {
+	GlyphShader* shader = &this->glyphShaders[(size_t)quality];
+	while (true) {
+		if (!shader->ready && !shader->failed) {
+			if (this->FinishGlyphShader(*shader)) {
+				this->renderState.shader = shader; // Left in use
+			}
+			else {
+				std::cerr << "WARN: Glyph shader of quality " << (size_t)quality << " failed to build\n";
+				shader->failed = true;
+			}
+		}
+		if (!shader->failed) {
+			break;
+		}
+		// Auto falls back on High, and the others on the next lower one
+		if (quality == Quality::Low) {
+			return false;
+		}
+		quality = (quality == Quality::Auto) ? Quality::High : (Quality)((size_t)quality - 1);
+		shader = &this->glyphShaders[(size_t)quality];
+	}
 
-	// writeBMP("bezierAtlas.bmp", kBezierAtlasSize, kBezierAtlasSize, 4, atlas->glyphDataBuf);
-	// writeBMP("gridAtlas.bmp", kGridAtlasSize, kGridAtlasSize, 4, atlas->gridAtlas);
+	if (this->renderState.shader != shader) {
+		glUseProgram(shader->program);
+		this->renderState.shader = shader;
+	}
+	return true;
+}
 
-	return &this->glyphs[face][point];
+void GLFontManager::SetShaderTransform(glm::mat4 transform) {
+	GlyphShader* shader = this->renderState.shader;
+	if (shader->hasTransform && shader->transform == transform) {
+		return;
+	}
+	glUniformMatrix4fv(shader->uTransform, 1, GL_FALSE, glm::value_ptr(transform));
+	shader->hasTransform = true;
+	shader->transform = transform;
 }
 
-void GLFontManager::LoadASCII(FT_Face face) {
-	if (!face) {
+void GLFontManager::UseAtlasTextures() {
+	if (this->renderState.atlasTextures) {
 		return;
 	}
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, this->gridAtlasId);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_BUFFER, this->glyphDataBufTexId);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_BUFFER, this->glyphHeaderBufTexId);
+	this->renderState.atlasTextures = true;
+}
 
-	this->GetGlyphForCodepoint(face, 0);
+void GLFontManager::UseBlending() {
+	if (!this->renderState.blend) {
+		glEnable(GL_BLEND);
+		this->renderState.blend = true;
+	}
+}
 
-	for (int i = 32; i < 128; i++) {
-		this->GetGlyphForCodepoint(face, i);
+void GLFontManager::BindVertexArray(GLuint vertexArrayId) {
+	if (this->renderState.vertexArray != vertexArrayId) {
+		glBindVertexArray(vertexArrayId);
+		this->renderState.vertexArray = vertexArrayId;
 	}
 }
 
-void GLFontManager::UploadAtlases() {
-	for (size_t i = 0; i < this->atlases.size(); i++) {
-		if (this->atlases[i].uploaded) {
-			continue;
-		}
+// Binds a buffer texture for the current glyph shader, and sets the uniform
+// telling it whether there is one
+static void use_shader_buffer(GLuint* boundTex, GLint* useBuffer, GLuint bufTexId, GLenum unit, GLuint uUseBuffer) {
+	if (bufTexId && *boundTex != bufTexId) {
+		glActiveTexture(unit);
+		glBindTexture(GL_TEXTURE_BUFFER, bufTexId);
+		*boundTex = bufTexId;
+	}
+	GLint use = bufTexId != 0;
+	if (*useBuffer != use) {
+		glUniform1i(uUseBuffer, use);
+		*useBuffer = use;
+	}
+}
 
-		glBindBuffer(GL_TEXTURE_BUFFER, this->atlases[i].glyphDataBufId);
-		glBufferData(GL_TEXTURE_BUFFER, sq(kBezierAtlasSize) * kAtlasChannels,
-			this->atlases[i].glyphDataBuf, GL_STREAM_DRAW);
+void GLFontManager::UseTransformBuffer(GLuint transformBufTexId) {
+	GlyphShader* shader = this->renderState.shader;
+	use_shader_buffer(&this->renderState.transformBufTex, &shader->useTransforms,
+		transformBufTexId, GL_TEXTURE2, shader->uUseTransforms);
+}
 
-		glBindTexture(GL_TEXTURE_2D, this->atlases[i].gridAtlasId);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, kGridAtlasSize, kGridAtlasSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, this->atlases[i].gridAtlas);
+void GLFontManager::UseLineOffsetBuffer(GLuint lineOffsetBufTexId) {
+	GlyphShader* shader = this->renderState.shader;
+	use_shader_buffer(&this->renderState.lineOffsetBufTex, &shader->useLineOffsets,
+		lineOffsetBufTexId, GL_TEXTURE3, shader->uUseLineOffsets);
+}
 
-		atlases[i].uploaded = true;
+void GLFontManager::UseInstanceSize(bool useInstanceSize) {
+	GlyphShader* shader = this->renderState.shader;
+	if (shader->useInstanceSize != (GLint)useInstanceSize) {
+		glUniform1i(shader->uUseInstanceSize, useInstanceSize);
+		shader->useInstanceSize = useInstanceSize;
 	}
 }
 
-void GLFontManager::UseGlyphShader() {
-	glUseProgram(this->glyphShader);
+void GLFontManager::UsePaletteBuffer(GLuint paletteBufTexId, GLuint paletteBaseBufTexId) {
+	if (this->renderState.paletteBufTex != paletteBufTexId) {
+		glActiveTexture(GL_TEXTURE6);
+		glBindTexture(GL_TEXTURE_BUFFER, paletteBufTexId);
+		this->renderState.paletteBufTex = paletteBufTexId;
+	}
+	// Only read with a transform buffer, so one left bound does no harm
+	if (paletteBaseBufTexId && this->renderState.paletteBaseBufTex != paletteBaseBufTexId) {
+		glActiveTexture(GL_TEXTURE7);
+		glBindTexture(GL_TEXTURE_BUFFER, paletteBaseBufTexId);
+		this->renderState.paletteBaseBufTex = paletteBaseBufTexId;
+	}
 }
 
-void GLFontManager::SetShaderTransform(glm::mat4 transform) {
-	glUniformMatrix4fv(this->uTransform, 1, GL_FALSE, glm::value_ptr(transform));
+void GLFontManager::SetShaderCacheDir(std::string dir) {
+	GLFontManager::shaderCacheDir = dir;
 }
 
-void GLFontManager::UseAtlasTextures(uint16_t atlasIndex) {
-	if (atlasIndex >= this->atlases.size()) {
-		return;
+// 64 bit FNV-1a, continuing from `hash`
+static uint64_t hash_string(const char* str, uint64_t hash = 14695981039346656037ull) {
+	for (; *str; str++) {
+		hash = (hash ^ (uint8_t)*str) * 1099511628211ull;
 	}
+	return hash;
+}
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, this->atlases[atlasIndex].gridAtlasId);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_BUFFER, this->atlases[atlasIndex].glyphDataBufTexId);
+// Links `programId` from a cached binary: the binary format as a GLenum,
+// followed by the binary. Returns false if there is none, or the driver
+// doesn't take it anymore.
+static bool load_program_binary(
+	GLuint programId,
+	const std::string& path,
+	const std::vector<GLint>& binaryFormats) {
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+	std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (binary.size() <= sizeof(GLenum)) {
+		return false;
+	}
 
+	GLenum format;
+	memcpy(&format, &binary[0], sizeof(GLenum));
+	if (std::find(binaryFormats.begin(), binaryFormats.end(), (GLint)format) == binaryFormats.end()) {
+		return false;
+	}
+	glProgramBinary(programId, format, &binary[sizeof(GLenum)], binary.size() - sizeof(GLenum));
+	GLint linked = GL_FALSE;
+	glGetProgramiv(programId, GL_LINK_STATUS, &linked);
+	return linked;
 }
 
-static GLuint loadShaderProgram(const char* vertexPath, const char* fragPath) {
-	//load vertex and fragment shaders from files
-	std::ifstream vertexShaderFile(vertexPath, std::ios::in | std::ios::ate);
-	if (!vertexShaderFile.is_open()) {
-		std::cerr << "Failed to Open Vertex Shader File" << std::endl;
-		return -1;
+static void save_program_binary(GLuint programId, const std::string& path) {
+	GLint length = 0;
+	glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) {
+		return;
 	}
-	std::streampos size = vertexShaderFile.tellg();
-	char* const vsCodeC = new char[size];
-	vertexShaderFile.seekg(0, std::ios::beg);
-	vertexShaderFile.read(vsCodeC, size);
-	vertexShaderFile.close();
-
-	std::ifstream fragmentShaderFile(fragPath, std::ios::in | std::ios::ate);
-	if (!fragmentShaderFile.is_open()) {
-		std::cerr << "Failed to Open Fragment Shader File" << std::endl;
-		return -1;
+	std::vector<char> binary(sizeof(GLenum) + length);
+	GLenum format;
+	glGetProgramBinary(programId, length, NULL, &format, &binary[sizeof(GLenum)]);
+	memcpy(&binary[0], &format, sizeof(GLenum));
+
+	std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		std::cerr << "WARN: Can't write shader cache file " << path << "\n";
+		return;
 	}
-	size = fragmentShaderFile.tellg();
-	char* const fsCodeC = new char[size];
-	fragmentShaderFile.seekg(0, std::ios::beg);
-	fragmentShaderFile.read(fsCodeC, size);
-	fragmentShaderFile.close();
+	file.write(&binary[0], binary.size());
+}
+
+static GLuint start_compiling_shader(GLenum type, const char* source) {
+	GLuint shaderId = glCreateShader(type);
+	glShaderSource(shaderId, 1, &source, NULL);
+	glCompileShader(shaderId);
+	return shaderId;
+}
 
-	// Compile vertex shader
-	GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-	glShaderSource(vertexShaderId, 1, &vsCodeC, NULL);
-	glCompileShader(vertexShaderId);
+// Prints the info log of a shader and returns whether it compiled
+static bool check_shader(GLuint shaderId, const char* name) {
+	GLint result = GL_FALSE;
+	int infoLogLength = 0;
+	glGetShaderiv(shaderId, GL_COMPILE_STATUS, &result);
+	glGetShaderiv(shaderId, GL_INFO_LOG_LENGTH, &infoLogLength);
+	if (infoLogLength > 1) {
+		std::vector<char> infoLog(infoLogLength + 1);
+		glGetShaderInfoLog(shaderId, infoLogLength, NULL, &infoLog[0]);
+		std::cerr << "[" << name << "] " << &infoLog[0] << "\n";
+	}
+	return result;
+}
 
+// Prints the info log of a program and returns whether it linked
+static bool check_program(GLuint programId, const char* name) {
 	GLint result = GL_FALSE;
 	int infoLogLength = 0;
-	glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &result);
-	glGetShaderiv(vertexShaderId, GL_INFO_LOG_LENGTH, &infoLogLength);
+	glGetProgramiv(programId, GL_LINK_STATUS, &result);
+	glGetProgramiv(programId, GL_INFO_LOG_LENGTH, &infoLogLength);
 	if (infoLogLength > 1) {
 		std::vector<char> infoLog(infoLogLength + 1);
-		glGetShaderInfoLog(vertexShaderId, infoLogLength, NULL, &infoLog[0]);
-		std::cerr << "[Vertex] " << &infoLog[0] << "\n";
+		glGetProgramInfoLog(programId, infoLogLength, NULL, &infoLog[0]);
+		std::cerr << "[" << name << "] " << &infoLog[0] << "\n";
 	}
-	if (!result) {
-		return 0;
+	return result;
+}
+
+// fragDefines is inserted into the fragment shader right after its #version
+// line, to pick a variant of it
+void GLFontManager::StartGlyphShader(GlyphShader& shader, const char* fragDefines) {
+	std::string fsSource = kGlyphFragmentShaderSource;
+	size_t versionEnd = fsSource.find('\n', fsSource.find("#version"));
+	if (versionEnd != std::string::npos) {
+		fsSource.insert(versionEnd + 1, fragDefines);
 	}
 
-	// Compile fragment shader
-	GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(fragmentShaderId, 1, &fsCodeC, NULL);
-	glCompileShader(fragmentShaderId);
+	shader = GlyphShader{};
+	shader.program = glCreateProgram();
 
-	result = GL_FALSE, infoLogLength = 0;
-	glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &result);
-	glGetShaderiv(fragmentShaderId, GL_INFO_LOG_LENGTH, &infoLogLength);
-	if (infoLogLength > 1) {
-		std::vector<char> infoLog(infoLogLength);
-		glGetShaderInfoLog(fragmentShaderId, infoLogLength, NULL, &infoLog[0]);
-		std::cerr << "[Fragment] " << &infoLog[0] << "\n";
+	GLint numBinaryFormats = 0;
+	if (GLEW_ARB_get_program_binary) {
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numBinaryFormats);
 	}
-	if (!result) {
-		return 0;
+	if (!GLFontManager::shaderCacheDir.empty() && numBinaryFormats > 0) {
+		std::vector<GLint> binaryFormats(numBinaryFormats);
+		glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, &binaryFormats[0]);
+
+		// A binary only works with the driver that made it
+		uint64_t hash = hash_string((const char*)glGetString(GL_VENDOR));
+		hash = hash_string((const char*)glGetString(GL_RENDERER), hash);
+		hash = hash_string((const char*)glGetString(GL_VERSION), hash);
+		hash = hash_string(kGlyphVertexShaderSource, hash);
+		hash = hash_string(fsSource.c_str(), hash);
+
+		char name[32];
+		snprintf(name, sizeof(name), "glyph_%016llx.bin", (unsigned long long)hash);
+		shader.cachePath = GLFontManager::shaderCacheDir + "/" + name;
+		if (load_program_binary(shader.program, shader.cachePath, binaryFormats)) {
+			shader.fromCache = true;
+			return;
+		}
+		glProgramParameteri(shader.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	}
 
-	// Link the program
-	GLuint programId = glCreateProgram();
-	glAttachShader(programId, vertexShaderId);
-	glAttachShader(programId, fragmentShaderId);
-	glLinkProgram(programId);
+	// Nothing here waits on the driver, see FinishGlyphShader()
+	shader.vertexShader = start_compiling_shader(GL_VERTEX_SHADER, kGlyphVertexShaderSource);
+	shader.fragmentShader = start_compiling_shader(GL_FRAGMENT_SHADER, fsSource.c_str());
+	glAttachShader(shader.program, shader.vertexShader);
+	glAttachShader(shader.program, shader.fragmentShader);
+	glLinkProgram(shader.program);
+}
 
-	result = GL_FALSE, infoLogLength = 0;
-	glGetProgramiv(programId, GL_LINK_STATUS, &result);
-	glGetProgramiv(programId, GL_INFO_LOG_LENGTH, &infoLogLength);
-	if (infoLogLength > 1) {
-		std::vector<char> infoLog(infoLogLength + 1);
-		glGetProgramInfoLog(programId, infoLogLength, NULL, &infoLog[0]);
-		std::cerr << "[Shader Linker] " << &infoLog[0] << "\n";
+// Waits for the shader to be linked and sets it up. Leaves it in use.
+// Returns false, leaving it unready, if it didn't compile or link.
+bool GLFontManager::FinishGlyphShader(GlyphShader& shader) {
+	bool compiled = true;
+	if (shader.vertexShader) {
+		compiled = check_shader(shader.vertexShader, "Vertex") && compiled;
+		compiled = check_shader(shader.fragmentShader, "Fragment") && compiled;
+		glDetachShader(shader.program, shader.vertexShader);
+		glDetachShader(shader.program, shader.fragmentShader);
+		glDeleteShader(shader.vertexShader);
+		glDeleteShader(shader.fragmentShader);
+		shader.vertexShader = shader.fragmentShader = 0;
 	}
-	if (!result) {
-		return 0;
+
+	bool linked = check_program(shader.program, "Shader Linker");
+	if (!compiled || !linked) {
+		return false;
 	}
+	if (!shader.fromCache && !shader.cachePath.empty()) {
+		save_program_binary(shader.program, shader.cachePath);
+	}
+
+	shader.uGridAtlas = glGetUniformLocation(shader.program, "uGridAtlas");
+	shader.uGlyphData = glGetUniformLocation(shader.program, "uGlyphData");
+	shader.uGlyphHeaders = glGetUniformLocation(shader.program, "uGlyphHeaders");
+	shader.uTransform = glGetUniformLocation(shader.program, "uTransform");
+	shader.uTransforms = glGetUniformLocation(shader.program, "uTransforms");
+	shader.uUseTransforms = glGetUniformLocation(shader.program, "uUseTransforms");
+	shader.uLineOffsets = glGetUniformLocation(shader.program, "uLineOffsets");
+	shader.uUseLineOffsets = glGetUniformLocation(shader.program, "uUseLineOffsets");
+	shader.uPalette = glGetUniformLocation(shader.program, "uPalette");
+	shader.uPaletteBases = glGetUniformLocation(shader.program, "uPaletteBases");
+	shader.uUseInstanceSize = glGetUniformLocation(shader.program, "uUseInstanceSize");
+
+	glUseProgram(shader.program);
+	glUniform1i(shader.uGridAtlas, 0);
+	glUniform1i(shader.uGlyphData, 1);
+	glUniform1i(shader.uTransforms, 2);
+	glUniform1i(shader.uUseTransforms, 0);
+	glUniform1i(shader.uLineOffsets, 3);
+	glUniform1i(shader.uUseLineOffsets, 0);
+	glUniform1i(shader.uGlyphHeaders, 4);
+	glUniform1i(shader.uPalette, 6);
+	glUniform1i(shader.uPaletteBases, 7);
+	glUniform1i(shader.uUseInstanceSize, 0);
+	shader.useTransforms = 0;
+	shader.useLineOffsets = 0;
+	shader.useInstanceSize = 0;
+
+	glm::mat4 iden = glm::mat4(1.0);
+	glUniformMatrix4fv(shader.uTransform, 1, GL_FALSE, glm::value_ptr(iden));
+	shader.hasTransform = true;
+	shader.transform = iden;
+	shader.ready = true;
+	return true;
+}
 
-	glDetachShader(programId, vertexShaderId);
-	glDetachShader(programId, fragmentShaderId);
+bool GLFontManager::DrawTexture(GLuint texture, glm::mat4 transform, glm::vec4 rect) {
+	if (this->textureProgramFailed) {
+		return false;
+	}
+	if (!this->textureProgram) {
+		GLuint vertexShader = start_compiling_shader(GL_VERTEX_SHADER, kTextureVertexShaderSource);
+		GLuint fragmentShader = start_compiling_shader(GL_FRAGMENT_SHADER, kTextureFragmentShaderSource);
+		bool compiled = check_shader(vertexShader, "Texture Vertex");
+		compiled = check_shader(fragmentShader, "Texture Fragment") && compiled;
+		this->textureProgram = glCreateProgram();
+		glAttachShader(this->textureProgram, vertexShader);
+		glAttachShader(this->textureProgram, fragmentShader);
+		glLinkProgram(this->textureProgram);
+		glDetachShader(this->textureProgram, vertexShader);
+		glDetachShader(this->textureProgram, fragmentShader);
+		glDeleteShader(vertexShader);
+		glDeleteShader(fragmentShader);
+		if (!check_program(this->textureProgram, "Texture Linker") || !compiled) {
+			std::cerr << "WARN: Texture shader failed to build, coverage caches are drawn as text\n";
+			this->textureProgramFailed = true;
+			return false;
+		}
 
-	glDeleteShader(vertexShaderId);
-	glDeleteShader(fragmentShaderId);
-	delete vsCodeC;
-	delete fsCodeC;
+		this->uTextureTransform = glGetUniformLocation(this->textureProgram, "uTransform");
+		this->uTextureRect = glGetUniformLocation(this->textureProgram, "uRect");
+		glUseProgram(this->textureProgram);
+		// Past the units the glyph shader uses, so they stay bound
+		glUniform1i(glGetUniformLocation(this->textureProgram, "uTexture"), 5);
+		glGenVertexArrays(1, &this->textureVertexArray);
+	}
 
-	return programId;
+	glUseProgram(this->textureProgram);
+	this->renderState.shader = nullptr;
+	glUniformMatrix4fv(this->uTextureTransform, 1, GL_FALSE, glm::value_ptr(transform));
+	glUniform4fv(this->uTextureRect, 1, glm::value_ptr(rect));
+	glActiveTexture(GL_TEXTURE5);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	this->BindVertexArray(this->textureVertexArray);
+	this->UseBlending();
+
+	GLint blend[4];
+	glGetIntegerv(GL_BLEND_SRC_RGB, &blend[0]);
+	glGetIntegerv(GL_BLEND_DST_RGB, &blend[1]);
+	glGetIntegerv(GL_BLEND_SRC_ALPHA, &blend[2]);
+	glGetIntegerv(GL_BLEND_DST_ALPHA, &blend[3]);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glDrawArrays(GL_TRIANGLES, 0, 6);
+	glBlendFuncSeparate(blend[0], blend[1], blend[2], blend[3]);
+	return true;
 }
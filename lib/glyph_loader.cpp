@@ -0,0 +1,279 @@
+#include "glyph_loader.hpp"
+#include "outline.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+
+// Smallest grid size tried for the long side of a glyph. Much coarser and
+// the grid stops doing much to cut down the beziers checked per pixel.
+static const int kGridMinSize = 4;
+
+// Builds the grid for out.curves, trying sizes from coarse to fine
+static void build_adaptive_grid(
+	PreparedGlyph &out,
+	uint8_t maxGridSize,
+	uint8_t maxCellBeziers) {
+	Vec2 glyphSize(out.metrics.width, out.metrics.height);
+	float longSide = std::max(glyphSize.w, glyphSize.h);
+
+	int longCells = std::min(kGridMinSize, (int)maxGridSize);
+	while (true) {
+		// Scale the short side down to keep the cells roughly square
+		int gridWidth = longCells, gridHeight = longCells;
+		if (glyphSize.w < glyphSize.h) {
+			gridWidth = std::max((int)std::ceil(longCells * glyphSize.w / longSide), 1);
+		}
+		else if (glyphSize.h < glyphSize.w) {
+			gridHeight = std::max((int)std::ceil(longCells * glyphSize.h / longSide), 1);
+		}
+
+		out.grid.Build(out.curves, glyphSize, gridWidth, gridHeight);
+
+		// A grid this fine that still overflows gets written out anyway,
+		// and VGridAtlas::WriteVGridAt() warns about it
+		if (longCells >= maxGridSize || out.grid.MaxCellSize() <= maxCellBeziers) {
+			return;
+		}
+		longCells = std::min(longCells + 2, (int)maxGridSize);
+	}
+}
+
+bool prepare_glyph(
+	FT_Face face,
+	uint32_t point,
+	uint8_t maxGridSize,
+	uint8_t maxCellBeziers,
+	PreparedGlyph &out) {
+	// Load the glyph. FT_LOAD_NO_SCALE implies that FreeType should not
+	// render the glyph to a bitmap, and ensures that metrics and outline
+	// points are represented in font units instead of em.
+	FT_UInt glyphIndex = FT_Get_Char_Index(face, point);
+	if (FT_Load_Glyph(face, glyphIndex, FT_LOAD_NO_SCALE)) {
+		return false;
+	}
+
+	out.metrics = face->glyph->metrics;
+	GetBeziersForOutline(&face->glyph->outline, out.curves);
+	if (out.curves.size() > 0) {
+		build_adaptive_grid(out, maxGridSize, maxCellBeziers);
+	}
+	return true;
+}
+
+// Points handed out at a time by prepare_glyphs(). Big enough that the
+// queues are hardly ever locked, small enough to even out the threads.
+static const size_t kPrepareChunk = 16;
+
+// One thread's share of prepare_glyphs(), as the first point of each chunk.
+// The owner takes from the front, and thieves from the back.
+struct PrepareQueue
+{
+	std::mutex mutex;
+	std::deque<size_t> chunks;
+};
+
+static bool pop_chunk(PrepareQueue &queue, bool steal, size_t &chunk) {
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.chunks.empty()) {
+		return false;
+	}
+	if (steal) {
+		chunk = queue.chunks.back();
+		queue.chunks.pop_back();
+	}
+	else {
+		chunk = queue.chunks.front();
+		queue.chunks.pop_front();
+	}
+	return true;
+}
+
+void prepare_glyphs(
+	std::shared_ptr<FontFile> file,
+	FT_Long faceIndex,
+	const std::vector<uint32_t> &points,
+	unsigned numThreads,
+	uint8_t maxGridSize,
+	uint8_t maxCellBeziers,
+	std::vector<PreparedGlyph> &out,
+	std::vector<uint8_t> &loaded) {
+	out.resize(points.size());
+	loaded.assign(points.size(), 0);
+
+	size_t numChunks = (points.size() + kPrepareChunk - 1) / kPrepareChunk;
+	numThreads = std::max(std::min(numThreads, (unsigned)numChunks), 1u);
+
+	// Contiguous shares, since neighboring codepoints tend to cost the same
+	std::vector<PrepareQueue> queues(numThreads);
+	for (size_t i = 0; i < numChunks; i++) {
+		queues[i * numThreads / numChunks].chunks.push_back(i * kPrepareChunk);
+	}
+
+	auto work = [&](unsigned self) {
+		FT_Library ft;
+		if (FT_Init_FreeType(&ft) != FT_Err_Ok) {
+			std::cerr << "Failed to load freetype\n";
+			return;
+		}
+		FT_Face face = nullptr;
+		if (file->OpenFace(ft, faceIndex, &face)) {
+			FT_Done_FreeType(ft);
+			return;
+		}
+
+		size_t chunk;
+		for (unsigned victim = 0; victim < numThreads; victim++) {
+			PrepareQueue &queue = queues[(self + victim) % numThreads];
+			while (pop_chunk(queue, victim != 0, chunk)) {
+				size_t end = std::min(chunk + kPrepareChunk, points.size());
+				for (size_t i = chunk; i < end; i++) {
+					loaded[i] = prepare_glyph(face, points[i], maxGridSize, maxCellBeziers, out[i]);
+				}
+			}
+		}
+
+		FT_Done_Face(face);
+		FT_Done_FreeType(ft);
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < numThreads; i++) {
+		threads.push_back(std::thread(work, i));
+	}
+	work(0);
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+}
+
+GlyphLoader::GlyphLoader(unsigned numThreads, uint8_t maxGridSize, uint8_t maxCellBeziers)
+	: releases(numThreads), stopping(false), maxGridSize(maxGridSize), maxCellBeziers(maxCellBeziers) {
+	for (unsigned i = 0; i < numThreads; i++) {
+		this->threads.push_back(std::thread(&GlyphLoader::WorkerMain, this, i));
+	}
+}
+
+GlyphLoader::~GlyphLoader() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->wake.notify_all();
+	for (size_t i = 0; i < this->threads.size(); i++) {
+		this->threads[i].join();
+	}
+}
+
+void GlyphLoader::Push(const Job &job) {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->jobs.push_back(job);
+	}
+	this->wake.notify_one();
+}
+
+void GlyphLoader::ReleaseFace(uint32_t faceId) {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		for (size_t i = 0; i < this->releases.size(); i++) {
+			this->releases[i].push_back(faceId);
+		}
+	}
+	this->wake.notify_all();
+}
+
+void GlyphLoader::TakeResults(std::vector<Result> &out) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	for (size_t i = 0; i < this->results.size(); i++) {
+		out.push_back(std::move(this->results[i]));
+	}
+	this->results.clear();
+}
+
+void GlyphLoader::WorkerMain(size_t worker) {
+	FT_Library ft;
+	if (FT_Init_FreeType(&ft) != FT_Err_Ok) {
+		std::cerr << "Failed to load freetype\n";
+		ft = nullptr;
+	}
+
+	// This thread's copy of each face, by face id, with the file it reads
+	// from. Null if it won't open.
+	typedef std::map<uint32_t, std::pair<FT_Face, std::shared_ptr<FontFile>>> FaceMap;
+	FaceMap faces;
+	auto closeFace = [&faces](FaceMap::iterator it) {
+		if (it->second.first) {
+			FT_Done_Face(it->second.first);
+		}
+		faces.erase(it);
+	};
+
+	std::vector<uint32_t> released;
+	while (true) {
+		Job job;
+		bool hasJob = false;
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->wake.wait(lock, [this, worker] {
+				return this->stopping || !this->jobs.empty() || !this->releases[worker].empty();
+			});
+			if (this->stopping) {
+				break;
+			}
+			released.swap(this->releases[worker]);
+			if (!this->jobs.empty()) {
+				job = this->jobs.front();
+				this->jobs.pop_front();
+				hasJob = true;
+			}
+		}
+
+		for (size_t i = 0; i < released.size(); i++) {
+			auto it = faces.find(released[i]);
+			if (it != faces.end()) {
+				closeFace(it);
+			}
+		}
+		released.clear();
+		if (!hasJob) {
+			continue;
+		}
+
+		Result result;
+		result.faceId = job.faceId;
+		result.point = job.point;
+		result.loaded = false;
+
+		// Face ids are reused when a closed face is opened again, maybe
+		// over another mapping of its file
+		auto faceIt = faces.find(job.faceId);
+		if (faceIt != faces.end() && faceIt->second.second != job.file) {
+			closeFace(faceIt);
+			faceIt = faces.end();
+		}
+		if (faceIt == faces.end()) {
+			FT_Face face = nullptr;
+			if (ft && job.file->OpenFace(ft, job.faceIndex, &face)) {
+				face = nullptr;
+			}
+			faceIt = faces.insert(std::make_pair(job.faceId, std::make_pair(face, job.file))).first;
+		}
+		if (faceIt->second.first) {
+			result.loaded = prepare_glyph(faceIt->second.first, job.point,
+				this->maxGridSize, this->maxCellBeziers, result.glyph);
+		}
+
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->results.push_back(std::move(result));
+	}
+
+	for (auto it = faces.begin(); it != faces.end(); it++) {
+		if (it->second.first) {
+			FT_Done_Face(it->second.first);
+		}
+	}
+	if (ft) {
+		FT_Done_FreeType(ft);
+	}
+}
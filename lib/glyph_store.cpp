@@ -0,0 +1,89 @@
+#include "glyph_store.hpp"
+
+StoredGlyph::StoredGlyph(const PreparedGlyph &glyph)
+	: metrics(glyph.metrics), curves(glyph.curves),
+	gridWidth(glyph.grid.width), gridHeight(glyph.grid.height) {
+}
+
+void StoredGlyph::Expand(PreparedGlyph &out) const {
+	out.metrics = this->metrics;
+	out.curves = this->curves;
+	if (out.curves.size() > 0) {
+		Vec2 glyphSize(this->metrics.width, this->metrics.height);
+		out.grid.Build(out.curves, glyphSize, this->gridWidth, this->gridHeight);
+	}
+}
+
+static uint64_t store_key(uint32_t fontId, uint32_t point) {
+	return ((uint64_t)fontId << 32) | point;
+}
+
+// Fibonacci hashing, since neighboring codepoints make for neighboring keys
+static size_t bucket_of(uint64_t key, size_t numBuckets) {
+	return (key * 0x9E3779B97F4A7C15ull) >> (64 - __builtin_ctzll(numBuckets));
+}
+
+GlyphStore::GlyphStore()
+	: buckets(new std::atomic<Node *>[kBuckets]), size(0) {
+	for (size_t i = 0; i < kBuckets; i++) {
+		this->buckets[i].store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+GlyphStore::~GlyphStore() {
+	for (size_t i = 0; i < kBuckets; i++) {
+		Node *node = this->buckets[i].load(std::memory_order_relaxed);
+		while (node) {
+			Node *next = node->next;
+			delete node;
+			node = next;
+		}
+	}
+}
+
+uint32_t GlyphStore::FontId(const std::string &path, FT_Long faceIndex) {
+	std::lock_guard<std::mutex> lock(this->fontsMutex);
+	for (size_t i = 0; i < this->fonts.size(); i++) {
+		if (this->fonts[i].first == path && this->fonts[i].second == faceIndex) {
+			return i + 1;
+		}
+	}
+	this->fonts.push_back(std::make_pair(path, faceIndex));
+	return this->fonts.size();
+}
+
+const StoredGlyph * GlyphStore::Find(uint32_t fontId, uint32_t point) const {
+	uint64_t key = store_key(fontId, point);
+	const std::atomic<Node *> &bucket = this->buckets[bucket_of(key, kBuckets)];
+	for (Node *node = bucket.load(std::memory_order_acquire); node; node = node->next) {
+		if (node->key == key) {
+			return &node->glyph;
+		}
+	}
+	return nullptr;
+}
+
+void GlyphStore::Insert(uint32_t fontId, uint32_t point, const PreparedGlyph &glyph) {
+	uint64_t key = store_key(fontId, point);
+	std::atomic<Node *> &bucket = this->buckets[bucket_of(key, kBuckets)];
+	Node *node = new Node{key, StoredGlyph(glyph), nullptr};
+
+	// Nodes already in the list never go away, so if someone else gets in
+	// first, only the ones they added need checking again
+	Node *head = bucket.load(std::memory_order_acquire);
+	Node *checkedUpTo = nullptr;
+	while (true) {
+		for (Node *n = head; n != checkedUpTo; n = n->next) {
+			if (n->key == key) {
+				delete node;
+				return;
+			}
+		}
+		checkedUpTo = head;
+		node->next = head;
+		if (bucket.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_acquire)) {
+			break;
+		}
+	}
+	this->size.fetch_add(1, std::memory_order_relaxed);
+}
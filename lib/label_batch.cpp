@@ -0,0 +1,347 @@
+#include <gllabel.hpp>
+#include <algorithm>
+#include <iostream>
+#include <stdint.h>
+
+// Value of firstDirtyEntry when the instance buffer matches the queue
+static const size_t kNoDirtyEntry = SIZE_MAX;
+
+GLLabelBatch::GLLabelBatch(std::shared_ptr<GLFontManager> manager)
+	: numQueued(0), firstDirtyEntry(kNoDirtyEntry), transformsDirty(false),
+	instanceBufferCapacity(0), firstDirtyPalette(kNoDirtyEntry), endDirtyPalette(0),
+	paletteBufCapacity(0), paletteBaseBufCapacity(0), overlaysDirty(false),
+	selectionBufferCapacity(0), caretBufferCapacity(0), quality(GLLabel::Quality::High),
+	seenAtlasGeneration(0) {
+	this->manager = manager ? manager : GLFontManager::GetFontManager();
+	this->entryInstances.push_back(0);
+
+	glGenBuffers(1, &this->instanceBuffer);
+	glGenBuffers(1, &this->selectionBuffer);
+	glGenBuffers(1, &this->caretBuffer);
+
+	glGenBuffers(1, &this->transformBuf);
+	glBindBuffer(GL_TEXTURE_BUFFER, this->transformBuf);
+	glGenTextures(1, &this->transformBufTex);
+	glBindTexture(GL_TEXTURE_BUFFER, this->transformBufTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, this->transformBuf);
+
+	glGenBuffers(1, &this->paletteBuf);
+	glBindBuffer(GL_TEXTURE_BUFFER, this->paletteBuf);
+	glGenTextures(1, &this->paletteBufTex);
+	glBindTexture(GL_TEXTURE_BUFFER, this->paletteBufTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8, this->paletteBuf);
+
+	glGenBuffers(1, &this->paletteBaseBuf);
+	glBindBuffer(GL_TEXTURE_BUFFER, this->paletteBaseBuf);
+	glGenTextures(1, &this->paletteBaseBufTex);
+	glBindTexture(GL_TEXTURE_BUFFER, this->paletteBaseBufTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, this->paletteBaseBuf);
+	this->manager->ResetRenderState();
+
+	// Same as GLLabel's, with a transform index instead of a line
+	auto setupVertexArray = [this](GLuint *vertexArray, GLuint buffer, size_t stride) {
+		glGenVertexArrays(1, vertexArray);
+		this->manager->BindVertexArray(*vertexArray);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(BatchInstance, pos));
+		glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, stride, (void*)offsetof(BatchInstance, glyphDataOffset));
+		glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, stride, (void*)offsetof(BatchInstance, transformAndColor));
+		GLuint attribs[] = {0, 1, 3, 5};
+		size_t numAttribs = (stride == sizeof(BatchOverlay)) ? 4 : 3;
+		if (numAttribs == 4) {
+			glVertexAttribPointer(5, 2, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(BatchOverlay, size));
+		}
+		for (size_t i = 0; i < numAttribs; i++) {
+			glEnableVertexAttribArray(attribs[i]);
+			glVertexAttribDivisor(attribs[i], 1);
+		}
+	};
+	setupVertexArray(&this->vertexArray, this->instanceBuffer, sizeof(BatchInstance));
+	setupVertexArray(&this->selectionVertexArray, this->selectionBuffer, sizeof(BatchOverlay));
+	setupVertexArray(&this->caretVertexArray, this->caretBuffer, sizeof(BatchOverlay));
+}
+
+GLLabelBatch::~GLLabelBatch() {
+	glDeleteBuffers(1, &this->instanceBuffer);
+	glDeleteBuffers(1, &this->selectionBuffer);
+	glDeleteBuffers(1, &this->caretBuffer);
+	GLuint vertexArrays[] = {this->vertexArray, this->selectionVertexArray, this->caretVertexArray};
+	glDeleteVertexArrays(3, vertexArrays);
+	glDeleteTextures(1, &this->transformBufTex);
+	glDeleteBuffers(1, &this->transformBuf);
+	glDeleteTextures(1, &this->paletteBufTex);
+	glDeleteBuffers(1, &this->paletteBuf);
+	glDeleteTextures(1, &this->paletteBaseBufTex);
+	glDeleteBuffers(1, &this->paletteBaseBuf);
+	this->manager->ResetRenderState();
+}
+
+void GLLabelBatch::Add(GLLabel *label, glm::mat4 transform) {
+	if (label->manager != this->manager) {
+		std::cerr << "WARN: Label added to a batch of another font manager\n";
+		return;
+	}
+	label->Update();
+
+	size_t i = this->numQueued++;
+
+	if (i == this->entries.size()) {
+		this->entries.push_back(Entry{label, label->version, 0, 0, false});
+		this->transforms.push_back(transform);
+		this->firstDirtyEntry = std::min(this->firstDirtyEntry, i);
+		this->transformsDirty = true;
+	}
+
+	// Same label in the same slot as last frame, with no edits since then,
+	// means its instances are already in the buffer at the right place.
+	Entry &entry = this->entries[i];
+	if (entry.label != label || entry.version != label->version) {
+		entry.label = label;
+		entry.version = label->version;
+		this->firstDirtyEntry = std::min(this->firstDirtyEntry, i);
+		entry.paletteVersion = 0;
+	}
+	if (entry.paletteVersion != label->paletteVersion) {
+		entry.paletteVersion = label->paletteVersion;
+		this->firstDirtyPalette = std::min(this->firstDirtyPalette, i);
+		this->endDirtyPalette = std::max(this->endDirtyPalette, i + 1);
+	}
+
+	if (this->transforms[i] != transform) {
+		this->transforms[i] = transform;
+		this->transformsDirty = true;
+	}
+}
+
+// Copies `overlays` into `buffer`, growing it if needed
+static void upload_overlays(GLuint buffer, size_t *capacity, const void *overlays, size_t count, size_t size) {
+	if (count == 0) {
+		return;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	if (count > *capacity) {
+		*capacity = std::max(*capacity * 2, count);
+		glBufferData(GL_ARRAY_BUFFER, *capacity * size, NULL, GL_DYNAMIC_DRAW);
+	}
+	glBufferSubData(GL_ARRAY_BUFFER, 0, count * size, overlays);
+}
+
+void GLLabelBatch::GatherOverlays() {
+	this->selections.clear();
+	this->carets.clear();
+	for (size_t i = 0; i < this->entries.size(); i++) {
+		GLLabel *label = this->entries[i].label;
+		for (size_t j = 0; j < label->overlays.size(); j++) {
+			// The caret comes first, see GLLabel::overlays
+			if (j == 0 && !this->entries[i].caretOn) {
+				continue;
+			}
+			const GLLabel::OverlayInstance &o = label->overlays[j];
+			glm::vec2 pos = o.glyph.pos + label->lineOffsets[o.glyph.LineId()];
+			uint32_t transformAndColor = (uint32_t)i | (o.glyph.lineAndColor & ~GLLabel::kLineIdMask);
+			BatchOverlay overlay{BatchInstance{pos, o.glyph.glyphDataOffset, transformAndColor}, o.size};
+			(j == 0 ? this->carets : this->selections).push_back(overlay);
+		}
+	}
+
+	upload_overlays(this->selectionBuffer, &this->selectionBufferCapacity,
+		this->selections.data(), this->selections.size(), sizeof(BatchOverlay));
+	upload_overlays(this->caretBuffer, &this->caretBufferCapacity,
+		this->carets.data(), this->carets.size(), sizeof(BatchOverlay));
+}
+
+void GLLabelBatch::UploadPalettes() {
+	// Entries before the first changed one stay where they are. The rest
+	// are laid out again, but unless the changed ones took a different
+	// number of colors than before, only those go to the GPU.
+	size_t first = this->firstDirtyPalette;
+	size_t end = std::min(this->endDirtyPalette, this->entries.size());
+	size_t numEntries = this->entries.size();
+	this->paletteStarts.resize(numEntries + 1); // Added entries are all dirty
+	this->paletteBases.resize(numEntries);
+	size_t oldEnd = (end < numEntries) ? this->paletteStarts[end] : 0;
+
+	size_t maxColors = this->manager->maxTextureBufferSize;
+	bool overflowed = false;
+	this->palettes.resize(this->paletteStarts[first]);
+	for (size_t i = first; i < numEntries; i++) {
+		const std::vector<GLLabel::Color> &palette = this->entries[i].label->palette;
+		this->paletteStarts[i] = this->palettes.size();
+		if (this->palettes.size() + palette.size() > maxColors) {
+			this->paletteBases[i] = 0;
+			overflowed = true;
+			continue;
+		}
+		this->paletteBases[i] = this->palettes.size();
+		this->palettes.insert(this->palettes.end(), palette.begin(), palette.end());
+	}
+	this->paletteStarts[numEntries] = this->palettes.size();
+	if (overflowed) {
+		std::cerr << "WARN: Batch palettes don't fit in a buffer texture (max: "
+			<< maxColors << " colors), some labels take the first one's colors\n";
+	}
+	if (end == numEntries || this->paletteStarts[end] != oldEnd) {
+		end = numEntries;
+	}
+
+	size_t firstColor = this->paletteStarts[first];
+	size_t endColor = this->paletteStarts[end];
+	glBindBuffer(GL_TEXTURE_BUFFER, this->paletteBuf);
+	if (this->palettes.size() > this->paletteBufCapacity) {
+		this->paletteBufCapacity = std::min(std::max(this->paletteBufCapacity * 2, this->palettes.size()), maxColors);
+		glBufferData(GL_TEXTURE_BUFFER, this->paletteBufCapacity * sizeof(GLLabel::Color), NULL, GL_DYNAMIC_DRAW);
+		firstColor = 0;
+		endColor = this->palettes.size();
+	}
+	if (endColor > firstColor) {
+		glBufferSubData(GL_TEXTURE_BUFFER,
+			firstColor * sizeof(GLLabel::Color),
+			(endColor - firstColor) * sizeof(GLLabel::Color),
+			&this->palettes[firstColor]);
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, this->paletteBaseBuf);
+	if (numEntries > this->paletteBaseBufCapacity) {
+		this->paletteBaseBufCapacity = std::max(this->paletteBaseBufCapacity * 2, numEntries);
+		glBufferData(GL_TEXTURE_BUFFER, this->paletteBaseBufCapacity * sizeof(uint32_t), NULL, GL_DYNAMIC_DRAW);
+		first = 0;
+		end = numEntries;
+	}
+	glBufferSubData(GL_TEXTURE_BUFFER,
+		first * sizeof(uint32_t),
+		(end - first) * sizeof(uint32_t),
+		&this->paletteBases[first]);
+}
+
+void GLLabelBatch::Render(float time) {
+	// Fewer labels were queued than last frame, drop the rest
+	if (this->numQueued < this->entries.size()) {
+		this->entries.resize(this->numQueued);
+		this->transforms.resize(this->numQueued);
+		this->firstDirtyEntry = std::min(this->firstDirtyEntry, this->numQueued);
+	}
+	this->numQueued = 0;
+
+	// Overlays may need new glyphs, so they're built before uploading the
+	// atlases. Uploading may compact the atlases, moving the glyphs' data,
+	// in which case every label's instances are gathered again.
+	for (size_t i = 0; i < this->entries.size(); i++) {
+		this->entries[i].label->BuildOverlays();
+	}
+	this->manager->UploadAtlases();
+	if (this->seenAtlasGeneration != this->manager->GetAtlasGeneration()) {
+		this->seenAtlasGeneration = this->manager->GetAtlasGeneration();
+		for (size_t i = 0; i < this->entries.size(); i++) {
+			this->entries[i].label->RefreshGlyphData();
+			this->entries[i].version = this->entries[i].label->version;
+		}
+		this->firstDirtyEntry = 0;
+	}
+
+	if (this->firstDirtyEntry != kNoDirtyEntry) {
+		// Everything before the first changed entry is still valid. Regather
+		// the instances of every entry after it, since their offsets may change.
+		size_t first = this->firstDirtyEntry;
+		size_t firstInstance = this->entryInstances[first];
+		this->instances.resize(firstInstance);
+		this->entryInstances.resize(first + 1);
+
+		for (size_t i = first; i < this->entries.size(); i++) {
+			GLLabel *label = this->entries[i].label;
+			for (size_t j = 0; j < label->lines.size(); j++) {
+				const GLLabel::Line &line = label->lines[j];
+				glm::vec2 origin = label->lineOffsets[line.id];
+				for (size_t k = 0; k < line.instances.size(); k++) {
+					const GLLabel::GlyphInstance &g = line.instances[k];
+					uint32_t transformAndColor = (uint32_t)i | (g.lineAndColor & ~GLLabel::kLineIdMask);
+					this->instances.push_back(BatchInstance{g.pos + origin, g.glyphDataOffset, transformAndColor});
+				}
+			}
+			this->entryInstances.push_back(this->instances.size());
+		}
+
+		glBindBuffer(GL_ARRAY_BUFFER, this->instanceBuffer);
+		if (this->instances.size() > this->instanceBufferCapacity) {
+			// Grow the buffer along with the vector, and reupload it all
+			this->instanceBufferCapacity = this->instances.capacity();
+			glBufferData(GL_ARRAY_BUFFER, this->instanceBufferCapacity * sizeof(BatchInstance), NULL, GL_DYNAMIC_DRAW);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, this->instances.size() * sizeof(BatchInstance), &this->instances[0]);
+		}
+		else if (this->instances.size() > firstInstance) {
+			glBufferSubData(GL_ARRAY_BUFFER,
+				firstInstance * sizeof(BatchInstance),
+				(this->instances.size() - firstInstance) * sizeof(BatchInstance),
+				&this->instances[firstInstance]);
+		}
+
+		this->firstDirtyEntry = kNoDirtyEntry;
+		this->overlaysDirty = true;
+	}
+
+	for (size_t i = 0; i < this->entries.size(); i++) {
+		Entry &entry = this->entries[i];
+		bool caretOn = entry.label->AdvanceCaret(time) && entry.label->hasCaretOverlay;
+		if (entry.overlayVersion != entry.label->builtOverlayVersion || entry.caretOn != caretOn) {
+			entry.overlayVersion = entry.label->builtOverlayVersion;
+			entry.caretOn = caretOn;
+			this->overlaysDirty = true;
+		}
+	}
+	if (this->overlaysDirty) {
+		this->GatherOverlays();
+		this->overlaysDirty = false;
+	}
+
+	if (this->instances.empty() && this->selections.empty() && this->carets.empty()) {
+		return;
+	}
+
+	double gpuUs;
+	while (this->renderTimer.Poll(&gpuUs)) {
+		this->manager->stats.renderGpuTime.Add(gpuUs);
+	}
+	if (this->manager->GPUTimingsEnabled()) {
+		this->renderTimer.Begin();
+	}
+
+	if (this->firstDirtyPalette < this->entries.size()) {
+		this->UploadPalettes();
+	}
+	this->firstDirtyPalette = kNoDirtyEntry;
+	this->endDirtyPalette = 0;
+
+	if (this->transformsDirty) {
+		glBindBuffer(GL_TEXTURE_BUFFER, this->transformBuf);
+		glBufferData(GL_TEXTURE_BUFFER, this->transforms.size() * sizeof(glm::mat4),
+			&this->transforms[0], GL_STREAM_DRAW);
+		this->transformsDirty = false;
+	}
+
+	if (!this->manager->UseGlyphShader(this->quality)) {
+		this->renderTimer.End();
+		return;
+	}
+	this->manager->UseAtlasTextures();
+	this->manager->UseBlending();
+	this->manager->UseTransformBuffer(this->transformBufTex);
+	this->manager->UseLineOffsetBuffer(0);
+	this->manager->UsePaletteBuffer(this->paletteBufTex, this->paletteBaseBufTex);
+
+	// Highlights go under the text, and carets over it
+	if (!this->selections.empty()) {
+		this->manager->UseInstanceSize(true);
+		this->manager->BindVertexArray(this->selectionVertexArray);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, 6, this->selections.size());
+	}
+	if (!this->instances.empty()) {
+		this->manager->UseInstanceSize(false);
+		this->manager->BindVertexArray(this->vertexArray);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, 6, this->instances.size());
+	}
+	if (!this->carets.empty()) {
+		this->manager->UseInstanceSize(true);
+		this->manager->BindVertexArray(this->caretVertexArray);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, 6, this->carets.size());
+	}
+	this->renderTimer.End();
+}
@@ -6,10 +6,21 @@ struct DecomposeState
 {
 	std::vector<Bezier2> *curves;
 	FT_Vector prev;
-	int c2qResolution;
-	double *c2qOut;
+
+	// Cubics are converted all together once the outline is decomposed.
+	// Each has 8 doubles in cubics, and the size of curves at the time it
+	// came up, which is where its quadratics go.
+	std::vector<double> *cubics;
+	std::vector<size_t> *cubicPositions;
 };
 
+// Scratch space for converting cubics, kept per thread since glyphs are
+// prepared concurrently
+static thread_local std::vector<double> tCubics;
+static thread_local std::vector<size_t> tCubicPositions;
+static thread_local std::vector<double> tQuads;
+static thread_local std::vector<int> tQuadCounts;
+
 static Bezier2 vec2bezier(const FT_Vector *e0, const FT_Vector *c, const FT_Vector *e1)
 {
 	Bezier2 b;
@@ -54,35 +65,56 @@ static int decompose_cubic_to(
 		(double)c2->x, (double)c2->y,
 		(double)to->x, (double)to->y,
 	};
-	double *out = state->c2qOut;
-
-	int nvals = 6 * cubic2quad(in, state->c2qResolution, out);
-
-	for (int i = 0; i < nvals; i += 6) {
-		Bezier2 b;
-		b.e0 = Vec2(out[i], out[i+1]);
-		b.c = Vec2(out[i+2], out[i+3]);
-		b.e1 = Vec2(out[i+4], out[i+5]);
-		state->curves->push_back(b);
-	}
+	state->cubics->insert(state->cubics->end(), in, in + 8);
+	state->cubicPositions->push_back(state->curves->size());
 
 	state->prev = *to;
 	return 0;
 }
 
-// Decompose an outline into an array of quadratic bezier curves. Cubics in
-// the outline are converted to quadratic at the given resolution.
-static std::vector<Bezier2> decompose(FT_Outline *outline, int c2qResolution)
+// Converts the cubics collected while decomposing, and puts their quadratics
+// in between the other curves where each cubic was. Going from the back,
+// every curve only has to move once.
+static void insert_cubics(std::vector<Bezier2> &curves, int c2qResolution)
 {
-	double c2qOut[C2Q_OUT_LEN];
+	int numCubics = tCubicPositions.size();
+	tQuads.resize(numCubics * C2Q_OUT_LEN);
+	tQuadCounts.resize(numCubics);
+	int numQuads = cubic2quad_batch(&tCubics[0], numCubics, c2qResolution,
+		&tQuads[0], &tQuadCounts[0]);
+
+	size_t src = curves.size();
+	curves.resize(curves.size() + numQuads);
+	size_t dst = curves.size();
+	const double *quad = &tQuads[numQuads * 6];
+	for (int i = numCubics - 1; i >= 0; i--) {
+		while (src > tCubicPositions[i]) {
+			curves[--dst] = curves[--src];
+		}
+		for (int j = 0; j < tQuadCounts[i]; j++) {
+			quad -= 6;
+			Bezier2 &b = curves[--dst];
+			b.e0 = Vec2(quad[0], quad[1]);
+			b.c = Vec2(quad[2], quad[3]);
+			b.e1 = Vec2(quad[4], quad[5]);
+		}
+	}
+}
 
-	std::vector<Bezier2> curves;
+// Decompose an outline into an array of quadratic bezier curves. Cubics in
+// the outline are converted to quadratic at the given resolution. The
+// curves replace the previous contents of `curves`.
+static bool decompose(FT_Outline *outline, int c2qResolution, std::vector<Bezier2> &curves)
+{
+	curves.clear();
 	curves.reserve(outline->n_contours);
+	tCubics.clear();
+	tCubicPositions.clear();
 
 	DecomposeState state{};
 	state.curves = &curves;
-	state.c2qOut = c2qOut;
-	state.c2qResolution = c2qResolution;
+	state.cubics = &tCubics;
+	state.cubicPositions = &tCubicPositions;
 
 	FT_Outline_Funcs funcs{};
 	funcs.move_to = decompose_move_to;
@@ -91,9 +123,13 @@ static std::vector<Bezier2> decompose(FT_Outline *outline, int c2qResolution)
 	funcs.cubic_to = decompose_cubic_to;
 
 	if (FT_Outline_Decompose(outline, &funcs, &state) != 0) {
-		return std::vector<Bezier2>();
+		curves.clear();
+		return false;
+	}
+	if (!tCubicPositions.empty()) {
+		insert_cubics(curves, c2qResolution);
 	}
-	return curves;
+	return true;
 }
 
 // Shifts all bezier points so 'origin' becomes 0,0
@@ -120,9 +156,17 @@ static void flip_beziers(std::vector<Bezier2> &beziers)
 // Convert a FreeType Outline into an array of quadratic beziers. For well-
 // designed fonts, the beziers are always generated clockwise (fill right).
 std::vector<Bezier2> GetBeziersForOutline(FT_Outline *outline)
+{
+	std::vector<Bezier2> beziers;
+	GetBeziersForOutline(outline, beziers);
+	return beziers;
+}
+
+void GetBeziersForOutline(FT_Outline *outline, std::vector<Bezier2> &beziers)
 {
 	if (!outline || outline->n_points <= 0) {
-		return std::vector<Bezier2>();
+		beziers.clear();
+		return;
 	}
 
 	FT_BBox cbox;
@@ -135,7 +179,7 @@ std::vector<Bezier2> GetBeziersForOutline(FT_Outline *outline)
 	// enough are generated (looks bad). 5% works pretty well.
 	int c2qResolution = std::max((int)(((width + height) / 2) * 0.05), 1);
 
-	std::vector<Bezier2> beziers = decompose(outline, c2qResolution);
+	decompose(outline, c2qResolution, beziers);
 
 	if (cbox.xMin != 0 || cbox.yMin != 0) {
 		translate_beziers(beziers, Vec2(cbox.xMin, cbox.yMin));
@@ -146,6 +190,4 @@ std::vector<Bezier2> GetBeziersForOutline(FT_Outline *outline)
 	if (counterclockwise) {
 		flip_beziers(beziers);
 	}
-
-	return beziers;
 }
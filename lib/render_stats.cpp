@@ -0,0 +1,55 @@
+#include "render_stats.hpp"
+
+GPUTimer::GPUTimer()
+	: queries{}, firstPending(0), numPending(0), created(false), running(false) {
+}
+
+GPUTimer::~GPUTimer() {
+	if (this->created) {
+		glDeleteQueries(kQueries, this->queries);
+	}
+}
+
+void GPUTimer::Begin() {
+	if (!this->created) {
+		glGenQueries(kQueries, this->queries);
+		this->created = true;
+	}
+	if (this->running || this->numPending == kQueries) {
+		return;
+	}
+
+	size_t i = (this->firstPending + this->numPending) % kQueries;
+	glBeginQuery(GL_TIME_ELAPSED, this->queries[i]);
+	this->running = true;
+}
+
+void GPUTimer::End() {
+	if (!this->running) {
+		return;
+	}
+	glEndQuery(GL_TIME_ELAPSED);
+	this->running = false;
+	this->numPending++;
+}
+
+bool GPUTimer::Poll(double *us) {
+	if (this->numPending == 0) {
+		return false;
+	}
+
+	// Queries finish in order, so only the oldest needs checking
+	GLuint query = this->queries[this->firstPending];
+	GLint available = 0;
+	glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) {
+		return false;
+	}
+
+	GLuint64 ns = 0;
+	glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+	*us = ns / 1000.0;
+	this->firstPending = (this->firstPending + 1) % kQueries;
+	this->numPending--;
+	return true;
+}
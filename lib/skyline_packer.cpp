@@ -0,0 +1,118 @@
+#include "skyline_packer.hpp"
+
+SkylinePacker::SkylinePacker(uint16_t width, uint16_t height)
+	: width(width), height(height) {
+	this->skyline.push_back(Node{0, 0, width});
+}
+
+SkylinePacker::SkylinePacker(uint16_t width, uint16_t height, const std::vector<Node> &skyline)
+	: width(width), height(height) {
+	// The spans have to cover the width exactly, with nothing too tall
+	uint32_t x = 0;
+	size_t i = 0;
+	for (; i < skyline.size(); i++) {
+		if (skyline[i].x != x || skyline[i].width == 0 || skyline[i].y > height) {
+			break;
+		}
+		x += skyline[i].width;
+	}
+	if (skyline.empty() || i < skyline.size() || x != width) {
+		this->skyline.push_back(Node{0, 0, width});
+		return;
+	}
+	this->skyline = skyline;
+}
+
+int SkylinePacker::FitAt(size_t i, uint16_t w, uint16_t h) const {
+	uint16_t x = this->skyline[i].x;
+	if (x + w > this->width) {
+		return -1;
+	}
+
+	// The rect rests on the tallest span beneath it
+	int y = 0;
+	int widthLeft = w;
+	for (size_t j = i; widthLeft > 0; j++) {
+		if (this->skyline[j].y > y) {
+			y = this->skyline[j].y;
+		}
+		widthLeft -= this->skyline[j].width;
+	}
+
+	if (y + h > this->height) {
+		return -1;
+	}
+	return y;
+}
+
+bool SkylinePacker::Pack(uint16_t w, uint16_t h, uint16_t &outX, uint16_t &outY) {
+	if (w == 0 || h == 0) {
+		outX = 0;
+		outY = 0;
+		return true;
+	}
+
+	// Find the lowest fit, preferring the narrowest span on ties so wide
+	// spans stay open for wide rects
+	size_t best = SIZE_MAX;
+	int bestY = 0;
+	for (size_t i = 0; i < this->skyline.size(); i++) {
+		int y = this->FitAt(i, w, h);
+		if (y < 0) {
+			continue;
+		}
+		if (best == SIZE_MAX || y < bestY
+			|| (y == bestY && this->skyline[i].width < this->skyline[best].width)) {
+			best = i;
+			bestY = y;
+		}
+	}
+	if (best == SIZE_MAX) {
+		return false;
+	}
+
+	outX = this->skyline[best].x;
+	outY = bestY;
+
+	// Raise the skyline under the new rect, trimming or dropping the spans
+	// it now covers
+	Node node{outX, (uint16_t)(bestY + h), w};
+	size_t i = best;
+	uint16_t right = outX + w;
+	while (i < this->skyline.size() && this->skyline[i].x < right) {
+		Node &n = this->skyline[i];
+		uint16_t nRight = n.x + n.width;
+		if (nRight <= right) {
+			this->skyline.erase(this->skyline.begin() + i);
+		}
+		else {
+			n.width = nRight - right;
+			n.x = right;
+			break;
+		}
+	}
+	this->skyline.insert(this->skyline.begin() + best, node);
+
+	// Merge neighbouring spans of the same height
+	for (size_t j = 0; j + 1 < this->skyline.size(); ) {
+		if (this->skyline[j].y == this->skyline[j + 1].y) {
+			this->skyline[j].width += this->skyline[j + 1].width;
+			this->skyline.erase(this->skyline.begin() + j + 1);
+		}
+		else {
+			j++;
+		}
+	}
+
+	return true;
+}
+
+uint16_t SkylinePacker::UsedHeight() const {
+	uint16_t most = 0;
+	for (size_t i = 0; i < this->skyline.size(); i++) {
+		if (this->skyline[i].y > most) {
+			most = this->skyline[i].y;
+		}
+	}
+	return most;
+}
@@ -0,0 +1,137 @@
+#include "text_layout.hpp"
+#include FT_ADVANCES_H
+#include <cmath>
+
+float layout_tab_stop(float x, const LayoutOptions &options) {
+	if (options.tabWidth <= 0) {
+		return x;
+	}
+	return (std::floor(x / options.tabWidth) + 1) * options.tabWidth;
+}
+
+// Kerning between two glyphs by index, 0 if either is missing
+static float kerning_between(FT_Face face, FT_UInt left, FT_UInt right) {
+	FT_Vector kerning;
+	if (!left || !right || FT_Get_Kerning(face, left, right, FT_KERNING_UNSCALED, &kerning)) {
+		return 0;
+	}
+	return kerning.x;
+}
+
+static bool is_control(uint32_t point) {
+	return point == '\n' || point == '\r' || point == '\t';
+}
+
+void layout_text(
+	FT_Face face,
+	const char32_t *text,
+	size_t length,
+	const LayoutOptions &options,
+	std::vector<LayoutGlyph> &out) {
+	out.resize(length);
+	bool kerning = options.kerning && FT_HAS_KERNING(face);
+	float x = 0, y = 0;
+	for (size_t i = 0; i < length; i++) {
+		LayoutGlyph &glyph = out[i];
+		glyph.point = text[i];
+		glyph.index = 0;
+		glyph.kerning = 0;
+
+		if (text[i] == '\n') {
+			glyph.x = x;
+			glyph.y = y;
+			x = 0;
+			y -= face->height;
+			continue;
+		}
+		if (text[i] == '\t') {
+			// Like GLLabel, a tab sits at the stop it moves the pen to
+			x = layout_tab_stop(x, options);
+		}
+		if (is_control(text[i])) {
+			glyph.x = x;
+			glyph.y = y;
+			continue;
+		}
+
+		glyph.index = FT_Get_Char_Index(face, text[i]);
+		if (kerning && i > 0) {
+			out[i - 1].kerning = kerning_between(face, out[i - 1].index, glyph.index);
+			x += out[i - 1].kerning;
+		}
+		glyph.x = x;
+		glyph.y = y;
+
+		FT_Fixed advance = 0;
+		FT_Get_Advance(face, glyph.index, FT_LOAD_NO_SCALE, &advance);
+		x += advance;
+	}
+}
+
+float layout_kerning(FT_Face face, uint32_t left, uint32_t right, const LayoutOptions &options) {
+	if (!options.kerning || !FT_HAS_KERNING(face) || is_control(left) || is_control(right)) {
+		return 0;
+	}
+	return kerning_between(face, FT_Get_Char_Index(face, left), FT_Get_Char_Index(face, right));
+}
+
+// 64 bit FNV-1a over everything the layout depends on
+static uint64_t layout_hash(uint32_t faceId, const std::u32string &text, const LayoutOptions &options) {
+	uint64_t hash = 14695981039346656037ull;
+	auto add = [&hash](const void *data, size_t size) {
+		for (size_t i = 0; i < size; i++) {
+			hash = (hash ^ ((const uint8_t *)data)[i]) * 1099511628211ull;
+		}
+	};
+	add(&faceId, sizeof(faceId));
+	add(&options.kerning, sizeof(options.kerning));
+	add(&options.tabWidth, sizeof(options.tabWidth));
+	add(text.data(), text.size() * sizeof(char32_t));
+	return hash;
+}
+
+const std::vector<LayoutGlyph> & LayoutCache::Get(
+	FT_Face face,
+	uint32_t faceId,
+	const std::u32string &text,
+	const LayoutOptions &options) {
+	if (text.size() > kMaxLength) {
+		this->stats.misses++;
+		layout_text(face, text.data(), text.size(), options, this->uncached);
+		return this->uncached;
+	}
+
+	uint64_t hash = layout_hash(faceId, text, options);
+	auto it = this->byHash.find(hash);
+	if (it != this->byHash.end()) {
+		Entry &entry = *it->second;
+		if (entry.faceId == faceId && entry.text == text
+			&& entry.options.kerning == options.kerning && entry.options.tabWidth == options.tabWidth) {
+			this->stats.hits++;
+			this->entries.splice(this->entries.begin(), this->entries, it->second);
+			return entry.glyphs;
+		}
+
+		// Another text with the same hash, which makes way for this one
+		this->entries.erase(it->second);
+		this->byHash.erase(it);
+	}
+	this->stats.misses++;
+
+	// Reuse the least recently used entry's storage once full
+	if (this->entries.size() >= kMaxEntries) {
+		this->byHash.erase(this->entries.back().hash);
+		this->entries.splice(this->entries.begin(), this->entries, std::prev(this->entries.end()));
+	}
+	else {
+		this->entries.push_front(Entry{});
+	}
+	Entry &entry = this->entries.front();
+	entry.hash = hash;
+	entry.faceId = faceId;
+	entry.options = options;
+	entry.text = text;
+	layout_text(face, text.data(), text.size(), options, entry.glyphs);
+	this->byHash[hash] = this->entries.begin();
+	return entry.glyphs;
+}
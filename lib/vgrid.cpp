@@ -1,6 +1,8 @@
 #include "vgrid.hpp"
+#include "simd.hpp"
 #include <iostream>
 #include <cmath>
+#include <algorithm>
 #include <assert.h>
 
 // Converts X,Y to index in a row-major 2D array
@@ -13,94 +15,255 @@ constexpr const T& clamp(const T& v, const T& min, const T& max) {
 	return std::max(std::min(v, max), min);
 }
 
-// Returns a list of the beziers that intersect each grid cell.
-// The returned outer vector is always size gridWidth*gridHeight.
-static std::vector<std::set<size_t>> find_cells_intersections(
+// Scratch space for building grids, kept per thread so glyphs can be
+// prepared concurrently without allocating once these have grown.
+// For each cell, one more than the last bezier index added to it.
+static thread_local std::vector<uint32_t> tCellLastBezier;
+// Intersections of each row's midline with the glyph.
+static thread_local std::vector<std::vector<float>> tRowIntersections;
+// Positions of the grid lines and row midlines, see set_lines()
+static thread_local std::vector<float> tVertLines, tHorzLines, tMidLines;
+
+// Intersections of a quadratic bezier with four horizontal lines y=Y, one
+// per lane, worked out exactly like Bezier2::IntersectHorz() does so they
+// come out the same. Pass the bezier with x and y swapped to intersect
+// vertical lines instead. Bit i of the result is set if lane i has an
+// intersection in x1, and bit i + 4 if it has one in x2.
+SIMD_INLINE int intersect_horz4(const Bezier2& bezier, f32x4 Y, f32x4* x1, f32x4* x2) {
+	const f32x4 zero = v_set(0), one = v_set(1), two = v_set(2);
+	const f32x4 e0x = v_set(bezier.e0.x), e0y = v_set(bezier.e0.y);
+	const f32x4 cx = v_set(bezier.c.x), cy = v_set(bezier.c.y);
+	const f32x4 e1x = v_set(bezier.e1.x), e1y = v_set(bezier.e1.y);
+
+	float a = bezier.e0.y - 2*bezier.c.y + bezier.e1.y;
+	f32x4 t1, t2;
+	int valid2 = 0;
+	// Same as almostEqual(a, 0), which compares in double precision
+	if (std::fabs(a) <= 1e-5f) {
+		t1 = v_div(v_sub(v_sub(v_mul(two, cy), e1y), Y), v_mul(two, v_sub(cy, e1y)));
+		t2 = zero;
+	}
+	else {
+		f32x4 va = v_set(a);
+		f32x4 sqrtTerm = v_sqrt(v_sub(v_add(v_mul(Y, va), v_mul(cy, cy)), v_mul(e0y, e1y)));
+		t1 = v_div(v_add(v_sub(e0y, cy), sqrtTerm), va);
+		t2 = v_div(v_sub(v_sub(e0y, cy), sqrtTerm), va);
+		valid2 = m_bits(m_and(v_le(t2, one), v_ge(t2, zero)));
+	}
+	int valid1 = m_bits(m_and(v_le(t1, one), v_ge(t1, zero)));
+
+	// (1-t)^2*e0 + 2*t*(1-t)*c + t^2*e1
+	auto xFromT = [&](f32x4 t) {
+		f32x4 u = v_sub(one, t);
+		return v_add(v_add(v_mul(v_mul(u, u), e0x), v_mul(v_mul(v_mul(two, t), u), cx)),
+			v_mul(v_mul(t, t), e1x));
+	};
+	*x1 = xFromT(t1);
+	*x2 = xFromT(t2);
+	return valid1 | valid2 << 4;
+}
+
+// Index of the lowest set bit of a nonzero mask from intersect_horz4()
+static int lowest_bit(int bits) {
+#if defined(__GNUC__)
+	return __builtin_ctz(bits);
+#else
+	int i = 0;
+	while (!(bits & (1 << i))) {
+		i++;
+	}
+	return i;
+#endif
+}
+
+static Bezier2 swap_xy(const Bezier2& b) {
+	return Bezier2{
+		{ b.e0.y, b.e0.x },
+		{ b.e1.y, b.e1.x },
+		{ b.c.y, b.c.x }
+	};
+}
+
+// Fills `lines` with the positions of `count` lines, (i + offset) cells into
+// a grid of `cells` cells spanning `size`. Computed the same way as the
+// original scalar code did, and padded so four lines can be loaded from any
+// of them.
+static void set_lines(std::vector<float>& lines, int count, float size, int cells, float offset) {
+	lines.resize(count + 4);
+	for (size_t i = 0; i < lines.size(); i++) {
+		lines[i] = (i + offset) * size / cells;
+	}
+}
+
+// Range of lines [first, last] which a bezier spanning [min, max] along
+// their axis could cross, where `scale` is lines per font unit. A line more
+// past either end is added as a margin for rounding, and the range is
+// clamped to [0, count - 1].
+static void lines_in_range(
+	float min,
+	float max,
+	float scale,
+	float offset,
+	int count,
+	int* first,
+	int* last) {
+	// Truncating is the same as flooring once these are known to be positive.
+	// Comparisons are false for NaN, which goes to the full range.
+	float lo = min * scale - offset - 1;
+	float hi = max * scale - offset + 2;
+	*first = (lo > 0) ? (int)std::min(lo, (float)count) : 0;
+	*last = (hi < count - 1) ? ((hi > 0) ? (int)hi : 0) : count - 1;
+}
+
+// Fills in the beziers that intersect each grid cell. Beziers are visited in
+// index order, so each cell's list comes out sorted, and a bezier hitting the
+// same cell twice is always the last one added to it. Each bezier is only
+// intersected with the grid lines within its bounding box, four at a time.
+static void find_cells_intersections(
+	VGrid& grid,
 	std::vector<Bezier2>& beziers,
-	Vec2 glyphSize, // in font units
-	int gridWidth,
-	int gridHeight) {
-	std::vector<std::set<size_t>> cellBeziers;
-	cellBeziers.resize(gridWidth * gridHeight);
+	Vec2 glyphSize) { // in font units
+	int gridWidth = grid.width;
+	int gridHeight = grid.height;
+	tCellLastBezier.assign(gridWidth * gridHeight, 0);
 
 	auto setgrid = [&](int x, int y, size_t bezierIndex) {
 		x = clamp(x, 0, gridWidth - 1);
 		y = clamp(y, 0, gridHeight - 1);
-		cellBeziers[(y * gridWidth) + x].insert(bezierIndex);
+		size_t cellIdx = (y * gridWidth) + x;
+		if (tCellLastBezier[cellIdx] == bezierIndex + 1) {
+			return;
+		}
+		tCellLastBezier[cellIdx] = bezierIndex + 1;
+
+		uint16_t count = grid.cellCounts[cellIdx]++;
+		if (count < VGrid::kCellCapacity) {
+			grid.cellBeziers[cellIdx * VGrid::kCellCapacity + count] = bezierIndex;
+		}
 	};
 
+	// Every vertical grid line including edges, and every horizontal one
+	set_lines(tVertLines, gridWidth + 1, glyphSize.w, gridWidth, 0);
+	set_lines(tHorzLines, gridHeight + 1, glyphSize.h, gridHeight, 0);
+	float scaleX = gridWidth / glyphSize.w;
+	float scaleY = gridHeight / glyphSize.h;
+
 	for (size_t i = 0; i < beziers.size(); i++) {
+		const Bezier2& b = beziers[i];
 		bool anyIntersections = false;
+		int first, last;
 
-		// Every vertical grid line including edges
-		for (int x = 0; x <= gridWidth; x++) {
-			float intY[2];
-			int numInt = beziers[i].IntersectVert(
-				x * glyphSize.w / gridWidth,
-				intY);
-			for (int j = 0; j < numInt; j++) {
-				//intY[j] contains the y value in font units of the intersection
-				//glyph size is total height of glyph in font units
-				int y = intY[j] * gridHeight / glyphSize.h;
-				setgrid(x, y, i); // right
-				setgrid(x - 1, y, i); // left
-				anyIntersections = true;
+		lines_in_range(std::min({b.e0.x, b.c.x, b.e1.x}), std::max({b.e0.x, b.c.x, b.e1.x}),
+			scaleX, 0, gridWidth + 1, &first, &last);
+		Bezier2 swapped = swap_xy(b);
+		for (int x0 = first; x0 <= last; x0 += 4) {
+			f32x4 intY1, intY2;
+			int hits = intersect_horz4(swapped, v_load(&tVertLines[x0]), &intY1, &intY2);
+			if (!hits) {
+				continue;
+			}
+			float intY[8];
+			v_store(intY, intY1);
+			v_store(intY + 4, intY2);
+			for (; hits; hits &= hits - 1) {
+				int j = lowest_bit(hits);
+				int x = x0 + (j & 3);
+				if (x <= last) {
+					//intY[j] contains the y value in font units of the intersection
+					//glyph size is total height of glyph in font units
+					int y = intY[j] * gridHeight / glyphSize.h;
+					setgrid(x, y, i); // right
+					setgrid(x - 1, y, i); // left
+					anyIntersections = true;
+				}
 			}
 		}
 
-		// Every horizontal grid line including edges
-		for (int y = 0; y <= gridHeight; y++) {
-			float intX[2];
-			int numInt = beziers[i].IntersectHorz(
-				y * glyphSize.h / gridHeight,
-				intX);
-			for (int j = 0; j < numInt; j++) {
-				int x = intX[j] * gridWidth / glyphSize.w;
-				setgrid(x, y, i); // up
-				setgrid(x, y - 1, i); // down
-				anyIntersections = true;
+		lines_in_range(std::min({b.e0.y, b.c.y, b.e1.y}), std::max({b.e0.y, b.c.y, b.e1.y}),
+			scaleY, 0, gridHeight + 1, &first, &last);
+		for (int y0 = first; y0 <= last; y0 += 4) {
+			f32x4 intX1, intX2;
+			int hits = intersect_horz4(b, v_load(&tHorzLines[y0]), &intX1, &intX2);
+			if (!hits) {
+				continue;
+			}
+			float intX[8];
+			v_store(intX, intX1);
+			v_store(intX + 4, intX2);
+			for (; hits; hits &= hits - 1) {
+				int j = lowest_bit(hits);
+				int y = y0 + (j & 3);
+				if (y <= last) {
+					int x = intX[j] * gridWidth / glyphSize.w;
+					setgrid(x, y, i); // up
+					setgrid(x, y - 1, i); // down
+					anyIntersections = true;
+				}
 			}
 		}
 
 		// If no grid line intersections, bezier is fully contained in
 		// one cell. Mark this bezier as intersecting that cell.
 		if (!anyIntersections) {
-			int x = beziers[i].e0.x * gridWidth / glyphSize.w;
-			int y = beziers[i].e0.y * gridHeight / glyphSize.h;
+			int x = b.e0.x * gridWidth / glyphSize.w;
+			int y = b.e0.y * gridHeight / glyphSize.h;
 			setgrid(x, y, i);
 		}
 	}
-
-	return cellBeziers;
 }
 
-// Returns whether the midpoint of the cell is inside the glyph for each cell.
-// The returned vector is always size gridWidth*gridHeight.
-static std::vector<char> find_cells_mids_inside(
+// Fills in whether the midpoint of each cell is inside the glyph.
+static void find_cells_mids_inside(
+	VGrid& grid,
 	std::vector<Bezier2>& beziers,
-	Vec2 glyphSize,
-	int gridWidth,
-	int gridHeight) {
-
-	std::vector<char> cellMids;
-	cellMids.resize(gridWidth * gridHeight);
+	Vec2 glyphSize) {
+	int gridWidth = grid.width;
+	int gridHeight = grid.height;
 
-	// Find whether the center of each cell is inside the glyph
+	// Find all intersections with cells horizontal midpoint lines, going
+	// through the beziers like find_cells_intersections() does
+	set_lines(tMidLines, gridHeight, glyphSize.h, gridHeight, 0.5);
+	float scaleY = gridHeight / glyphSize.h;
+	if (tRowIntersections.size() < (size_t)gridHeight) {
+		tRowIntersections.resize(gridHeight);
+	}
 	for (int y = 0; y < gridHeight; y++) {
-		// Find all intersections with cells horizontal midpoint line
-		// and store them sorted from left to right
-		std::set<float> intersections;
-		float yMid = y + 0.5;
-		for (size_t i = 0; i < beziers.size(); i++) {
-			float intX[2];
-			int numInt = beziers[i].IntersectHorz(
-				yMid * glyphSize.h / gridHeight,
-				intX);
-			for (int j = 0; j < numInt; j++) {
-				float x = intX[j] * gridWidth / glyphSize.w;
-				intersections.insert(x);
+		tRowIntersections[y].clear();
+	}
+	for (size_t i = 0; i < beziers.size(); i++) {
+		const Bezier2& b = beziers[i];
+		int first, last;
+		lines_in_range(std::min({b.e0.y, b.c.y, b.e1.y}), std::max({b.e0.y, b.c.y, b.e1.y}),
+			scaleY, 0.5, gridHeight, &first, &last);
+		for (int y0 = first; y0 <= last; y0 += 4) {
+			f32x4 intX1, intX2;
+			int hits = intersect_horz4(b, v_load(&tMidLines[y0]), &intX1, &intX2);
+			if (!hits) {
+				continue;
+			}
+			float intX[8];
+			v_store(intX, intX1);
+			v_store(intX + 4, intX2);
+			for (; hits; hits &= hits - 1) {
+				int j = lowest_bit(hits);
+				int y = y0 + (j & 3);
+				if (y <= last) {
+					float x = intX[j] * gridWidth / glyphSize.w;
+					tRowIntersections[y].push_back(x);
+				}
 			}
 		}
+	}
+
+	// Find whether the center of each cell is inside the glyph
+	for (int y = 0; y < gridHeight; y++) {
+		// Sort each row's intersections from left to right. Duplicates
+		// (where two curves meet on the line) only count once.
+		std::vector<float>& intersections = tRowIntersections[y];
+		std::sort(intersections.begin(), intersections.end());
+		intersections.erase(
+			std::unique(intersections.begin(), intersections.end()),
+			intersections.end());
 
 		// Traverse intersections (whole grid row, left to right).
 		// Every 2nd crossing represents exiting an "inside" region.
@@ -108,8 +271,8 @@ static std::vector<char> find_cells_mids_inside(
 		// crossings.
 		bool outside = false;
 		float start = 0;
-		for (auto it = intersections.begin(); it != intersections.end(); it++) {
-			float end = *it;
+		for (size_t i = 0; i < intersections.size(); i++) {
+			float end = intersections[i];
 
 			// Upon exiting, the midpoint of every cell between
 			// start and end, rounded to the nearest int, is
@@ -118,7 +281,7 @@ static std::vector<char> find_cells_mids_inside(
 				int startCell = clamp((int)std::round(start), 0, gridWidth);
 				int endCell = clamp((int)std::round(end), 0, gridWidth);
 				for (int x = startCell; x < endCell; x++) {
-					cellMids[(y * gridWidth) + x] = true;
+					grid.cellMids[(y * gridWidth) + x] = true;
 				}
 			}
 
@@ -126,8 +289,6 @@ static std::vector<char> find_cells_mids_inside(
 			start = end;
 		}
 	}
-
-	return cellMids;
 }
 
 VGrid::VGrid(
@@ -135,33 +296,87 @@ VGrid::VGrid(
 	Vec2 glyphSize,
 	int gridWidth,
 	int gridHeight)
-	: width(gridWidth), height(gridHeight) {
-	this->cellBeziers = find_cells_intersections(
-		beziers, glyphSize, gridWidth, gridHeight);
-	this->cellMids = find_cells_mids_inside(
-		beziers, glyphSize, gridWidth, gridHeight);
+	: width(0), height(0) {
+	this->Build(beziers, glyphSize, gridWidth, gridHeight);
+}
+
+void VGrid::Build(
+	std::vector<Bezier2>& beziers,
+	Vec2 glyphSize,
+	int gridWidth,
+	int gridHeight) {
+	this->width = gridWidth;
+	this->height = gridHeight;
+
+	// assign() keeps the existing capacity, only clearing the contents
+	size_t numCells = gridWidth * gridHeight;
+	this->cellBeziers.resize(numCells * kCellCapacity);
+	this->cellCounts.assign(numCells, 0);
+	this->cellMids.assign(numCells, false);
+
+	find_cells_intersections(*this, beziers, glyphSize);
+	find_cells_mids_inside(*this, beziers, glyphSize);
 }
 
-// Each bezier index is represented as one byte in the grid cell,
+uint16_t VGrid::MaxCellSize() const {
+	uint16_t most = 0;
+	for (size_t i = 0; i < this->cellCounts.size(); i++) {
+		most = std::max(most, this->cellCounts[i]);
+	}
+	return most;
+}
+
+// Each bezier index is represented as one 16 bit int in the grid cell,
 // and values 0 and 1 are reserved for special meaning.
-// This leaves a limit of 254 beziers per grid/glyph.
-// More on the meaning of values 1 and 0 in the VGridAtlas struct
-// definition and in write_vgrid_cell_to_buffer().
-static const uint8_t kBezierIndexUnused = 0;
-static const uint8_t kBezierIndexSortMeta = 1;
-static const uint8_t kBezierIndexFirstReal = 2;
-//static const uint8_t kMaxBeziersPerGrid = 256 - kBezierIndexFirstReal;
-
-// Writes the data of a single vgrid cell into a texel. At most `depth` bytes
-// will be written, even if there are more beziers.
+// This leaves a limit of 65534 beziers per grid/glyph.
+// More on the meaning of values 1 and 0 in write_vgrid_cell_to_buffer().
+static const uint16_t kBezierIndexUnused = 0;
+static const uint16_t kBezierIndexSortMeta = 1;
+static const uint16_t kBezierIndexFirstReal = 2;
+
+// Texels taken by a cell's overflow list: its length, then each index,
+// as 16 bit ints packed two per texel.
+static size_t overflow_list_size(size_t numBeziers) {
+	return (1 + numBeziers + 1) / 2;
+}
+
+// Writes the data of a single vgrid cell into a texel. At most `depth`
+// indices will be written, even if there are more beziers.
+// If it has more beziers than that and `overflow` isn't null, the cell's
+// full list is written at `overflow` instead and the texel is written as:
+//   data[0], data[1]: overflowOffset (low 16 bits, then high 16 bits)
+//   data[2]: midInside (0 or 1)
+//   data[3]: kBezierIndexSortMeta, which marks the cell as an overflow cell
+// That pattern never comes up in a regular cell, where the sort meta value
+// is only ever used in data[0].
 static void write_vgrid_cell_to_buffer(
 	VGrid& grid,
 	size_t cellIdx, // which cell in `grid` to write
-	uint8_t* data, // texel buffer, `depth` bytes long
-	uint8_t depth) {
+	uint16_t* data, // texel buffer, `depth` ints long
+	uint8_t depth,
+	uint16_t* overflow,
+	uint32_t overflowOffset) {
 
 	//get the beziers in the cell
-	std::set<size_t>* beziers = &grid.cellBeziers[cellIdx];
+	const uint16_t* beziers = grid.CellBeziers(cellIdx);
+	size_t numBeziers = grid.CellSize(cellIdx);
+	bool midInside = grid.cellMids[cellIdx];
+
+	if (overflow && numBeziers > depth) {
+		overflow[0] = numBeziers;
+		for (size_t i = 0; i < numBeziers; i++) {
+			overflow[i + 1] = beziers[i] + kBezierIndexFirstReal;
+		}
+		if ((numBeziers + 1) % 2 != 0) {
+			overflow[numBeziers + 1] = kBezierIndexUnused;
+		}
+
+		data[0] = overflowOffset & 0xFFFF;
+		data[1] = overflowOffset >> 16;
+		data[2] = midInside;
+		data[3] = kBezierIndexSortMeta;
+		return;
+	}
 
 	// Clear texel
 	for (uint8_t i = 0; i < depth; i++) {
@@ -169,39 +384,32 @@ static void write_vgrid_cell_to_buffer(
 	}
 
 	// Write out bezier indices to atlas texel
-	size_t i = 0;
 	//depth is always 4. nBeziers will be from 0-4
-	size_t nbeziers = std::min(beziers->size(), (size_t)depth);
-	auto end = beziers->begin();
-	std::advance(end, nbeziers);
-
-	for (auto it = beziers->begin(); it != end; it++) {
-		// TODO: The uint8_t cast wont overflow because the bezier
-		// limit is checked when loading the glyph. But try to encode
-		// that info into the data types so no cast is needed.
-		data[i] = (uint8_t)(*it) + kBezierIndexFirstReal;
-		i++;
-	}
+	size_t nbeziers = std::min(numBeziers, (size_t)depth);
 
-	bool midInside = grid.cellMids[cellIdx];
+	for (size_t i = 0; i < nbeziers; i++) {
+		// Won't overflow, VGridAtlas::kMaxBeziers is checked when
+		// committing the glyph
+		data[i] = beziers[i] + kBezierIndexFirstReal;
+	}
 
 	// Because the order of beziers doesn't matter and a single bezier is
 	// never referenced twice in one cell, metadata can be stored by
 	// adjusting the order of the bezier indices. In this case, the
 	// midInside bit is 1 if data[0] > data[1].
 	// Note that the bezier indices are already sorted from smallest to
-	// largest because of std::set.
+	// largest, see find_cells_intersections().
 	if (midInside) {
 		// If cell is empty, there's nothing to swap (both values 0).
 		// So a fake "sort meta" value must be used to make data[0]
 		// be larger. This special value is treated as 0 by the shader.
-		if (beziers->size() == 0) {
+		if (numBeziers == 0) {
 			data[0] = kBezierIndexSortMeta;
 		}
 		// If there's just one bezier, data[0] is always > data[1] so
 		// nothing needs to be done. Otherwise, swap data[0] and [1].
-		else if (beziers->size() != 1) {
-			uint8_t tmp = data[0];
+		else if (numBeziers != 1) {
+			uint16_t tmp = data[0];
 			data[0] = data[1];
 			data[1] = tmp;
 		}
@@ -209,16 +417,32 @@ static void write_vgrid_cell_to_buffer(
 		// not happen if there is only 1 bezier in this cell, for the reason
 		// described above. Solve by moving the only bezier into data[1].
 	}
-	else if (beziers->size() == 1) {
+	else if (numBeziers == 1) {
 		data[1] = data[0];
 		data[0] = kBezierIndexUnused;
 	}
 }
 
+size_t VGridAtlas::OverflowSize(VGrid& grid) {
+	size_t texels = 0;
+	for (size_t i = 0; i < grid.cellCounts.size(); i++) {
+		size_t numBeziers = grid.CellSize(i);
+		if (numBeziers > this->depth) {
+			texels += overflow_list_size(numBeziers);
+		}
+	}
+	return texels;
+}
+
 // Writes an entire vgrid into the atlas, where the bottom-left of the vgrid
 // will be written at (atX, atY). It will take up (grid->width, grid->height)
 // atlas texels and overwrite all contents in that rectangle.
-void VGridAtlas::WriteVGridAt(VGrid& grid, uint16_t atX, uint16_t atY) {
+void VGridAtlas::WriteVGridAt(
+	VGrid& grid,
+	uint16_t atX,
+	uint16_t atY,
+	uint8_t* overflow,
+	uint32_t overflowOffset) {
 	// TODO: Write an assert() that can take a format message so the
 	// variables can be printed.
 	assert((atX + grid.width) <= this->width);
@@ -229,17 +453,27 @@ void VGridAtlas::WriteVGridAt(VGrid& grid, uint16_t atX, uint16_t atY) {
 			size_t cellIdx = xy2i(x, y, grid.width);
 			size_t atlasIdx = xy2i(atX + x, atY + y, this->width) * this->depth;
 
-			std::set<size_t>* beziers = &grid.cellBeziers[cellIdx];
-			if (beziers->size() > this->depth) {
+			size_t maxBeziers = overflow ? VGrid::kCellCapacity : this->depth;
+			if (grid.cellCounts[cellIdx] > maxBeziers) {
+				this->truncatedCells++;
 				std::cerr << "WARN: Too many beziers in one grid cell ("
-					<< "max: " << this->depth
-					<< ", need: " << beziers->size()
+					<< "max: " << maxBeziers
+					<< ", need: " << grid.cellCounts[cellIdx]
 					<< ", x: " << x
 					<< ", y: " << y << ")\n";
 			}
 
-			uint8_t* data = &this->data[atlasIdx];
-			write_vgrid_cell_to_buffer(grid, cellIdx, data, this->depth);
+			uint16_t* data = &this->data[atlasIdx];
+			write_vgrid_cell_to_buffer(grid, cellIdx, data, this->depth,
+				(uint16_t*)overflow, overflowOffset);
+
+			size_t numBeziers = grid.CellSize(cellIdx);
+			if (overflow && numBeziers > this->depth) {
+				this->overflowCells++;
+				size_t listSize = overflow_list_size(numBeziers);
+				overflow += listSize * 4;
+				overflowOffset += listSize;
+			}
 		}
 	}
 }
@@ -4,12 +4,29 @@
 #version 330 core
 precision highp float;
 
-#define numSS 4
 #define pi 3.1415926535897932384626433832795
 #define kPixelWindowSize 1.0
 
-uniform sampler2D uGridAtlas;
-uniform samplerBuffer uGlyphData;
+// Rays cast per pixel, at most kMaxSamples. gllabel.cpp defines this for
+// each quality variant of the shader. 0 picks it per glyph from how many
+// pixels the glyph covers, with below kAutoMinPixels getting 2 and below
+// kAutoMidPixels getting 3. A single ray misses too much to be of use, even
+// for tiny text.
+#ifndef kSamples
+#define kSamples 4
+#endif
+#define kMaxSamples 4
+#define kAutoMinPixels 8.0
+#define kAutoMidPixels 24.0
+
+// Pixels of grid information before a glyph's beziers in uGlyphData.
+// Must match kGlyphHeaderPixels in gllabel.cpp.
+#define kGlyphHeaderPixels 4
+
+uniform usampler2DArray uGridAtlas;
+// Two 16 bit ints per texel (RG16UI): bezier points, and the lists of grid
+// cells with too many beziers to fit their texel
+uniform usamplerBuffer uGlyphData;
 
 
 in vec4 oColor;
@@ -19,6 +36,7 @@ flat in uint glyphDataOffset;
 //oGridRect.xy is origin in the grid atlas
 //oGridRect.zw is size of the grid
 flat in ivec4 oGridRect;
+flat in int oGridLayer;
 //float between [0,1] that indicates where it is on the glyph's quad
 in vec2 oNormCoord;
 
@@ -40,21 +58,21 @@ bool almostEqual(float a, float b)
 	return abs(a-b) < 1e-5;
 }
 
-float normalizedUshortFromVec2(vec2 v)
-{
-	return (v.y * 65280.0 + v.x * 255.0) / 65536.0;
-}
-
-vec4 getPixelByOffset(int offset)
+// Reads the 16 bit int at the given index of a list of them starting at
+// texel `offset` of the glyph data, packed two per texel.
+int fetchUshort(int offset, int index)
 {
-	return texelFetch(uGlyphData, offset);
+	uvec2 texel = texelFetch(uGlyphData, int(glyphDataOffset) + offset + index/2).xy;
+	return int((index % 2 == 0) ? texel.x : texel.y);
 }
 
+// Bezier points are stored normalized to the glyph's size, in 16 bit
+// fixed point
 void fetchBezier(int coordIndex, out vec2 p[3])
 {
 	for (int i=0; i<3; i++) {
-		vec4 pixel = getPixelByOffset(int(glyphDataOffset) + 2 + coordIndex*3 + i);
-		p[i] = vec2(normalizedUshortFromVec2(pixel.xy), normalizedUshortFromVec2(pixel.zw)) - oNormCoord;
+		uvec2 point = texelFetch(uGlyphData, int(glyphDataOffset) + kGlyphHeaderPixels + coordIndex*3 + i).xy;
+		p[i] = vec2(point) / 65536.0 - oNormCoord;
 	}
 }
 
@@ -150,22 +168,48 @@ void main()
 	//map normalized size -> pixel size
 	mat2 initrot = inverse(mat2(dFdx(oNormCoord) * kPixelWindowSize, dFdy(oNormCoord) * kPixelWindowSize));
 
+#if kSamples == 0
+	// Pixels along the glyph's longer side
+	vec2 footprint = fwidth(oNormCoord);
+	float glyphPixels = 1.0 / min(footprint.x, footprint.y);
+	int numSS = (glyphPixels < kAutoMinPixels) ? 2 : (glyphPixels < kAutoMidPixels) ? 3 : 4;
+#else
+	const int numSS = kSamples;
+#endif
+
 	// the angle to increment for each sample
 	float theta = pi/float(numSS);
 
 // note this is column major ordering
 	mat2 rotM = mat2(cos(theta), sin(theta), -sin(theta), cos(theta)); 
 
-	//fetch the indices into bezier array and bitshift left twice
-	ivec4 indices1 = ivec4(texelFetch(uGridAtlas, indicesCoord, 0) * 255.0);
+	//fetch the indices into bezier array
+	ivec4 indices1 = ivec4(texelFetch(uGridAtlas, ivec3(indicesCoord, oGridLayer), 0));
 
 	// The mid-inside flag is encoded by the order of the beziers indices.
+	// Cells with more than 4 beziers instead point to a list of them in the
+	// glyph data, and carry the flag separately.
 	// See write_vgrid_cell_to_buffer() for details.
+	bool overflowCell = indices1[3] == 1;
 	bool midInside = indices1[0] > indices1[1];
+	int numIndices = 4;
+	int overflowOffset = 0;
+	if (overflowCell) {
+		midInside = indices1[2] == 1;
+		overflowOffset = indices1[0] + indices1[1] * 65536;
+		numIndices = fetchUshort(overflowOffset, 0);
+	}
+
+	// Cells without any curves are entirely inside or outside the glyph
+	if (!overflowCell && all(lessThan(indices1, ivec4(2)))) {
+		outColor = oColor;
+		outColor.a *= midInside ? 1.0 : 0.0;
+		return;
+	}
 
 	float midClosest = midInside ? -2.0 : 2.0;
 
-	float firstIntersection[numSS];
+	float firstIntersection[kMaxSamples];
 	for (int ss=0; ss<numSS; ss++) {
 		firstIntersection[ss] = 2.0;
 	}
@@ -174,15 +218,14 @@ void main()
 
 	mat2 midTransform = getUnitLineMatrix(oNormCoord, cellMid);
 
-	for (int bezierIndex=0; bezierIndex<4; bezierIndex++) {
+	for (int bezierIndex=0; bezierIndex<numIndices; bezierIndex++) {
 		int coordIndex;
 
-		//if (bezierIndex < 4) {
+		if (!overflowCell) {
 			coordIndex = indices1[bezierIndex];
-		//} else {
-		//	 if (!moreThanFourIndices) break;
-		//	 coordIndex = indices2[bezierIndex-4];
-		//}
+		} else {
+			coordIndex = fetchUshort(overflowOffset, bezierIndex + 1);
+		}
 
 		// Indices 0 and 1 are both "no bezier" -- see
 		// write_vgrid_cell_to_buffer() for why.
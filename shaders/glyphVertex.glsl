@@ -1,37 +1,83 @@
 #version 330 core
-uniform samplerBuffer uGlyphData;
+// The same buffer as the fragment shader's uGlyphData, read four 16 bit
+// ints at a time. Glyphs are aligned to fit: each one's header is the two
+// texels at glyphDataOffset / 2, with the grid's position and size in the
+// grid atlas, then its layer (and an unused int) and the glyph's size in FT
+// units. See write_glyph_data_to_buffer().
+uniform usamplerBuffer uGlyphHeaders;
 uniform mat4 uTransform;
 
+// When set, each vertex picks its transform out of uTransforms (one mat4
+// per four RGBA32F texels) instead of using uTransform. See GLLabelBatch.
+uniform bool uUseTransforms;
+uniform samplerBuffer uTransforms;
+
+// When set, each instance's position is relative to the start of its line,
+// and uLineOffsets has the origin of each line (one RG32F texel per line).
+// See GLLabel::Line.
+uniform bool uUseLineOffsets;
+uniform samplerBuffer uLineOffsets;
+
+// Colors, one RGBA8 texel each. The top 8 bits of vLine, or of
+// vTransformIndex with uUseTransforms, pick the glyph's color out of its
+// label's palette, which in a batch starts at the texel uPaletteBases has
+// for the transform index. The low 24 bits are the line or transform
+// index. See GLLabel::palette and GLLabelBatch::paletteBases.
+uniform samplerBuffer uPalette;
+uniform usamplerBuffer uPaletteBases;
+
+// When set, each instance has its own quad size in vSize, like carets and
+// selections do. Otherwise the quad is the glyph's size.
+uniform bool uUseInstanceSize;
+
+// All per glyph instance. Each glyph is drawn as six vertices, two
+// triangles, covering the glyph's size from vPosition. See GLLabel::Render.
 layout(location = 0) in vec2 vPosition;
-layout(location = 1) in uint vData;
-layout(location = 2) in vec4 vColor;
+layout(location = 1) in uint vGlyphDataOffset;
+layout(location = 3) in uint vTransformIndex;
+layout(location = 4) in uint vLine;
+// Size of the quad in font units, see uUseInstanceSize
+layout(location = 5) in vec2 vSize;
 
 out vec4 oColor;
 flat out uint glyphDataOffset;
 flat out ivec4 oGridRect;
+flat out int oGridLayer;
 out vec2 oNormCoord;
 
-float ushortFromVec2(vec2 v)
+mat4 fetchTransform(uint index)
 {
-	//the vec2 v was a uint16 on cpu memory
-	//the gpu bitshift
-	return (v.y * 65535.0 + v.x * 255.0);
-}
-
-ivec2 vec2FromPixel(uint offset)
-{
-	// RGBA* ->4*8 = 32 bits??
-	vec4 pixel = texelFetch(uGlyphData, int(offset));
-	return ivec2(ushortFromVec2(pixel.xy), ushortFromVec2(pixel.zw));
+	int base = int(index) * 4;
+	return mat4(
+		texelFetch(uTransforms, base),
+		texelFetch(uTransforms, base + 1),
+		texelFetch(uTransforms, base + 2),
+		texelFetch(uTransforms, base + 3));
 }
 
 void main()
 {
-	oColor = vColor;
-	glyphDataOffset = vData >> 2u;
-	oNormCoord = vec2((vData & 2u) >> 1, vData & 1u);
-	oGridRect = ivec4(vec2FromPixel(glyphDataOffset), vec2FromPixel(glyphDataOffset + 1u));
+	uint indexAndColor = uUseTransforms ? vTransformIndex : vLine;
+	uint index = indexAndColor & 0xFFFFFFu;
+	uint color = indexAndColor >> 24u;
+	uint paletteBase = uUseTransforms ? texelFetch(uPaletteBases, int(index)).x : 0u;
+	oColor = texelFetch(uPalette, int(paletteBase + color));
+	glyphDataOffset = vGlyphDataOffset;
+
+	// Corners 0,1,2 then 2,1,3 (bottom-left, bottom-right, top-left, top-right)
+	int corner = (gl_VertexID < 4) ? gl_VertexID : 6 - gl_VertexID;
+	oNormCoord = vec2(corner & 1, corner >> 1);
+	int header = int(glyphDataOffset / 2u);
+	uvec4 gridRect = texelFetch(uGlyphHeaders, header);
+	uvec4 layerAndSize = texelFetch(uGlyphHeaders, header + 1);
+	vec2 glyphSize = uUseInstanceSize ? vSize : vec2(layerAndSize.zw);
+
 	//oGridRect.xy is origin in the grid atlas
 	//oGridRect.zw is size of the grid
-	gl_Position = uTransform*vec4(vPosition, 0.0, 1.0);
+	//oGridLayer is which layer of the grid atlas holds the grid
+	oGridRect = ivec4(gridRect);
+	oGridLayer = int(layerAndSize.x);
+	mat4 transform = uUseTransforms ? fetchTransform(index) : uTransform;
+	vec2 origin = uUseLineOffsets ? vPosition + texelFetch(uLineOffsets, int(index)).xy : vPosition;
+	gl_Position = transform*vec4(origin + oNormCoord * glyphSize, 0.0, 1.0);
 }
\ No newline at end of file
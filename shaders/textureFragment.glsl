@@ -0,0 +1,13 @@
+#version 330 core
+
+// Premultiplied alpha
+uniform sampler2D uTexture;
+
+in vec2 oTexCoord;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+	outColor = texture(uTexture, oTexCoord);
+}
@@ -0,0 +1,16 @@
+#version 330 core
+uniform mat4 uTransform;
+
+// Where the texture's (0, 0) and (1, 1) corners go, in xy and zw, before
+// uTransform. See GLFontManager::DrawTexture.
+uniform vec4 uRect;
+
+out vec2 oTexCoord;
+
+void main()
+{
+	// Corners 0,1,2 then 2,1,3, like in glyphVertex.glsl
+	int corner = (gl_VertexID < 4) ? gl_VertexID : 6 - gl_VertexID;
+	oTexCoord = vec2(corner & 1, corner >> 1);
+	gl_Position = uTransform*vec4(mix(uRect.xy, uRect.zw, oTexCoord), 0.0, 1.0);
+}
@@ -0,0 +1,117 @@
+/*
+ * Bakes the glyphs of some fonts into an atlas file, which
+ * GLFontManager::LoadAtlas() can load instead of preparing the glyphs from
+ * the fonts at startup. Each font gets ASCII, plus every character of the
+ * text files given with -t.
+ *
+ * Usage: bake_atlas <output> [-t <text file>]... <font file>...
+ *
+ * Font paths are stored as given, and only match the same path passed to
+ * GLFontManager::GetFontFromPath() later.
+ */
+
+#include <gllabel.hpp>
+#include <glfw3.h>
+#include <codecvt>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <locale>
+#include <string>
+#include <vector>
+
+static std::u32string readTextFile(const std::string &path, bool *ok)
+{
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		*ok = false;
+		return std::u32string();
+	}
+	std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> cv;
+	*ok = true;
+	return cv.from_bytes(text);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3) {
+		std::cerr << "Usage: " << argv[0] << " <output> [-t <text file>]... <font file>...\n";
+		return 1;
+	}
+
+	std::u32string text;
+	std::vector<std::string> fontPaths;
+	for (int i = 2; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "-t" && i + 1 < argc) {
+			bool ok;
+			text += readTextFile(argv[++i], &ok);
+			if (!ok) {
+				std::cerr << "Failed to read " << argv[i] << "\n";
+				return 1;
+			}
+		}
+		else {
+			fontPaths.push_back(arg);
+		}
+	}
+
+	// The manager needs a GL context, even though nothing gets drawn
+	if (!glfwInit()) {
+		std::cerr << "Failed to initialize GLFW.\n";
+		return 1;
+	}
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	GLFWwindow *window = glfwCreateWindow(1, 1, "bake_atlas", NULL, NULL);
+	if (!window) {
+		std::cerr << "Failed to create GLFW window.\n";
+		glfwTerminate();
+		return 1;
+	}
+	glfwMakeContextCurrent(window);
+	glewExperimental = true;
+	if (glewInit() != GLEW_OK) {
+		std::cerr << "Failed to initialize GLEW.\n";
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return 1;
+	}
+
+	int status = 0;
+	{
+		std::shared_ptr<GLFontManager> manager = GLFontManager::GetFontManager();
+		for (size_t i = 0; i < fontPaths.size() && status == 0; i++) {
+			FT_Face face = manager->GetFontFromPath(fontPaths[i]);
+			if (!face) {
+				std::cerr << "Failed to load font " << fontPaths[i] << "\n";
+				status = 1;
+				continue;
+			}
+			manager->LoadASCII(face);
+			for (size_t j = 0; j < text.size(); j++) {
+				manager->GetGlyphForCodepoint(face, text[j]);
+			}
+		}
+		// Labels draw selections with it
+		manager->GetSolidGlyph();
+
+		if (status == 0) {
+			if (manager->SaveAtlas(argv[1])) {
+				std::cout << "Baked " << manager->GetGlyphCacheStats().size << " glyphs into " << argv[1] << "\n";
+			}
+			else {
+				status = 1;
+			}
+		}
+		GLFontManager::singleton = nullptr;
+	}
+
+	glfwDestroyWindow(window);
+	glfwTerminate();
+	return status;
+}
@@ -0,0 +1,374 @@
+/*
+ * Draws a fixed set of glyphs at several sizes and rotations, and compares
+ * the images against golden ones rendered by a known good build, so changes
+ * to the grids, the curve conversion or the shaders can't change what gets
+ * drawn without anyone noticing.
+ *
+ * Usage: render_check [-u] [-t <tolerance>] [-a <prefix>] <golden dir> <font file>...
+ *
+ * -u writes the golden images instead of comparing against them. A pixel
+ * differs when any of its channels is off by more than the tolerance (8 by
+ * default), which leaves room for GPUs that round differently. A case fails
+ * if any pixel differs, and its image is then written next to the golden one
+ * as <case>.actual.ppm. -a writes the grid atlases to <prefix><group>.bmp
+ * once everything is drawn.
+ *
+ * Drawing goes to an offscreen framebuffer of a hidden window, like
+ * bench_labels. Results are printed as one JSON object per line: the
+ * beziers and grid cell overflows of each glyph, then how each case compared
+ * and its GPU time, then whether a glyph that can't be committed is queued
+ * on the worker threads only once. Exits with 1 if any check failed.
+ */
+
+#include <gllabel.hpp>
+#include <glfw3.h>
+#include <glm/gtx/transform.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const int kImageSize = 384;
+static const int kWarmupFrames = 2;
+static const int kFrames = 20;
+
+// Straight and curved strokes, dots, accents, and pairs that kern or touch
+static const char32_t *kCorpus =
+	U"ABCDEFGHIJKLM\n"
+	U"NOPQRSTUVWXYZ\n"
+	U"abcdefghijklm\n"
+	U"nopqrstuvwxyz\n"
+	U"0123456789 !\"#$\n"
+	U"%&'()*+,-./:;<=>\n"
+	U"?@[\\]^_`{|}~\n"
+	U"fi ffl WAVE\n"
+	U"\u00c0\u00c7\u00e9\u00df\u00f1\u00f8\u00e6 \u00a9\u00ae\u00bd\u00b6";
+
+// Few enough glyphs for the biggest size to show whole
+static const char32_t *kLargeCorpus = U"Ag&\n@\u00df%";
+
+static const float kPixelSizes[] = {12, 32, 96}; // Per em
+static const float kRotations[] = {0, 30, 90}; // Degrees, counterclockwise
+
+struct Image
+{
+	int width, height;
+	std::vector<uint8_t> rgb; // Top row first
+};
+
+static bool readPPM(const std::string &path, Image &image)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) {
+		return false;
+	}
+	int maxValue = 0;
+	bool ok = fscanf(f, "P6 %d %d %d", &image.width, &image.height, &maxValue) == 3
+		&& maxValue == 255 && image.width > 0 && image.height > 0 && fgetc(f) != EOF;
+	if (ok) {
+		image.rgb.resize((size_t)image.width * image.height * 3);
+		ok = fread(&image.rgb[0], image.rgb.size(), 1, f) == 1;
+	}
+	fclose(f);
+	return ok;
+}
+
+static bool writePPM(const std::string &path, const Image &image)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f) {
+		return false;
+	}
+	fprintf(f, "P6\n%d %d\n255\n", image.width, image.height);
+	bool ok = fwrite(&image.rgb[0], image.rgb.size(), 1, f) == 1;
+	return fclose(f) == 0 && ok;
+}
+
+static Image readFramebuffer()
+{
+	Image image{kImageSize, kImageSize, std::vector<uint8_t>()};
+	std::vector<uint8_t> rgba((size_t)kImageSize * kImageSize * 4);
+	glReadPixels(0, 0, kImageSize, kImageSize, GL_RGBA, GL_UNSIGNED_BYTE, &rgba[0]);
+	image.rgb.resize((size_t)kImageSize * kImageSize * 3);
+	for (int y = 0; y < kImageSize; y++) {
+		const uint8_t *row = &rgba[(size_t)(kImageSize - 1 - y) * kImageSize * 4];
+		for (int x = 0; x < kImageSize; x++) {
+			memcpy(&image.rgb[((size_t)y * kImageSize + x) * 3], &row[x * 4], 3);
+		}
+	}
+	return image;
+}
+
+static std::string fontName(const std::string &path)
+{
+	size_t start = path.find_last_of('/');
+	start = (start == std::string::npos) ? 0 : start + 1;
+	size_t end = path.find_last_of('.');
+	if (end == std::string::npos || end < start) {
+		end = path.size();
+	}
+	return path.substr(start, end - start);
+}
+
+// Commits each glyph on its own, so the manager's counters tell what went
+// into it
+static void checkGlyphs(GLFontManager *manager, FT_Face face, const std::string &name)
+{
+	std::set<char32_t> points;
+	for (const char32_t *text : {kCorpus, kLargeCorpus}) {
+		for (const char32_t *c = text; *c; c++) {
+			if (*c != U'\n') {
+				points.insert(*c);
+			}
+		}
+	}
+
+	for (char32_t point : points) {
+		GLFontManager::Stats before = manager->GetStats();
+		manager->GetGlyphForCodepoint(face, point);
+		GLFontManager::Stats after = manager->GetStats();
+		std::cout << "{\"check\": \"glyph\", \"font\": \"" << name
+			<< "\", \"point\": " << (uint32_t)point
+			<< ", \"beziers\": " << after.committedBeziers - before.committedBeziers
+			<< ", \"overflow_cells\": " << after.overflowCells - before.overflowCells
+			<< ", \"truncated_cells\": " << after.truncatedCells - before.truncatedCells << "}\n";
+	}
+}
+
+// Loads a glyph, missing from the corpus, asynchronously into a manager with
+// no room for it, and checks that a label waiting on it queues it only once
+// however many times it updates. Returns whether it did.
+static bool checkFailedGlyph(std::shared_ptr<GLFontManager> manager, FT_Face face, const std::string &name)
+{
+	const char32_t point = U'\u00fe';
+	size_t maxGlyphDataSize = manager->maxGlyphDataSize;
+	manager->maxGlyphDataSize = 0;
+
+	GLFontManager::Stats before = manager->GetStats();
+	GLLabel label(manager);
+	label.SetAsyncGlyphLoading(true);
+	label.SetText(std::u32string(1, point), glm::vec4(0, 0, 0, 1), face);
+	for (int i = 0; i < 1000 && manager->IsGlyphPending(face, point); i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		label.Update();
+	}
+	for (int frame = 0; frame < 10; frame++) {
+		label.Update();
+	}
+	GLFontManager::Stats after = manager->GetStats();
+	manager->maxGlyphDataSize = maxGlyphDataSize;
+
+	uint64_t queued = after.glyphsQueued - before.glyphsQueued;
+	uint64_t failed = after.glyphsFailed - before.glyphsFailed;
+	bool pass = queued == 1 && failed == 1;
+	std::cout << "{\"check\": \"failed_glyph\", \"font\": \"" << name
+		<< "\", \"point\": " << (uint32_t)point
+		<< ", \"queued\": " << queued
+		<< ", \"failed\": " << failed
+		<< ", \"pass\": " << (pass ? "true" : "false") << "}\n";
+	return pass;
+}
+
+// Draws one case, and returns its median GPU time per frame
+static double drawCase(GLLabel &label, const glm::mat4 &transform)
+{
+	std::vector<GLuint> queries(kFrames);
+	glGenQueries(kFrames, &queries[0]);
+	for (int frame = 0; frame < kWarmupFrames + kFrames; frame++) {
+		int measured = frame - kWarmupFrames;
+		glClear(GL_COLOR_BUFFER_BIT);
+		if (measured >= 0) {
+			glBeginQuery(GL_TIME_ELAPSED, queries[measured]);
+		}
+		label.Render(0, transform);
+		if (measured >= 0) {
+			glEndQuery(GL_TIME_ELAPSED);
+		}
+	}
+	glFinish();
+
+	std::vector<double> gpuMs;
+	for (int i = 0; i < kFrames; i++) {
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &ns);
+		gpuMs.push_back(ns / 1e6);
+	}
+	glDeleteQueries(kFrames, &queries[0]);
+	std::sort(gpuMs.begin(), gpuMs.end());
+	return gpuMs[gpuMs.size() / 2];
+}
+
+// Runs every case of one font, and returns how many failed
+static int checkFont(std::shared_ptr<GLFontManager> manager, FT_Face face, const std::string &name,
+	const std::string &goldenDir, bool update, int tolerance)
+{
+	int failed = 0;
+	for (float pixelSize : kPixelSizes) {
+		std::u32string text = (pixelSize > 50) ? kLargeCorpus : kCorpus;
+		GLLabel label(manager);
+		label.SetText(text, glm::vec4(0, 0, 0, 1), face);
+
+		// The text turns around the middle of its lines, which is put in the
+		// middle of the image, so as little as possible falls outside of it
+		const std::vector<LayoutGlyph> &layout = manager->GetLayout(face, text);
+		float right = 0, bottom = 0;
+		for (size_t i = 0; i < layout.size(); i++) {
+			right = std::max(right, layout[i].x);
+			bottom = std::min(bottom, layout[i].y + face->descender);
+		}
+		glm::vec3 middle(right / 2, (bottom + face->ascender) / 2, 0);
+
+		for (float rotation : kRotations) {
+			float scale = pixelSize / face->units_per_EM;
+			glm::mat4 m(1.0);
+			m = glm::scale(m, glm::vec3(2.0f / kImageSize, 2.0f / kImageSize, 1));
+			m = glm::rotate(m, glm::radians(rotation), glm::vec3(0, 0, 1));
+			m = glm::scale(m, glm::vec3(scale, scale, 1));
+			m = glm::translate(m, -middle);
+
+			double gpuMs = drawCase(label, m);
+			Image image = readFramebuffer();
+
+			char caseName[256];
+			snprintf(caseName, sizeof(caseName), "%s_%gpx_%gdeg", name.c_str(), pixelSize, rotation);
+			std::string goldenPath = goldenDir + "/" + caseName + ".ppm";
+
+			std::cout << "{\"check\": \"render\", \"case\": \"" << caseName
+				<< "\", \"gpu_median_ms\": " << gpuMs;
+			if (update) {
+				bool written = writePPM(goldenPath, image);
+				std::cout << ", \"written\": " << (written ? "true" : "false") << "}\n";
+				failed += !written;
+				continue;
+			}
+
+			Image golden;
+			if (!readPPM(goldenPath, golden) || golden.width != image.width || golden.height != image.height) {
+				std::cout << ", \"pass\": false, \"error\": \"no golden image of this size\"}\n";
+				failed++;
+				continue;
+			}
+			size_t differing = 0;
+			int maxDiff = 0;
+			for (size_t i = 0; i < image.rgb.size(); i += 3) {
+				int diff = 0;
+				for (size_t c = 0; c < 3; c++) {
+					diff = std::max(diff, std::abs(image.rgb[i + c] - golden.rgb[i + c]));
+				}
+				maxDiff = std::max(maxDiff, diff);
+				differing += diff > tolerance;
+			}
+			bool pass = differing == 0;
+			std::cout << ", \"differing_pixels\": " << differing
+				<< ", \"max_diff\": " << maxDiff
+				<< ", \"pass\": " << (pass ? "true" : "false") << "}\n";
+			if (!pass) {
+				writePPM(goldenDir + "/" + caseName + ".actual.ppm", image);
+				failed++;
+			}
+		}
+	}
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	bool update = false;
+	int tolerance = 8;
+	std::string atlasPrefix;
+	std::string goldenDir;
+	std::vector<std::string> fontPaths;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "-u") {
+			update = true;
+		}
+		else if (arg == "-t" && i + 1 < argc) {
+			tolerance = atoi(argv[++i]);
+		}
+		else if (arg == "-a" && i + 1 < argc) {
+			atlasPrefix = argv[++i];
+		}
+		else if (goldenDir.empty()) {
+			goldenDir = arg;
+		}
+		else {
+			fontPaths.push_back(arg);
+		}
+	}
+	if (goldenDir.empty() || fontPaths.empty()) {
+		std::cerr << "Usage: " << argv[0]
+			<< " [-u] [-t <tolerance>] [-a <prefix>] <golden dir> <font file>...\n";
+		return 1;
+	}
+
+	if (!glfwInit()) {
+		std::cerr << "Failed to initialize GLFW.\n";
+		return 1;
+	}
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	GLFWwindow *window = glfwCreateWindow(1, 1, "render_check", NULL, NULL);
+	if (!window) {
+		std::cerr << "Failed to create GLFW window.\n";
+		glfwTerminate();
+		return 1;
+	}
+	glfwMakeContextCurrent(window);
+	glewExperimental = true;
+	if (glewInit() != GLEW_OK) {
+		std::cerr << "Failed to initialize GLEW.\n";
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return 1;
+	}
+
+	GLuint framebuffer, colorBuffer;
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glGenRenderbuffers(1, &colorBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, kImageSize, kImageSize);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+	glViewport(0, 0, kImageSize, kImageSize);
+	glClearColor(1, 1, 1, 1);
+	// Labels enable blending, but leave the function to the app, like the demo
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	int failed = 0;
+	{
+		std::shared_ptr<GLFontManager> manager = GLFontManager::GetFontManager();
+		for (const std::string &path : fontPaths) {
+			FT_Face face = manager->GetFontFromPath(path);
+			if (!face) {
+				std::cerr << "Failed to load font " << path << "\n";
+				failed++;
+				continue;
+			}
+			std::string name = fontName(path);
+			checkGlyphs(manager.get(), face, name);
+			failed += checkFont(manager, face, name, goldenDir, update, tolerance);
+			failed += !checkFailedGlyph(manager, face, name);
+		}
+		if (!atlasPrefix.empty()) {
+			manager->WriteAtlasBMPs(atlasPrefix);
+		}
+		GLFontManager::singleton = nullptr;
+	}
+
+	glDeleteRenderbuffers(1, &colorBuffer);
+	glDeleteFramebuffers(1, &framebuffer);
+	glfwDestroyWindow(window);
+	glfwTerminate();
+	return failed > 0;
+}